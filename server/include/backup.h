@@ -0,0 +1,16 @@
+#ifndef BACKUP_H
+#define BACKUP_H
+
+/* Online backups into --backup-dir, made with SQLite's backup API by one
+ * background thread. Each step copies BACKUP_STEP_PAGES pages while
+ * holding the lock of the connection it reads from, then the thread
+ * sleeps BACKUP_YIELD_MS so writers queued on that lock go first. */
+#define BACKUP_STEP_PAGES 64
+#define BACKUP_YIELD_MS 10
+#define BACKUP_NAME_LEN 64
+
+void backup_start(void);
+int backup_request(const char *name, const char *requester, char *err, int err_size);
+void backup_status(int sock);
+
+#endif
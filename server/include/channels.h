@@ -0,0 +1,20 @@
+#ifndef CHANNELS_H
+#define CHANNELS_H
+
+#include "server.h"
+#include <stdint.h>
+
+#define MAX_CHANNELS 64
+/* channel names start with '#' and share the users table for storage */
+#define CHANNEL_PREFIX '#'
+#define CHANNEL_HISTORY_DEFAULT 20
+
+int channel_join(const char *channel, int sock, int persist);
+int channel_leave(const char *channel, int sock);
+void channel_drop_slot(int slot);
+void channel_post(const char *from, int sock, const char *channel, const char *msg);
+void channel_list(int sock);
+int channel_is_member(const char *channel, int sock);
+int channel_name_valid(const char *name);
+
+#endif
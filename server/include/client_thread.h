@@ -3,8 +3,60 @@
 #define CLIENT_THREAD_H
 
 #include <pthread.h>
+#include <sys/types.h>
 #include "server.h"
+#include "timer.h"
+#include "compress.h"
+#include "ratelimit.h"
+#include "netio.h"
+#include "messaging.h"
+
+/* everything one session owns: socket, identity, chat state, deadlines and
+ * its input buffer and optional output compression. Allocated from a slab when the connection starts (or is
+ * handed over during a hot upgrade, resumed = 1) and freed when it ends. */
+typedef struct conn {
+    int sock;
+    int resumed;
+    char username[USERNAME_LEN];
+    client_chat_state_t state;
+    wheel_timer_t idle_timer;
+    wheel_timer_t ping_timer;
+    zout_t zout;
+    unsigned rec_session;       /* capture session number, 0 = not recorded */
+    char inbuf[BUF_SIZE];
+    int started;                /* session_begin() ran (event backends) */
+    int in_login;               /* waiting for the login line (event backends) */
+    bigmsg_t big;               /* bigchat payload still coming (event backends) */
+    char *carry;                /* input handed over by the previous process */
+    size_t carry_len, carry_off;
+    char *carry_out;            /* output the previous process had not sent */
+    size_t carry_out_len;
+    netio_conn_t io;            /* input and output queues, event backends only */
+} conn_t;
+
+/* a session received in a hot upgrade (upgrade.c) */
+typedef struct {
+    int sock;
+    char username[USERNAME_LEN];
+    client_chat_state_t state;
+    char *input;                /* malloc'd unread input, or NULL */
+    size_t input_len;
+    char *output;               /* malloc'd unsent output, or NULL */
+    size_t output_len;
+} resumed_session_t;
 
 void *client_thread(void *arg);
+ssize_t session_recv(int sock, void *buf, size_t len);
+void session_send_bulk(int sock, const char *data, size_t len);
+int session_count(void);
+int session_room_for(int sock);
+int start_client_thread(int sock);
+int start_resumed_sessions(resumed_session_t *s, int n);
+void session_step(conn_t *conn);
+void session_free(conn_t *conn);
+void session_freeze_init(void);
+void session_wait_readable(int fd);
+int session_freeze(int timeout_ms);
+void session_thaw(void);
 
 #endif
@@ -2,15 +2,25 @@
 #define CLIENTS_H
 
 #include "server.h"
+#include <stddef.h>
 
-int add_client(int sock, const char *username);
+int add_client(int sock, const char *username, client_chat_state_t *state);
 void remove_client_by_sock(int sock);
+int client_slot(int sock, unsigned *gen);
+int find_sock_by_user_id(int user_id);
 int find_sock_by_username(const char *username);
 int user_exists(const char *username);
 void send_to_sock(int sock, const char *msg);
+void send_buf_to_sock(int sock, const char *data, size_t len);
+int send_buf_to_slot(int slot, unsigned gen, int sock, const char *data, size_t len);
+int send_frame_to_sock(int sock, const char *header, const void *payload, size_t len);
+/* send_file_to_sock frames files in pieces of this many bytes */
+#define SENDFILE_PIECE (64 * 1024)
+int send_file_to_sock(int sock, int fd, size_t len);
+int try_send_to_sock(int sock, const char *msg);
 
 void handle_getuserlist(int requester_sock);
 void broadcast_shutdown_and_close_all();
-void get_all_users(char *out, size_t out_size);
+int get_online_users(char names[][USERNAME_LEN]);
 
 #endif
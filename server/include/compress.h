@@ -0,0 +1,29 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <zlib.h>
+
+/* responses shorter than this are always sent as plain text */
+#define COMPRESS_MIN_BYTES 256
+/* fast levels already shrink chat history ~10x; higher ones cost CPU for little */
+#define COMPRESS_LEVEL 4
+/* 8 KiB window and a small hash: ~48 KiB of deflate state per connection
+ * instead of zlib's default 256 KiB */
+#define COMPRESS_WINDOW_BITS 13
+#define COMPRESS_MEM_LEVEL 5
+
+/* one deflate stream per connection, kept across responses so repeated
+ * names and prefixes from earlier output are matched too. Each response is
+ * sent as "ZLIB <n>\n" followed by n bytes ending on a sync flush: the
+ * client feeds every frame to one inflate context and gets whole text. */
+typedef struct {
+    int on;
+    z_stream zs;
+} zout_t;
+
+int zout_start(zout_t *z);
+void zout_end(zout_t *z);
+int zout_send(zout_t *z, int sock, const char *data, size_t len);
+
+#endif
@@ -1,11 +1,93 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 #include <stddef.h>   // for size_t
+#include "lockprof.h"
+#include "server.h"
 
+#define SEARCH_DEFAULT_LIMIT 20
+#define SEARCH_MAX_LIMIT 100
+/* search pages reach at most this many results deep; each shard returns
+ * every row up to the end of the page */
+#define SEARCH_MAX_DEPTH (10 * SEARCH_MAX_LIMIT)
+
+/* resume tokens are hex strings; a resume returns at most this many rows */
+#define RESUME_TOKEN_LEN 32
+#define RESUME_MAX_MESSAGES 500
+
+/* un-acked messages resent at login (or by "redeliver") per response */
+#define REDELIVER_MAX_MESSAGES 500
+/* most <user> <seq> pairs in one ack line */
+#define ACK_MAX_PAIRS 32
+
+/* Every conversation numbers its messages 1, 2, 3... in insert order.
+ * The next number for a new row between SQL parameters a and b; both
+ * directions are looked up separately so each is one index probe. */
+#define MESSAGE_NEXT_SEQ(a, b) \
+    "1 + max(coalesce((SELECT max(seq) FROM messages WHERE sender_id = " a " AND receiver_id = " b "), 0), " \
+    "coalesce((SELECT max(seq) FROM messages WHERE sender_id = " b " AND receiver_id = " a "), 0))"
+
+/* "export": transcripts are written EXPORT_CHUNK messages per shard lock
+ * hold, and the newest EXPORT_CACHE_ENTRIES are kept for reuse */
+#define EXPORT_CHUNK 1000
+#define EXPORT_CACHE_ENTRIES 8
+
+/* history responses are sent in batches of about this many bytes, and
+ * hold at most the newest HISTORY_MAX_ROWS messages */
+#define HISTORY_BATCH_BYTES 32768
+#define HISTORY_MAX_ROWS 2000
+
+/* --storage profiles: journal mode, synchronous, cache, mmap and page
+ * size for every connection the server opens (see db_tune) */
+typedef enum {
+    STORAGE_DURABLE = 0,        /* SQLite's defaults: rollback journal, fsync every commit */
+    STORAGE_BALANCED,
+    STORAGE_THROUGHPUT
+} storage_profile_t;
+
+/* --warmup reads the newest WARMUP_ROWS messages of each shard, and the
+ * index entries of their conversations, WARMUP_CHUNK rows per lock hold */
+#define WARMUP_ROWS 20000
+#define WARMUP_CHUNK 500
+#define WARMUP_YIELD_MS 2
+
+/* open bounds for history time ranges (epoch seconds) */
+#define HISTORY_NO_LIMIT_LOW  0LL
+#define HISTORY_NO_LIMIT_HIGH 0x7fffffffffffffffLL
+
+int storage_parse(const char *name);
+const char *storage_name(void);
+void db_tune(sqlite3 *d, int wal);
 void init_database(const char *filename);
-void store_message(const char *sender, const char *receiver, const char *text);
-void handle_getmessages_db_and_send(const char *requester, int requester_sock, const char *target);
+void db_warmup_start(void);
+#define db_lock_acquire() db_lock_acquire_at(LOCKPROF_SITE("db_lock"))
+void db_lock_acquire_at(lockprof_site_t *site);
+void close_database(void);
+long long store_message(const char *sender, const char *receiver, const char *text, long long *seq);
+void handle_history_db_and_send(const char *requester, int requester_sock,
+                                const char *const *partners, int npartners,
+                                long long since, long long until);
+void handle_getmessages_db_and_send(const char *requester, int requester_sock, const char *target,
+                                    long long since, long long until);
 void handle_deletemessages_db(const char *user_a, const char *user_b, int requester_sock);
+void handle_search_db_and_send(const char *requester, int requester_sock, const char *text,
+                               const char *with, int limit, int page);
+void handle_channel_history_db_and_send(const char *channel, int sock, int limit);
+int handle_chatrooms_db_and_send(const char *username, int sock);
 void get_messages_for_user(const char *username, char *out, size_t out_size);
 
+long long big_message_begin(const char *sender, const char *receiver, long long size, long long *seq);
+int big_message_write(long long id, const void *data, int n, long long offset);
+int big_message_read(long long id, void *buf, int n, long long offset);
+void big_message_abort(long long id);
+int big_message_info(long long id, const char *requester, char *from, char *to, long long *size,
+                     long long *seq);
+
+int session_issue_token(const char *username, char *out);
+int session_check_token(const char *username, const char *token);
+void handle_resume_db_and_send(const char *username, int sock, long long last_id);
+
+int acks_store(const char *username, char partners[][USERNAME_LEN], const long long *seqs, int n);
+void handle_redeliver_db_and_send(const char *username, int sock, int at_login);
+void handle_export_db_and_send(const char *requester, int sock, const char *target, int jsonl);
+
 #endif
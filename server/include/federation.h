@@ -0,0 +1,27 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include "server.h"
+#include "utils.h"
+
+/* cluster mode: persistent TCP links to other server instances */
+#define MAX_PEERS 8
+#define FED_BATCH_BYTES 65536       /* most bytes written to a link in one send */
+#define FED_MAX_UNACKED 10000       /* forwarded messages queued per link */
+#define FED_RETRY_MS 2000           /* reconnect delay for outbound links */
+#define FED_ACK_EVERY 1000          /* received messages per ack while busy */
+#define MAX_ALLOWED_ADDRS 32        /* resolved addresses allowed on the peer port */
+
+int fed_add_peer(const char *spec);
+int fed_allow_peer(const char *host);
+void fed_start(void);
+int fed_enabled(void);
+
+void fed_presence(const char *username, int online);
+int fed_user_is_remote(const char *username);
+int fed_remote_users(char names[][USERNAME_LEN], int max);
+void fed_list_remote(strbuf_t *out);
+int fed_forward(const char *from, const char *to, const char *text);
+void fed_report(int sock);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <pthread.h>
+
+/* Contention profiler for the shared locks. Each LOCK()/UNLOCK() call
+ * site gets a static record of how long threads waited for the lock there
+ * and how long they held it, as totals and log2 histograms. Recording is
+ * off until lockprof_enable(); a disabled acquire costs one flag test on
+ * top of the mutex. Build with -DLOCKPROF=0 to compile it out entirely. */
+
+#ifndef LOCKPROF
+#define LOCKPROF 1
+#endif
+
+/* bucket i counts times in [2^i, 2^(i+1)) microseconds; 0 also takes < 1us */
+#define LOCKPROF_BUCKETS 20
+
+typedef struct lockprof_site {
+    const char *lock;
+    const char *func;
+    int line;
+    int registered;
+    struct lockprof_site *next;
+    unsigned long acquires;
+    unsigned long contended;
+    unsigned long long wait_ns;
+    unsigned long long wait_max_ns;
+    unsigned long long hold_ns;
+    unsigned long long hold_max_ns;
+    unsigned long wait_hist[LOCKPROF_BUCKETS];
+    unsigned long hold_hist[LOCKPROF_BUCKETS];
+} lockprof_site_t;
+
+#if LOCKPROF
+#define LOCKPROF_SITE(name) \
+    ({ static lockprof_site_t site_ = { (name), __func__, __LINE__, 0, 0, 0, 0, 0, 0, 0, 0, {0}, {0} }; &site_; })
+#define LOCK(m)   lockprof_acquire(&(m), LOCKPROF_SITE(#m))
+#define UNLOCK(m) lockprof_release(&(m))
+#else
+#define LOCKPROF_SITE(name) ((lockprof_site_t *)0)
+#define LOCK(m)   lockprof_acquire(&(m), 0)
+#define UNLOCK(m) pthread_mutex_unlock(&(m))
+#endif
+
+long long lockprof_acquire(pthread_mutex_t *m, lockprof_site_t *site);
+void lockprof_release(pthread_mutex_t *m);
+void lockprof_enable(int on);
+void lockprof_reset(void);
+void lockprof_report(int sock, int top);
+
+#endif
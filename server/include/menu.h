@@ -3,12 +3,18 @@
 
 #include "server.h"  // <-- add this so client_chat_state_t is known
 
+/* Menus never read the socket themselves: each entry point shows its
+ * screen and sets state->menu, and every later line of input is handed
+ * to menu_input() until the step returns to MENU_NONE. */
 void handle_menu_chatrooms(const char *username, int sock, client_chat_state_t *state);
 void handle_menu(const char *username, int sock, client_chat_state_t *state);
-void menu_start_open_chat(const char *username, int sock);
+void menu_start_open_chat(const char *username, int sock, client_chat_state_t *state);
 void menu_start_closed_chat(const char *username, int sock, client_chat_state_t *state);
 void menu_start_semiclosed_chat(const char *username, int sock, client_chat_state_t *state);
 void menu_view_users(int sock);
 void menu_view_messages(const char *username, int sock, client_chat_state_t *state);
 
+void menu_input(const char *username, int sock, client_chat_state_t *state, char *line);
+int menu_takes_text(const client_chat_state_t *state);
+
 #endif
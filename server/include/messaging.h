@@ -1,8 +1,30 @@
 #ifndef MESSAGING_H
 #define MESSAGING_H
 
+#include "server.h"
+#include <stddef.h>
+
 void broadcast_message(const char *sender, const char *msg);
 void send_private_message(const char *sender, const char *receiver, const char *msg);
-void send_to_user(const char *from, const char *to, const char *message);
+long long send_to_user(const char *from, const char *to, const char *message, long long *seq,
+                       int *unforwarded);
+int send_to_room(const char *from, char members[][USERNAME_LEN], int count, const char *message,
+                 int *unstored);
+/* a large message being received (bigchat), see messaging.c */
+typedef struct {
+    long long id;               /* 0 = no transfer */
+    long long seq, size, done;
+    int sock, peer;             /* sender; recipient here, or -1 */
+    char from[USERNAME_LEN], to[USERNAME_LEN];
+} bigmsg_t;
+
+int bigchat_begin(const char *from, int sock, const char *to, long long size,
+                  size_t early, bigmsg_t *bm);
+size_t bigchat_want(const bigmsg_t *bm);
+void bigchat_data(bigmsg_t *bm, const char *data, size_t n);
+void bigchat_abort(bigmsg_t *bm);
+void handle_bigchat(const char *from, int sock, const char *to, long long size,
+                    const char *early, size_t early_len);
+void handle_getbig(const char *requester, int sock, long long id);
 
 #endif
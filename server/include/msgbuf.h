@@ -0,0 +1,22 @@
+#ifndef MSGBUF_H
+#define MSGBUF_H
+
+#include <stddef.h>
+
+/* pooled buffer holding one formatted outgoing message. A message is
+ * formatted once and the same buffer is sent to every recipient. Sends
+ * complete before they return, so the formatting caller is the only owner
+ * and msgbuf_free() returns the buffer to its size-class pool; there is no
+ * refcount because nothing queues a buffer past the call that sent it. */
+typedef struct msgbuf {
+    int cls;        /* pool index, -1 = plain malloc (oversized) */
+    size_t len;
+    size_t cap;
+    char data[];
+} msgbuf_t;
+
+msgbuf_t *msgbuf_alloc(size_t cap);
+msgbuf_t *msgbuf_format(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void msgbuf_free(msgbuf_t *mb);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef NETIO_H
+#define NETIO_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "timer.h"
+#include "utils.h"
+
+/* Network backends (--io). "threads" is the original model: a blocking
+ * accept() loop and one thread per connection blocked in recv(). With
+ * "epoll" or "uring" one I/O thread accepts, reads and writes every
+ * socket: input is queued on the connection for a small worker pool,
+ * which runs a session only while it has input, and replies are queued
+ * on the connection for the I/O thread to send. */
+typedef enum {
+    IO_THREADS = 0,
+    IO_EPOLL,
+    IO_URING
+} io_backend_t;
+
+#define NETIO_MAX_QUEUED 65536      /* unread input per connection before reads pause */
+#define NETIO_MAX_OUTPUT (2 << 20)  /* unsent output per connection, see netio_send() */
+#define NETIO_URING_ENTRIES 256
+#define NETIO_URING_BUFS 256        /* provided receive buffers, a power of two */
+#define NETIO_URING_BUF_SIZE 4096
+
+struct conn;
+
+/* input and output queues of one connection, embedded in conn_t */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *buf;                  /* queued input, buf[off..len) unread */
+    size_t off, len, cap;
+    int eof;                    /* peer closed or the socket was shut down */
+    int waiting;                /* the session is blocked in netio_read() */
+    int scheduled;              /* queued for or running on a worker */
+    int paused;                 /* reads stopped until the queue drains */
+    int done;                   /* the session has ended */
+    pthread_cond_t out_cond;
+    char *out;                  /* output not yet taken by the I/O thread */
+    size_t out_len, out_cap;
+    size_t out_queued;          /* output not yet sent, including the taken part */
+    int out_failed;             /* the socket failed or stalled: output is dropped */
+    int out_waiting;            /* threads waiting in netio_send() / netio_direct_begin() */
+    int flushing;               /* the I/O thread has output to send */
+    int direct;                 /* a netio_direct_begin() writer owns the socket */
+    /* owned by the I/O thread */
+    int armed;                  /* registered with epoll / a receive in flight */
+    int closing;                /* ended, freed once nothing is read or sent */
+    char *sending;              /* taken output, sending[send_off..send_len) unsent */
+    size_t send_off, send_len, send_cap;
+    int send_inflight;          /* io_uring: a send is outstanding */
+    unsigned events;            /* epoll: what the socket is registered for */
+    wheel_timer_t stall;        /* --write-timeout while output waits on the peer */
+    int stalling;
+    struct conn *run_next;      /* under the run queue lock */
+    struct conn *notify_next;   /* under the notify lock */
+    int notify_queued;
+    struct conn *all_prev, *all_next;   /* every attached connection, I/O thread */
+} netio_conn_t;
+
+int netio_parse(const char *name);
+const char *netio_name(void);
+void netio_init(void);
+int netio_evented(void);
+
+void netio_attach(struct conn *conn);
+void netio_start(struct conn *conn);
+void netio_run(int listen_fd);
+ssize_t netio_read(struct conn *conn, void *buf, size_t len);
+int netio_park(struct conn *conn);
+void netio_release(struct conn *conn);
+int netio_send(int sock, const void *a, size_t alen, const void *b, size_t blen);
+int netio_direct_begin(int sock);
+void netio_direct_end(int sock);
+int netio_freeze(int timeout_ms);
+void netio_thaw(void);
+size_t netio_pending(int sock, const char **data);
+void netio_pending_output(int sock, strbuf_t *sb);
+
+#endif
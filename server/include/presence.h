@@ -0,0 +1,12 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+/* changes arriving within this window are sent to subscribers as one line */
+#define PRESENCE_COALESCE_MS 250
+
+void presence_start(void);
+void presence_changed(const char *username, int online);
+int presence_subscribe(int sock);
+void presence_unsubscribe(int sock);
+
+#endif
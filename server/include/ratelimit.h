@@ -0,0 +1,49 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+/* commands are rate limited per user in three classes */
+typedef enum {
+    RL_CHAT,     /* Chat, channel posts and closed-chat lines */
+    RL_QUERY,    /* the expensive ones: history, search, sync, large messages, deletes */
+    RL_OTHER,    /* everything else */
+    RL_NCLASSES
+} rl_class_t;
+
+/* refill `rate` tokens per second up to `burst`; rate 0 = unlimited */
+typedef struct {
+    double rate;
+    double burst;
+} rl_limit_t;
+
+typedef struct {
+    double tokens;
+    double last;        /* monotonic seconds of the last refill, 0 = never */
+} rl_bucket_t;
+
+/* shed queries once requests wait this long for db_lock on average */
+#define DEFAULT_OVERLOAD_MS 200
+/* how long a query waits for the overload to clear before it is refused */
+#define OVERLOAD_DEFER_MS 50
+
+extern rl_limit_t rl_limits[RL_NCLASSES];
+
+int rl_parse(const char *spec);
+rl_class_t rl_class_of(const char *cmd);
+const char *rl_class_name(rl_class_t c);
+long rl_take(int user_id, rl_class_t c);
+
+void overload_note_db_wait(long long ns);
+int overload_active(void);
+
+/* counters reported by the `stats` command */
+typedef enum {
+    STAT_RATE_LIMITED,
+    STAT_SHED,
+    STAT_REFUSED,
+    STAT_NCOUNTERS
+} stat_counter_t;
+
+void stat_inc(stat_counter_t c);
+void stats_send(int sock);
+
+#endif
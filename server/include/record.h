@@ -0,0 +1,29 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Traffic capture (--record <file>), read back by tools/replay.
+ * File: the 8-byte magic, then records of
+ *     u8  type        REC_OPEN, REC_CMD or REC_CLOSE
+ *     u32 session     connection number within the capture
+ *     u32 ms          milliseconds since the capture started
+ *     u16 len         payload length
+ *     len bytes       OPEN: the (anonymized) login line, CMD: the command
+ * all little-endian. Users become u<id>, channels #h<hash>, and message
+ * bodies and any other free text x's of the same length, so a capture
+ * keeps the command mix and message sizes but no content. */
+
+#define REC_MAGIC "CHATREC1"
+#define REC_HEADER_SIZE 11
+
+enum { REC_OPEN = 1, REC_CMD = 2, REC_CLOSE = 3 };
+
+int record_open(const char *path);
+void record_close(void);
+unsigned record_session_start(const char *username);
+void record_command(unsigned session, const char *line, size_t len, int free_text);
+void record_session_end(unsigned session);
+
+#endif
@@ -9,7 +9,42 @@
 #define USERNAME_LEN 32
 #define MAX_ROOM_USERS 5
 
+/* connection deadlines in seconds, overridable on the command line */
+#define DEFAULT_LOGIN_TIMEOUT 30
+#define DEFAULT_IDLE_TIMEOUT 900
+#define DEFAULT_WRITE_TIMEOUT 15
+#define DEFAULT_PING_INTERVAL 120
+
+/* large messages (bigchat) are streamed in chunks of BIG_CHUNK_SIZE bytes */
+#define DEFAULT_MAX_MESSAGE_SIZE (1 << 20)
+#define BIG_CHUNK_SIZE 16384
+
+/* command-line configuration (defined in main.c) */
+typedef struct {
+    int port;
+    const char *dbfile;
+    const char *upgrade_sock;   /* unix socket for hot upgrades, NULL = disabled */
+    int takeover;               /* start by taking over from a running server */
+    int login_timeout;          /* seconds to send the login line, 0 = none */
+    int idle_timeout;           /* seconds without input before disconnect, 0 = none */
+    int write_timeout;          /* seconds a blocked send may stall, 0 = none */
+    int ping_interval;          /* seconds of silence before a PING, 0 = none */
+    long long max_message_size; /* largest bigchat payload accepted, in bytes */
+    int overload_ms;            /* db_lock wait that starts shedding queries, 0 = never */
+    int lock_profile;           /* record lock contention from startup */
+    const char *record_file;    /* traffic capture, NULL = not recording */
+    const char *node_name;      /* cluster node name, NULL = node-<port> */
+    int peer_port;              /* accept peer links here, 0 = don't listen */
+    int shards;                 /* message shards in a store directory, 0 = one file */
+    int io_backend;             /* io_backend_t, see netio.h */
+    const char *backup_dir;     /* where "backup" writes, NULL = backups off */
+    int backup_every;           /* seconds between scheduled backups, 0 = none */
+    int storage_profile;        /* storage_profile_t, see database.h */
+    int warmup;                 /* preload recent history after startup */
+} server_config_t;
+
 /* global state (defined in main.c) */
+extern server_config_t config;
 extern int server_fd;
 extern int running;
 extern sqlite3 *db;
@@ -22,17 +57,37 @@ typedef enum {
     SEMI_CLOSED_CHAT
 } chat_mode_t;
 
+/* where a session is in the interactive menus (menu.c). Each step waits
+ * for the next input line; MENU_NONE is the normal command loop. */
+typedef enum {
+    MENU_NONE = 0,
+    MENU_ROOMS,                 /* chat-room list: select/back/listusers/help */
+    MENU_MAIN,                  /* numbered main menu */
+    MENU_OPEN_CHAT,             /* every line is broadcast until /exit */
+    MENU_CLOSED_ASK,            /* waiting for the closed-chat partner */
+    MENU_CLOSED_CHAT,           /* lines go to menu_partner until /exit */
+    MENU_ROOM_ASK,              /* waiting for the semi-closed room members */
+    MENU_ROOM_CHAT              /* lines go to room_partners until /exit */
+} menu_step_t;
+
 typedef struct {
     chat_mode_t mode;
     char chat_partner[USERNAME_LEN];
     char room_partners[MAX_ROOM_USERS][USERNAME_LEN];
     int room_size;
+    menu_step_t menu;
+    menu_step_t menu_return;    /* MENU_ROOMS or MENU_MAIN, shown again after a menu chat */
+    chat_mode_t menu_prev_mode; /* restored when a semi-closed room ends */
+    char menu_partner[USERNAME_LEN];
 } client_chat_state_t;
 
 typedef struct {
     int sock;
+    int user_id;                 /* interned id, see users.h */
     char username[USERNAME_LEN];
     int active;
+    unsigned gen;                /* bumped each time the slot is taken */
+    client_chat_state_t *state;  /* owned by the session thread */
 } client_t;
 
 extern client_t clients[MAX_CLIENTS];
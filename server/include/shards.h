@@ -0,0 +1,52 @@
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include <pthread.h>
+#include <sqlite3.h>
+#include "lockprof.h"
+
+/* Messages live in one or more shards. Unsharded, shard 0 is the main
+ * database itself (`db`, guarded by db_lock). With --shards N the database
+ * argument is a directory: users, sessions and the partner summary stay in
+ * main.db and messages are spread over shard-<i>.db by conversation. */
+#define MAX_SHARDS 64
+#define SHARD_MAIN_FILE "main.db"
+
+typedef struct shard_insert shard_insert_t;
+
+typedef struct {
+    sqlite3 *db;                /* queries and rare writes, under `lock` */
+    pthread_mutex_t *lock;      /* &db_lock when unsharded */
+    pthread_mutex_t own_lock;
+    sqlite3 *wdb;               /* writer thread's connection, NULL when unsharded */
+    sqlite3_stmt *insert_stmt;  /* the writer's cached insert */
+    pthread_mutex_t qlock;      /* insert queue */
+    pthread_cond_t qcond;       /* work for the writer */
+    pthread_cond_t done_cond;   /* a batch was committed */
+    shard_insert_t *qhead, *qtail;
+    pthread_t writer;
+    int stopping;               /* shards_close: drain the queue and exit */
+} shard_t;
+
+extern shard_t shards[MAX_SHARDS];
+extern int nshards;
+
+void shards_init_single(void);
+void shards_open(const char *dir, int n, void (*prepare)(sqlite3 *d));
+void shards_reseed(void);
+void shards_close(void);
+
+int shard_of(int key_a, int key_b);
+unsigned long long shard_mask_all(void);
+
+#define shard_lock(s) shard_lock_at((s), LOCKPROF_SITE("shard_lock"))
+void shard_lock_at(shard_t *s, lockprof_site_t *site);
+void shard_unlock(shard_t *s);
+
+long long shard_store(shard_t *s, int sender_id, int receiver_id, const char *text, long long ts,
+                      long long *seq);
+long long shard_id_begin(void);
+void shard_id_end(long long id);
+long long shard_id_watermark(void);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* fixed-size object allocator. Objects are carved from chunks of
+ * `per_chunk` objects and recycled through a free list; chunks are kept
+ * for the life of the process, so steady-state alloc/free never reaches
+ * malloc. */
+typedef struct {
+    pthread_mutex_t lock;
+    size_t obj_size;
+    size_t per_chunk;
+    void *free_list;
+    size_t in_use;
+    size_t total;
+} slab_t;
+
+#define SLAB_INITIALIZER(type_size, chunk) \
+    { PTHREAD_MUTEX_INITIALIZER, (type_size), (chunk), NULL, 0, 0 }
+
+void *slab_alloc(slab_t *s);
+void slab_free(slab_t *s, void *obj);
+
+#endif
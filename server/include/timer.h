@@ -0,0 +1,27 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+/* hierarchical timer wheel driven by one ticker thread.
+ * Timers are intrusive: the owner embeds a wheel_timer_t (on its stack or in
+ * its session struct) and arms/cancels it in O(1). Callbacks run on the
+ * ticker thread without the wheel lock held, so they may re-arm timers
+ * (but must not cancel their own).
+ * timer_cancel() waits for a running callback of that timer to finish, so a
+ * timer may be freed as soon as timer_cancel() returns. */
+
+#define TIMER_TICK_MS 100
+
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer *prev;
+    unsigned long long expires;   /* absolute tick */
+    void (*fn)(void *arg);
+    void *arg;
+} wheel_timer_t;
+
+void timers_start(void);
+void timer_init(wheel_timer_t *t, void (*fn)(void *arg), void *arg);
+void timer_arm(wheel_timer_t *t, unsigned long ms);
+void timer_cancel(wheel_timer_t *t);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Sampled latency tracing. One command in every `trace_sample_every` is
+ * traced: its dispatch becomes a root span and every TRACE_BEGIN/TRACE_END
+ * pair it passes through (send_to_user, store_message, lookups, sends)
+ * becomes a child span. Spans go to a per-thread ring without locks shared
+ * between threads; "trace dump" exports them as Chrome trace_event JSON
+ * (chrome://tracing, Perfetto). An untraced command pays one thread-local
+ * test per span. */
+
+#define TRACE_RING_EVENTS 1024
+#define TRACE_MAX_THREADS 64
+
+typedef struct {
+    long long start_us;
+} trace_span_t;
+
+extern int trace_sample_every;          /* 0 = tracing off */
+extern __thread long long trace_current; /* id of the traced command, 0 = none */
+
+#define TRACE_BEGIN(sp) do { if (trace_current) trace_begin(sp); } while (0)
+#define TRACE_END(sp, name) do { if (trace_current) trace_end(sp, name); } while (0)
+
+int trace_command_start(trace_span_t *root);
+void trace_command_end(trace_span_t *root, const char *cmd);
+void trace_begin(trace_span_t *sp);
+void trace_end(trace_span_t *sp, const char *name);
+void trace_record(const char *name, long long start_us, long long dur_us);
+long long trace_now_us(void);
+void trace_dump(int sock);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/* zero-downtime restart: the running process listens on a unix socket and,
+ * when a new binary connects, hands it server_fd and every logged-in client
+ * socket (SCM_RIGHTS) together with their session state, then exits. */
+void upgrade_listen(const char *path);
+int upgrade_takeover(const char *path);
+
+#endif
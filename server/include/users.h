@@ -0,0 +1,19 @@
+#ifndef USERS_H
+#define USERS_H
+
+/* interned usernames: every name the server has seen maps to a compact
+ * integer id (users.id in the database). ids are never reused and names
+ * returned by user_name() stay valid for the life of the process.
+ * 0 means "no such user". */
+void users_load(void);
+int user_intern(const char *name);
+int user_lookup(const char *name);
+const char *user_name(int id);
+
+/* names given with --admin: they may run "backup <name>", switch or
+ * reset the profilers and dump traces. Set while parsing arguments, read-only afterwards. */
+#define MAX_ADMINS 8
+int user_add_admin(const char *name);
+int user_is_admin(const char *name);
+
+#endif
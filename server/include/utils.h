@@ -2,8 +2,22 @@
 #define UTILS_H
 
 #include "server.h"
+#include <stddef.h>
+
+/* growable byte buffer for responses assembled before a single send */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} strbuf_t;
+
+void sb_init(strbuf_t *sb);
+int sb_append(strbuf_t *sb, const char *data, size_t len);
+int sb_appendf(strbuf_t *sb, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void sb_free(strbuf_t *sb);
 
 void trim_whitespace(char *s);
+int parse_timestamp(const char *s, long long *out);
 void send_help(int sock, client_chat_state_t *state);
 
 #endif
@@ -0,0 +1,324 @@
+#include "backup.h"
+#include "server.h"
+#include "shards.h"
+#include "clients.h"
+#include "logging.h"
+#include "lockprof.h"
+#include "users.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* "backup <name>" (or the --backup-every schedule) writes
+ * <backup-dir>/<name>: a copy of the database file, or with --shards a
+ * directory holding every shard and then main.db. Each file is written as
+ * <file>.part and renamed when complete.
+ *
+ * A step reads through the connection the server already uses for that
+ * file, under its lock. In a single-file store every write goes through
+ * `db` too, so SQLite patches the copy as it goes. Shard writers use
+ * their own connection, and a commit there makes SQLite start that file
+ * over; each restart doubles the step size so a busy shard still
+ * finishes. Only one backup runs at a time. */
+
+typedef struct {
+    int running;
+    int finished;               /* a backup has completed, ok or not */
+    int ok;
+    char name[BACKUP_NAME_LEN];
+    char pending[BACKUP_NAME_LEN];          /* requested, not started yet */
+    char requester[USERNAME_LEN];           /* "" for the schedule */
+    char pending_requester[USERNAME_LEN];
+    char error[160];
+    char file[32];              /* file being copied */
+    int file_index, nfiles;
+    long long pages_done, pages_total;      /* of the current file */
+    long long pages_files;      /* of the files already finished */
+    unsigned long steps, restarts;
+    long long pause_total_us, pause_max_us;
+    long long started_ms, elapsed_ms;
+} backup_state_t;
+
+static pthread_mutex_t backup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backup_cond = PTHREAD_COND_INITIALIZER;
+static backup_state_t st;
+static time_t next_due;
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void set_error(const char *what, const char *detail) {
+    pthread_mutex_lock(&backup_lock);
+    snprintf(st.error, sizeof(st.error), "%s: %s", what, detail);
+    pthread_mutex_unlock(&backup_lock);
+}
+
+static int sync_file(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    int ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+/* copies one database through `src` into `path` */
+static int backup_file(sqlite3 *src, pthread_mutex_t *lock, const char *path, const char *label) {
+    char part[4096];
+    snprintf(part, sizeof(part), "%s.part", path);
+    unlink(part);
+
+    sqlite3 *dst = NULL;
+    if (sqlite3_open(part, &dst) != SQLITE_OK) {
+        set_error(label, sqlite3_errmsg(dst));
+        sqlite3_close(dst);
+        return 0;
+    }
+    /* the last step commits the copy while holding the lock; the fsync
+     * happens after it instead, before the rename */
+    sqlite3_exec(dst, "PRAGMA synchronous = OFF;", NULL, NULL, NULL);
+
+    lockprof_acquire(lock, LOCKPROF_SITE("backup"));
+    sqlite3_backup *b = sqlite3_backup_init(dst, "main", src, "main");
+    lockprof_release(lock);
+    if (!b) {
+        set_error(label, sqlite3_errmsg(dst));
+        sqlite3_close(dst);
+        unlink(part);
+        return 0;
+    }
+
+    int pages = BACKUP_STEP_PAGES;
+    int expected = 0;
+    int rc;
+    do {
+        lockprof_acquire(lock, LOCKPROF_SITE("backup"));
+        long long t0 = now_us();
+        rc = sqlite3_backup_step(b, pages);
+        int remaining = sqlite3_backup_remaining(b);
+        int total = sqlite3_backup_pagecount(b);
+        long long held = now_us() - t0;
+        lockprof_release(lock);
+
+        /* fewer pages copied than this step should have reached means
+         * another connection wrote and SQLite started the file over
+         * (growth adds to total and remaining alike) */
+        int restarted = rc == SQLITE_OK && total - remaining < expected;
+        if (restarted && pages < (1 << 20)) pages *= 2;
+        expected = total - remaining + pages;
+
+        pthread_mutex_lock(&backup_lock);
+        st.steps++;
+        st.restarts += restarted;
+        st.pause_total_us += held;
+        if (held > st.pause_max_us) st.pause_max_us = held;
+        st.pages_done = total - remaining;
+        st.pages_total = total;
+        pthread_mutex_unlock(&backup_lock);
+
+        if (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED)
+            usleep(BACKUP_YIELD_MS * 1000);
+    } while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+
+    rc = sqlite3_backup_finish(b);
+    if (rc != SQLITE_OK) set_error(label, sqlite3_errmsg(dst));
+    if (sqlite3_close(dst) != SQLITE_OK && rc == SQLITE_OK) {
+        set_error(label, "close failed");
+        rc = SQLITE_ERROR;
+    }
+    if (rc == SQLITE_OK && !sync_file(part)) {
+        set_error(label, strerror(errno));
+        rc = SQLITE_ERROR;
+    }
+    if (rc == SQLITE_OK && rename(part, path) != 0) {
+        set_error(label, strerror(errno));
+        rc = SQLITE_ERROR;
+    }
+    if (rc != SQLITE_OK) {
+        unlink(part);
+        return 0;
+    }
+    pthread_mutex_lock(&backup_lock);
+    st.pages_files += st.pages_total;
+    pthread_mutex_unlock(&backup_lock);
+    return 1;
+}
+
+static void begin_file(int index, const char *file) {
+    pthread_mutex_lock(&backup_lock);
+    st.file_index = index;
+    snprintf(st.file, sizeof(st.file), "%s", file);
+    st.pages_done = st.pages_total = 0;
+    pthread_mutex_unlock(&backup_lock);
+}
+
+static int run_backup(const char *name) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", config.backup_dir, name);
+    if (!config.shards) {
+        begin_file(0, name);
+        return backup_file(db, &db_lock, path, name);
+    }
+
+    /* shards before main.db, so every user a copied message names is in
+     * the copied main.db */
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+        set_error(name, strerror(errno));
+        return 0;
+    }
+    char file[32], fpath[4096 + 32];
+    for (int i = 0; i < nshards; i++) {
+        snprintf(file, sizeof(file), "shard-%d.db", i);
+        snprintf(fpath, sizeof(fpath), "%s/%s", path, file);
+        begin_file(i, file);
+        if (!backup_file(shards[i].db, shards[i].lock, fpath, file)) return 0;
+    }
+    snprintf(fpath, sizeof(fpath), "%s/%s", path, SHARD_MAIN_FILE);
+    begin_file(nshards, SHARD_MAIN_FILE);
+    return backup_file(db, &db_lock, fpath, SHARD_MAIN_FILE);
+}
+
+/* under backup_lock */
+static void format_status(char *out, size_t size) {
+    long long avg = st.steps ? st.pause_total_us / (long long)st.steps : 0;
+    if (st.running) {
+        int pct = st.pages_total ? (int)(100 * st.pages_done / st.pages_total) : 0;
+        snprintf(out, size,
+                 "BACKUP running %s file %d/%d %s %d%% of %lld pages, steps=%lu restarts=%lu "
+                 "pause avg=%lldus max=%lldus elapsed=%lldms\n",
+                 st.name, st.file_index + 1, st.nfiles, st.file, pct, st.pages_total, st.steps,
+                 st.restarts, avg, st.pause_max_us, now_us() / 1000 - st.started_ms);
+    } else if (!st.finished) {
+        snprintf(out, size, "BACKUP idle\n");
+    } else if (st.ok) {
+        snprintf(out, size,
+                 "BACKUP done %s files=%d pages=%lld steps=%lu restarts=%lu "
+                 "pause avg=%lldus max=%lldus elapsed=%lldms\n",
+                 st.name, st.nfiles, st.pages_files, st.steps, st.restarts, avg, st.pause_max_us,
+                 st.elapsed_ms);
+    } else {
+        snprintf(out, size, "BACKUP failed %s (%s) after %lldms\n", st.name, st.error, st.elapsed_ms);
+    }
+}
+
+static void *backup_thread(void *arg) {
+    (void)arg;
+    char line[512];
+    pthread_mutex_lock(&backup_lock);
+    for (;;) {
+        while (!st.pending[0]) {
+            if (config.backup_every <= 0) {
+                pthread_cond_wait(&backup_cond, &backup_lock);
+                continue;
+            }
+            struct timespec until = { next_due, 0 };
+            pthread_cond_timedwait(&backup_cond, &backup_lock, &until);
+            if (!st.pending[0] && time(NULL) >= next_due) {
+                snprintf(st.pending, sizeof(st.pending), "%s", config.shards ? "auto" : "auto.db");
+                st.pending_requester[0] = '\0';
+            }
+        }
+
+        char name[BACKUP_NAME_LEN];
+        snprintf(name, sizeof(name), "%s", st.pending);
+        snprintf(st.name, sizeof(st.name), "%s", name);
+        snprintf(st.requester, sizeof(st.requester), "%s", st.pending_requester);
+        st.pending[0] = '\0';
+        st.error[0] = '\0';
+        st.nfiles = config.shards ? nshards + 1 : 1;
+        st.pages_done = st.pages_total = st.pages_files = 0;
+        st.steps = st.restarts = 0;
+        st.pause_total_us = st.pause_max_us = 0;
+        st.running = 1;
+        st.started_ms = now_us() / 1000;
+        pthread_mutex_unlock(&backup_lock);
+
+        log_info("Backup %s started.", name);
+        int ok = run_backup(name);
+
+        pthread_mutex_lock(&backup_lock);
+        st.running = 0;
+        st.finished = 1;
+        st.ok = ok;
+        st.elapsed_ms = now_us() / 1000 - st.started_ms;
+        if (config.backup_every > 0) next_due = time(NULL) + config.backup_every;
+        format_status(line, sizeof(line));
+        char requester[USERNAME_LEN];
+        snprintf(requester, sizeof(requester), "%s", st.requester);
+        pthread_mutex_unlock(&backup_lock);
+
+        line[strcspn(line, "\n")] = '\0';
+        log_info("%s", line);
+        if (requester[0]) {
+            int sock = find_sock_by_username(requester);
+            if (sock > 0) {
+                strcat(line, "\n");
+                send_to_sock(sock, line);
+            }
+        }
+        pthread_mutex_lock(&backup_lock);
+    }
+    return NULL;
+}
+
+void backup_start(void) {
+    if (!config.backup_dir) return;
+    if (mkdir(config.backup_dir, 0700) != 0 && errno != EEXIST) die("backup dir");
+    next_due = time(NULL) + config.backup_every;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, backup_thread, NULL) != 0) die("pthread_create");
+    pthread_detach(tid);
+    if (config.backup_every > 0)
+        log_info("Backups go to %s, every %d s.", config.backup_dir, config.backup_every);
+}
+
+/* names stay inside the backup directory */
+static int valid_name(const char *name) {
+    size_t n = strlen(name);
+    if (n == 0 || n >= BACKUP_NAME_LEN || name[0] == '.') return 0;
+    return strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-") == n;
+}
+
+/* queues a backup; 0 with a reason in `err` if it can't. Each backup is a
+ * full copy under a new name, so only admins may start one: anyone else
+ * could fill the disk. */
+int backup_request(const char *name, const char *requester, char *err, int err_size) {
+    if (!config.backup_dir) {
+        snprintf(err, err_size, "backups are off (start the server with --backup-dir)");
+        return 0;
+    }
+    if (!user_is_admin(requester)) {
+        snprintf(err, err_size, "only admins may start backups (--admin)");
+        return 0;
+    }
+    if (!valid_name(name)) {
+        snprintf(err, err_size, "backup name must be letters, digits, '.', '_' or '-'");
+        return 0;
+    }
+    pthread_mutex_lock(&backup_lock);
+    if (st.running || st.pending[0]) {
+        pthread_mutex_unlock(&backup_lock);
+        snprintf(err, err_size, "a backup is already running");
+        return 0;
+    }
+    snprintf(st.pending, sizeof(st.pending), "%s", name);
+    snprintf(st.pending_requester, sizeof(st.pending_requester), "%s", requester);
+    pthread_cond_signal(&backup_cond);
+    pthread_mutex_unlock(&backup_lock);
+    return 1;
+}
+
+void backup_status(int sock) {
+    char line[512];
+    pthread_mutex_lock(&backup_lock);
+    format_status(line, sizeof(line));
+    pthread_mutex_unlock(&backup_lock);
+    send_to_sock(sock, line);
+}
@@ -0,0 +1,177 @@
+#include "channels.h"
+#include "clients.h"
+#include "database.h"
+#include "msgbuf.h"
+#include "utils.h"
+#include "users.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Named channels. Membership is a bitset over clients[] slots, so joining,
+ * leaving and testing are one bit each, and a post walks only the set bits.
+ * A post copies the member sockets under channels_lock, then sends one
+ * shared payload with no lock held; each send checks the slot generation
+ * so a socket closed and reused meanwhile is skipped. A session leaves
+ * every channel when
+ * it disconnects (channel_drop_slot, called under clients_lock before the
+ * slot is freed), so a reused slot never inherits membership.
+ * Lock order: clients_lock, then channels_lock. */
+
+#define CHANNEL_WORDS ((MAX_CLIENTS + 63) / 64)
+
+typedef struct {
+    int in_use;
+    int persist;                /* posts are stored and readable with chanhistory */
+    int members;
+    char name[USERNAME_LEN];
+    uint64_t bits[CHANNEL_WORDS];
+} channel_t;
+
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+static channel_t channels[MAX_CHANNELS];
+static int slot_sock[MAX_CLIENTS];   /* socket of each member slot */
+static unsigned slot_gen[MAX_CLIENTS];  /* its clients[] generation */
+
+int channel_name_valid(const char *name) {
+    size_t n = strlen(name);
+    if (n < 2 || n >= USERNAME_LEN || name[0] != CHANNEL_PREFIX) return 0;
+    for (size_t i = 1; i < n; i++)
+        if (name[i] == ' ' || name[i] == ',' || name[i] == CHANNEL_PREFIX) return 0;
+    return 1;
+}
+
+static channel_t *find_locked(const char *name) {
+    for (int i = 0; i < MAX_CHANNELS; i++)
+        if (channels[i].in_use && strcmp(channels[i].name, name) == 0) return &channels[i];
+    return NULL;
+}
+
+static int bit_test(const channel_t *c, int slot) {
+    return (c->bits[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void bit_clear(channel_t *c, int slot) {
+    if (!bit_test(c, slot)) return;
+    c->bits[slot / 64] &= ~(1ULL << (slot % 64));
+    if (--c->members == 0) c->in_use = 0;
+}
+
+/* creates the channel on first join; `persist` only applies then. A
+ * channel with stored messages is always recreated persistent, so a
+ * later join without "persist" does not silently stop storing posts.
+ * Returns 1 joined, 0 already a member, -1 not logged in or no room. */
+int channel_join(const char *channel, int sock, int persist) {
+    unsigned gen;
+    int slot = client_slot(sock, &gen);
+    if (slot < 0) return -1;
+    /* stored posts intern the channel name */
+    if (!persist && user_lookup(channel)) persist = 1;
+
+    pthread_mutex_lock(&channels_lock);
+    channel_t *c = find_locked(channel);
+    if (!c) {
+        for (int i = 0; i < MAX_CHANNELS && !c; i++) {
+            if (!channels[i].in_use) {
+                c = &channels[i];
+                memset(c, 0, sizeof(*c));
+                c->in_use = 1;
+                c->persist = persist;
+                snprintf(c->name, USERNAME_LEN, "%s", channel);
+            }
+        }
+    }
+    int rc = -1;
+    if (c) {
+        rc = !bit_test(c, slot);
+        if (rc) {
+            c->bits[slot / 64] |= 1ULL << (slot % 64);
+            c->members++;
+        }
+        slot_sock[slot] = sock;
+        slot_gen[slot] = gen;
+    }
+    pthread_mutex_unlock(&channels_lock);
+    return rc;
+}
+
+/* returns 1 if the session was a member */
+int channel_leave(const char *channel, int sock) {
+    int slot = client_slot(sock, NULL);
+    if (slot < 0) return 0;
+
+    pthread_mutex_lock(&channels_lock);
+    channel_t *c = find_locked(channel);
+    int was = c && bit_test(c, slot);
+    if (was) bit_clear(c, slot);
+    pthread_mutex_unlock(&channels_lock);
+    return was;
+}
+
+void channel_drop_slot(int slot) {
+    pthread_mutex_lock(&channels_lock);
+    for (int i = 0; i < MAX_CHANNELS; i++)
+        if (channels[i].in_use) bit_clear(&channels[i], slot);
+    slot_sock[slot] = 0;
+    pthread_mutex_unlock(&channels_lock);
+}
+
+int channel_is_member(const char *channel, int sock) {
+    int slot = client_slot(sock, NULL);
+    if (slot < 0) return 0;
+    pthread_mutex_lock(&channels_lock);
+    channel_t *c = find_locked(channel);
+    int member = c && bit_test(c, slot);
+    pthread_mutex_unlock(&channels_lock);
+    return member;
+}
+
+void channel_post(const char *from, int sock, const char *channel, const char *msg) {
+    int slot = client_slot(sock, NULL);
+    int slots[MAX_CLIENTS], socks[MAX_CLIENTS];
+    unsigned gens[MAX_CLIENTS];
+    int n = 0;
+    int persist = 0;
+
+    pthread_mutex_lock(&channels_lock);
+    channel_t *c = find_locked(channel);
+    if (!c || slot < 0 || !bit_test(c, slot)) {
+        pthread_mutex_unlock(&channels_lock);
+        send_to_sock(sock, "ERROR: join the channel first\n");
+        return;
+    }
+    persist = c->persist;
+    for (int w = 0; w < CHANNEL_WORDS; w++) {
+        for (uint64_t bits = c->bits[w]; bits; bits &= bits - 1)
+            slots[n++] = w * 64 + __builtin_ctzll(bits);
+    }
+    for (int i = 0; i < n; i++) {
+        socks[i] = slot_sock[slots[i]];
+        gens[i] = slot_gen[slots[i]];
+    }
+    pthread_mutex_unlock(&channels_lock);
+
+    long long id = persist ? store_message(from, channel, msg, NULL) : 0;
+    msgbuf_t *mb = id ? msgbuf_format("#%lld [%s] %s: %s\n", id, channel, from, msg)
+                      : msgbuf_format("[%s] %s: %s\n", channel, from, msg);
+    if (!mb) return;
+    for (int i = 0; i < n; i++)
+        send_buf_to_slot(slots[i], gens[i], socks[i], mb->data, mb->len);
+    msgbuf_free(mb);
+}
+
+void channel_list(int sock) {
+    strbuf_t out;
+    sb_init(&out);
+    pthread_mutex_lock(&channels_lock);
+    for (int i = 0; i < MAX_CHANNELS; i++) {
+        if (channels[i].in_use)
+            sb_appendf(&out, "%s (%d member%s%s)\n", channels[i].name, channels[i].members,
+                       channels[i].members == 1 ? "" : "s", channels[i].persist ? ", stored" : "");
+    }
+    pthread_mutex_unlock(&channels_lock);
+    if (out.len == 0) sb_appendf(&out, "(no channels)\n");
+    send_buf_to_sock(sock, out.data, out.len);
+    sb_free(&out);
+}
@@ -6,59 +6,290 @@
 #include "menu.h"
 #include "logging.h"
 #include "client_thread.h"
+#include "timer.h"
+#include "slab.h"
+#include "presence.h"
+#include "channels.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "record.h"
+#include "federation.h"
+#include "netio.h"
+#include "backup.h"
+#include "users.h"
 
+#include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <stdint.h>       // intptr_t
 #include <string.h>       // strlen(), memset()
 #include <unistd.h>       // close()
 #include <stdio.h>        // snprintf(), printf()
+#include <time.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>   // recv(), send(), accept()
 #include <netinet/in.h>   // sockaddr_in
 #include <arpa/inet.h>    // htons(), inet_ntoa
 
 
-void *client_thread(void *arg) {
-    int sock = *(int *)arg;
-    free(arg);
+/* session the calling thread is serving, for session_recv() */
+static __thread conn_t *current_conn = NULL;
+
+/* connection objects come from a slab: no malloc per accept */
+static slab_t conn_slab = SLAB_INITIALIZER(sizeof(conn_t), 16);
+
+/* Hot upgrade (upgrade.c): while frozen, readers park instead of reading so
+ * no input is consumed by a process that is handing its sockets over.
+ * freeze_fd is an eventfd that stays readable while frozen; it exists only
+ * with --upgrade-sock, so other servers read without the extra poll(). */
+static int freeze_fd = -1;
+static pthread_mutex_t freeze_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t freeze_cond = PTHREAD_COND_INITIALIZER;
+static int frozen, nparked;
+
+/* deadline callbacks run on the timer thread: never block there. Shutting
+ * the socket down wakes the session thread's recv(), which then cleans up
+ * through its normal exit path. With an event backend the reason is only
+ * queued, so just the read side is shut and the I/O thread still sends it. */
+static void drop_connection(int sock, const char *reason) {
+    try_send_to_sock(sock, reason);
+    shutdown(sock, netio_evented() ? SHUT_RD : SHUT_RDWR);
+}
+
+static void login_deadline(void *arg) {
+    drop_connection((int)(intptr_t)arg, "ERROR: login timeout\n");
+}
+
+static void idle_deadline(void *arg) {
+    conn_t *conn = arg;
+    log_info("Idle timeout (sock=%d)", conn->sock);
+    drop_connection(conn->sock, "ERROR: idle timeout\n");
+}
 
-    char buffer[BUF_SIZE];
-    char username[USERNAME_LEN] = {0};
-    client_chat_state_t state;
-    state.mode = OPEN_CHAT;
-    state.chat_partner[0] = '\0';
-    state.room_size = 0;
+static void ping_due(void *arg) {
+    conn_t *conn = arg;
+    /* a busy socket is evidently alive; just try again next interval */
+    try_send_to_sock(conn->sock, "PING\n");
+    timer_arm(&conn->ping_timer, (unsigned long)config.ping_interval * 1000);
+}
+
+/* both session timers are pushed back by every input line */
+static void session_touch(conn_t *conn) {
+    timer_arm(&conn->idle_timer, (unsigned long)config.idle_timeout * 1000);
+    timer_arm(&conn->ping_timer, (unsigned long)config.ping_interval * 1000);
+}
+
+void session_freeze_init(void) {
+    freeze_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (freeze_fd < 0) perror("eventfd");
+}
+
+/* Threads backend: returns once `fd` is readable, parking for as long as
+ * sessions are frozen. Used by every session read and the accept loop. */
+void session_wait_readable(int fd) {
+    if (freeze_fd < 0) return;
+    for (;;) {
+        struct pollfd pf[2] = { { fd, POLLIN, 0 }, { freeze_fd, POLLIN, 0 } };
+        if (poll(pf, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (!(pf[1].revents & POLLIN)) return;
+
+        pthread_mutex_lock(&freeze_lock);
+        if (frozen) {
+            nparked++;
+            pthread_cond_broadcast(&freeze_cond);
+            while (frozen) pthread_cond_wait(&freeze_cond, &freeze_lock);
+            nparked--;
+        }
+        pthread_mutex_unlock(&freeze_lock);
+    }
+}
+
+/* Stops every reader (each session and the accept loop, or with an event
+ * backend the I/O thread and the workers) and waits up to timeout_ms for
+ * all of them to park. Returns 0 on timeout, still frozen; the caller
+ * thaws. Commands already running finish first, so the caller must not
+ * hold clients_lock or db_lock here. */
+int session_freeze(int timeout_ms) {
+    if (netio_evented()) return netio_freeze(timeout_ms);
+    if (freeze_fd < 0) return 0;
+    uint64_t one = 1;
+    pthread_mutex_lock(&freeze_lock);
+    frozen = 1;
+    if (write(freeze_fd, &one, sizeof(one)) < 0) perror("freeze");
+
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    int all = 0;
+    for (;;) {
+        /* sessions can end or start meanwhile, so recount each time */
+        all = nparked >= session_count() + 1;
+        if (all) break;
+        if (pthread_cond_timedwait(&freeze_cond, &freeze_lock, &until) != 0) {
+            all = nparked >= session_count() + 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&freeze_lock);
+    return all;
+}
+
+void session_thaw(void) {
+    if (netio_evented()) {
+        netio_thaw();
+        return;
+    }
+    uint64_t v;
+    pthread_mutex_lock(&freeze_lock);
+    frozen = 0;
+    if (read(freeze_fd, &v, sizeof(v)) < 0 && errno != EAGAIN) perror("thaw");
+    pthread_cond_broadcast(&freeze_cond);
+    pthread_mutex_unlock(&freeze_lock);
+}
+
+/* raw client input: the socket itself, or with an event backend the
+ * bytes the I/O thread has queued for this session */
+static ssize_t conn_read(conn_t *conn, void *buf, size_t len) {
+    if (netio_evented()) return netio_read(conn, buf, len);
+    if (conn->carry) {
+        size_t n = conn->carry_len - conn->carry_off;
+        if (n > len) n = len;
+        memcpy(buf, conn->carry + conn->carry_off, n);
+        conn->carry_off += n;
+        if (conn->carry_off == conn->carry_len) {
+            free(conn->carry);
+            conn->carry = NULL;
+        }
+        return (ssize_t)n;
+    }
+    session_wait_readable(conn->sock);
+    return recv(conn->sock, buf, len, 0);
+}
+
+/* every read of client input goes through here so activity anywhere
+ * (main loop or menus) keeps the session alive */
+ssize_t session_recv(int sock, void *buf, size_t len) {
+    conn_t *conn = current_conn;
+    if (!conn || conn->sock != sock) return recv(sock, buf, len, 0);
+    ssize_t n = conn_read(conn, buf, len);
+    if (n > 0) session_touch(conn);
+    return n;
+}
+
+/* multi-line responses (history, search, sync) go through here: compressed
+ * when this session asked for it and the response is worth it */
+void session_send_bulk(int sock, const char *data, size_t len) {
+    conn_t *conn = current_conn;
+    if (conn && conn->sock == sock && conn->zout.on && len >= COMPRESS_MIN_BYTES) {
+        zout_send(&conn->zout, sock, data, len);
+        return;
+    }
+    send_buf_to_sock(sock, data, len);
+}
+
+/* the sender's copy of the #id/seq the recipient sees, so it can match
+ * later history or redelivery against what it sent */
+static void confirm_sent(int sock, long long id, long long seq, int unforwarded) {
+    char line[128];
+    if (!id) {
+        send_to_sock(sock, "ERROR: could not store message\n");
+        return;
+    }
+    if (unforwarded) {
+        snprintf(line, sizeof(line),
+                 "ERROR: peer link backed up, message not forwarded (stored here as #%lld/%lld)\n",
+                 id, seq);
+        send_to_sock(sock, line);
+        return;
+    }
+    snprintf(line, sizeof(line), "Message sent ✓ (#%lld/%lld)\n", id, seq);
+    send_to_sock(sock, line);
+}
+
+/* the user's per-class token buckets, then load shedding for queries: under overload
+ * a query is deferred once and refused if the database is still backed up.
+ * Replies with the reason and returns 0 when the command must not run. */
+static int session_admit(conn_t *conn, rl_class_t c) {
+    char reply[128];
+    long wait_ms = rl_take(user_lookup(conn->username), c);
+    if (wait_ms) {
+        stat_inc(STAT_RATE_LIMITED);
+        snprintf(reply, sizeof(reply), "ERROR: rate limit exceeded (%s), retry in %ld ms\n",
+                 rl_class_name(c), wait_ms);
+        send_to_sock(conn->sock, reply);
+        return 0;
+    }
+    if (c == RL_QUERY && overload_active()) {
+        usleep(OVERLOAD_DEFER_MS * 1000);
+        if (overload_active()) {
+            stat_inc(STAT_SHED);
+            send_to_sock(conn->sock, "ERROR: server busy, retry shortly\n");
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    /* login prompt */
+static void login_prompt(int sock) {
     send_to_sock(sock,
         "Welcome to the Messaging Server!\n"
         "Type: login <username>\n");
-    ssize_t bytes = recv(sock, buffer, sizeof(buffer)-1, 0);
-    if (bytes <= 0) { close(sock); return NULL; }
+}
+
+/* registers the client under the name in its login line, `bytes` bytes in
+ * conn->inbuf. Returns 1 once the client is in clients[], 0 if the login
+ * failed. */
+static int login_line(conn_t *conn, ssize_t bytes) {
+    int sock = conn->sock;
+    char *buffer = conn->inbuf;
+    char *username = conn->username;
+    client_chat_state_t *state = &conn->state;
+
     buffer[bytes] = '\0';
     trim_whitespace(buffer);
 
-    if (strncmp(buffer, "login ", 6) == 0) {
-        strncpy(username, buffer+6, USERNAME_LEN-1);
-    } else {
-        strncpy(username, buffer, USERNAME_LEN-1);
+    /* login <username> [resume <token> <last_id>] */
+    char *login_save = NULL;
+    char *login_name = buffer;
+    if (strncmp(buffer, "login ", 6) == 0) login_name = buffer + 6;
+    login_name = strtok_r(login_name, " ", &login_save);
+    char *resume_kw = login_name ? strtok_r(NULL, " ", &login_save) : NULL;
+    char *resume_token = NULL;
+    char *resume_last = NULL;
+    if (resume_kw && strcasecmp(resume_kw, "resume") == 0) {
+        resume_token = strtok_r(NULL, " ", &login_save);
+        resume_last = resume_token ? strtok_r(NULL, " ", &login_save) : NULL;
     }
+
+    if (login_name) strncpy(username, login_name, USERNAME_LEN-1);
     username[USERNAME_LEN-1] = '\0';
     trim_whitespace(username);
 
     if (strlen(username) == 0) {
         send_to_sock(sock, "ERROR: empty username\n");
-        close(sock);
-        return NULL;
+        return 0;
+    }
+    /* '#' names belong to channels */
+    if (username[0] == CHANNEL_PREFIX) {
+        send_to_sock(sock, "ERROR: usernames cannot start with '#'\n");
+        return 0;
     }
     if (user_exists(username)) {
         send_to_sock(sock, "ERROR: username already in use\n");
-        close(sock);
-        return NULL;
+        return 0;
     }
-    if (!add_client(sock, username)) {
+    if (!add_client(sock, username, state)) {
         send_to_sock(sock, "ERROR: server full\n");
-        close(sock);
-        return NULL;
+        return 0;
     }
 
     /* send welcome & help */
@@ -67,139 +298,685 @@ void *client_thread(void *arg) {
         snprintf(welcome, sizeof(welcome),
             "Welcome, %s!\nType 'help' for commands.\n", username);
         send_to_sock(sock, welcome);
-        send_help(sock, &state);
+        send_help(sock, state);
     }
     log_info("Client connected: %s (sock=%d)", username, sock);
 
-    /* main loop */
-    while (running) {
-        memset(buffer, 0, sizeof(buffer));
-        ssize_t len = recv(sock, buffer, sizeof(buffer)-1, 0);
-        if (len <= 0) break;
-        buffer[len] = '\0';
-        trim_whitespace(buffer);
-        if (strlen(buffer) == 0) continue;
-
-        /* In CLOSED_CHAT we accept slash-commands or plain messages */
-        if (state.mode == CLOSED_CHAT) {
-            if (buffer[0] == '/') {
-                /* slash commands */
-                if (strncmp(buffer+1, "open", 4) == 0) {
-                    state.mode = OPEN_CHAT;
-                    state.chat_partner[0] = '\0';
-                    send_to_sock(sock, "Returned to OPEN_CHAT mode.\n");
-                    continue;
-                } else if (strncmp(buffer+1, "menu", 4) == 0) {
-                    handle_menu_chatrooms(username, sock, &state);;
-                    continue;
-                } else if (strncmp(buffer+1, "exit", 4) == 0) {
-                    send_to_sock(sock, "Goodbye\n");
-                    break;
-                } else if (strncmp(buffer+1, "help", 4) == 0) {
-                    send_help(sock, &state);
-                    continue;
-                } else if (strncmp(buffer+1, "users", 5) == 0) {
-                    handle_getuserlist(sock);
-                    continue;
-                } else {
-                    send_to_sock(sock, "Unknown slash command in closed chat. /help\n");
-                    continue;
-                }
-            } else if (buffer[0] == '\\') {
-                /* also accept backslash as alternative */
-                send_to_sock(sock, "Use /command for commands. To send message, just type it.\n");
-                continue;
-            } else {
-                /* Plain message send to chat partner (full buffer) */
-                if (strlen(state.chat_partner) == 0) {
-                    send_to_sock(sock, "No chat partner set. Type /menu then select.\n");
-                    state.mode = OPEN_CHAT;
-                    continue;
-                }
-                /* ensure partner exists historically — but allow sending even if offline */
-                send_to_user(username, state.chat_partner, buffer);
-                send_to_sock(sock, "Message sent ✓\n");
-                continue;
-            }
+    /* delta sync: a valid token from the previous session gets everything
+     * after the client's last-seen id in one batch; then rotate the token */
+    if (resume_token) {
+        if (resume_last && session_check_token(username, resume_token)) {
+            handle_resume_db_and_send(username, sock, atoll(resume_last));
+        } else {
+            send_to_sock(sock, "ERROR: invalid resume token\n");
         }
+    }
+    {
+        char token[RESUME_TOKEN_LEN + 1];
+        char line[64 + RESUME_TOKEN_LEN];
+        if (session_issue_token(username, token)) {
+            snprintf(line, sizeof(line), "RESUME-TOKEN %s\n", token);
+            send_to_sock(sock, line);
+        }
+    }
+    /* a client that acks gets back only what it has not acked */
+    handle_redeliver_db_and_send(username, sock, 1);
+    return 1;
+}
 
-        /* OPEN_CHAT or other modes: parse commands */
-        char *saveptr = NULL;
-        char *cmd = strtok_r(buffer, " ", &saveptr);
-        if (!cmd) continue;
+/* threads backend: greets a fresh connection and waits for its login line */
+static int client_login(conn_t *conn) {
+    login_prompt(conn->sock);
+    wheel_timer_t login_timer;
+    timer_init(&login_timer, login_deadline, (void *)(intptr_t)conn->sock);
+    timer_arm(&login_timer, (unsigned long)config.login_timeout * 1000);
+    ssize_t bytes = conn_read(conn, conn->inbuf, BUF_SIZE-1);
+    timer_cancel(&login_timer);
+    return bytes > 0 && login_line(conn, bytes);
+}
 
-        if (strcasecmp(cmd, "Chat") == 0) {
-            char *target = strtok_r(NULL, " ", &saveptr);
-            char *msg = (target) ? strtok_r(NULL, "", &saveptr) : NULL;
-            if (!target || !msg) {
-                send_to_sock(sock, "ERROR: usage: Chat <user> <message>\n");
-                continue;
-            }
-            trim_whitespace(target);
-            trim_whitespace(msg);
-            if (!user_exists(target)) {
-                send_to_sock(sock, "ERROR: target username does not exist\n");
-                continue;
+/* runs one command line of `len` bytes from conn->inbuf. Returns 0 when
+ * the session should end. `name` is set to the command, for tracing. */
+static int session_dispatch(conn_t *conn, ssize_t len, const char **name) {
+    int sock = conn->sock;
+    char *buffer = conn->inbuf;
+    char *username = conn->username;
+    client_chat_state_t *state = &conn->state;
+
+    buffer[len] = '\0';
+
+    /* inside a menu every line belongs to the current menu step; chat
+     * lines there count against the chat bucket like any other */
+    if (state->menu != MENU_NONE) {
+        int text = menu_takes_text(state);
+        *name = text ? "menu-chat" : "menu";
+        if (!session_admit(conn, text ? RL_CHAT : RL_OTHER)) return 1;
+        menu_input(username, sock, state, buffer);
+        return 1;
+    }
+
+    /* bigchat <user> <size>: only the first line is a command, anything
+     * after it is already payload. It is checked before the line is
+     * trimmed, but in a closed chat every plain line is message text, so
+     * the closed-chat handling below takes precedence. */
+    if (state->mode != CLOSED_CHAT && strncasecmp(buffer, "bigchat ", 8) == 0) {
+        *name = "bigchat";
+        char *nl = memchr(buffer, '\n', (size_t)len);
+        size_t head = nl ? (size_t)(nl - buffer) + 1 : (size_t)len;
+        char header[128];
+        snprintf(header, sizeof(header), "%.*s", (int)head, buffer);
+        char *save = NULL;
+        strtok_r(header, " \r\n", &save);
+        char *target = strtok_r(NULL, " \r\n", &save);
+        char *size = target ? strtok_r(NULL, " \r\n", &save) : NULL;
+        if (!size) {
+            send_to_sock(sock, "ERROR: usage bigchat <user> <size>\n");
+            return 1;
+        }
+        if (!session_admit(conn, RL_QUERY)) return 1;
+        if (!netio_evented()) {
+            handle_bigchat(username, sock, target, atoll(size), buffer + head, (size_t)len - head);
+        } else if (bigchat_begin(username, sock, target, atoll(size), (size_t)len - head, &conn->big) &&
+                   (size_t)len > head) {
+            /* the rest arrives as the session's next inputs */
+            bigchat_data(&conn->big, buffer + head, (size_t)len - head);
+        }
+        return 1;
+    }
+
+    trim_whitespace(buffer);
+    if (strlen(buffer) == 0) return 1;
+    /* keepalive reply; its arrival already pushed the deadlines back */
+    if (strcasecmp(buffer, "pong") == 0) return 1;
+
+    /* In CLOSED_CHAT we accept slash-commands or plain messages */
+    if (state->mode == CLOSED_CHAT) {
+        *name = buffer[0] == '/' ? "slash" : "closed-chat";
+        if (buffer[0] == '/') {
+            /* slash commands */
+            if (strncmp(buffer+1, "open", 4) == 0) {
+                state->mode = OPEN_CHAT;
+                state->chat_partner[0] = '\0';
+                send_to_sock(sock, "Returned to OPEN_CHAT mode.\n");
+                return 1;
+            } else if (strncmp(buffer+1, "menu", 4) == 0) {
+                handle_menu_chatrooms(username, sock, state);
+                return 1;
+            } else if (strncmp(buffer+1, "exit", 4) == 0) {
+                send_to_sock(sock, "Goodbye\n");
+                return 0;
+            } else if (strncmp(buffer+1, "help", 4) == 0) {
+                send_help(sock, state);
+                return 1;
+            } else if (strncmp(buffer+1, "users", 5) == 0) {
+                handle_getuserlist(sock);
+                return 1;
+            } else {
+                send_to_sock(sock, "Unknown slash command in closed chat. /help\n");
+                return 1;
             }
-            send_to_user(username, target, msg);
-            send_to_sock(sock, "Message sent ✓\n");
-        }
-        else if (strcasecmp(cmd, "getmessages") == 0) {
-            char *target = strtok_r(NULL, " ", &saveptr);
-            if (!target) { send_to_sock(sock, "ERROR: usage getmessages <user>\n"); continue; }
-            trim_whitespace(target);
-            handle_getmessages_db_and_send(username, sock, target);
-        }
-        else if (strcasecmp(cmd, "deletemessages") == 0) {
-            char *target = strtok_r(NULL, " ", &saveptr);
-            if (!target) { send_to_sock(sock, "ERROR: usage deletemessages <user>\n"); continue; }
-            trim_whitespace(target);
-            handle_deletemessages_db(username, target, sock);
-        }
-        else if (strcasecmp(cmd, "getuserlist") == 0) {
-            handle_getuserlist(sock);
-        }
-        else if (strcasecmp(cmd, "Menu") == 0 || strcasecmp(cmd, "menu") == 0) {
-            handle_menu_chatrooms(username, sock, &state);;
-        }
-        else if (strcasecmp(cmd, "select") == 0) {
-            char *partner = strtok_r(NULL, " ", &saveptr);
-            if (!partner) { send_to_sock(sock, "ERROR: usage select <username>\n"); continue; }
-            trim_whitespace(partner);
-            if (!user_exists(partner)) {
-                send_to_sock(sock, "ERROR: user not connected/known\n");
-                continue;
+        } else if (buffer[0] == '\\') {
+            /* also accept backslash as alternative */
+            send_to_sock(sock, "Use /command for commands. To send message, just type it.\n");
+            return 1;
+        } else {
+            /* Plain message send to chat partner (full buffer) */
+            if (strlen(state->chat_partner) == 0) {
+                send_to_sock(sock, "No chat partner set. Type /menu then select.\n");
+                state->mode = OPEN_CHAT;
+                return 1;
             }
-            /* Enter CLOSED_CHAT with partner */
-            strncpy(state.chat_partner, partner, USERNAME_LEN-1);
-            state.chat_partner[USERNAME_LEN-1] = '\0';
-            state.mode = CLOSED_CHAT;
-            {
-                char m[128];
-                snprintf(m, sizeof(m), "Entered CLOSED_CHAT with %s. Type messages directly to send.\n", state.chat_partner);
-                send_to_sock(sock, m);
-                send_to_sock(sock, "Type /open to return to open chat, /menu to view menu, /exit to quit.\n");
+            if (!session_admit(conn, RL_CHAT)) return 1;
+            /* ensure partner exists historically — but allow sending even if offline */
+            long long seq = 0;
+            int unforwarded = 0;
+            long long id = send_to_user(username, state->chat_partner, buffer, &seq, &unforwarded);
+            confirm_sent(sock, id, seq, unforwarded);
+            return 1;
+        }
+    }
+
+    /* OPEN_CHAT or other modes: parse commands */
+    char *saveptr = NULL;
+    char *cmd = strtok_r(buffer, " ", &saveptr);
+    if (!cmd) return 1;
+    *name = cmd;
+    if (!session_admit(conn, rl_class_of(cmd))) return 1;
+
+    if (strcasecmp(cmd, "Chat") == 0) {
+        char *target = strtok_r(NULL, " ", &saveptr);
+        char *msg = (target) ? strtok_r(NULL, "", &saveptr) : NULL;
+        if (!target || !msg) {
+            send_to_sock(sock, "ERROR: usage: Chat <user> <message>\n");
+            return 1;
+        }
+        trim_whitespace(target);
+        trim_whitespace(msg);
+        if (!user_exists(target)) {
+            send_to_sock(sock, "ERROR: target username does not exist\n");
+            return 1;
+        }
+        long long seq = 0;
+        int unforwarded = 0;
+        long long id = send_to_user(username, target, msg, &seq, &unforwarded);
+        confirm_sent(sock, id, seq, unforwarded);
+    }
+    else if (strcasecmp(cmd, "getmessages") == 0) {
+        /* getmessages <user> [since <ts>] [until <ts>] */
+        char *target = strtok_r(NULL, " ", &saveptr);
+        if (!target) { send_to_sock(sock, "ERROR: usage getmessages <user> [since <ts>] [until <ts>]\n"); return 1; }
+        trim_whitespace(target);
+        long long since = HISTORY_NO_LIMIT_LOW, until = HISTORY_NO_LIMIT_HIGH;
+        int bad = 0;
+        char *tok;
+        while (!bad && (tok = strtok_r(NULL, " ", &saveptr)) != NULL) {
+            char *val = strtok_r(NULL, " ", &saveptr);
+            if (strcasecmp(tok, "since") == 0) bad = !parse_timestamp(val, &since);
+            else if (strcasecmp(tok, "until") == 0) bad = !parse_timestamp(val, &until);
+            else bad = 1;
+        }
+        if (bad) {
+            send_to_sock(sock, "ERROR: usage getmessages <user> [since <ts>] [until <ts>] "
+                               "(ts = epoch seconds or YYYY-MM-DD[THH:MM[:SS]] UTC)\n");
+            return 1;
+        }
+        handle_getmessages_db_and_send(username, sock, target, since, until);
+    }
+    else if (strcasecmp(cmd, "search") == 0) {
+        /* search <text> [with <user>] [limit N] [page N] */
+        char text[BUF_SIZE] = {0};
+        char *with = NULL;
+        int limit = 0, page = 0;
+        char *tok;
+        while ((tok = strtok_r(NULL, " ", &saveptr)) != NULL) {
+            if (strcasecmp(tok, "with") == 0 && saveptr && *saveptr) {
+                with = strtok_r(NULL, " ", &saveptr);
+            } else if (strcasecmp(tok, "limit") == 0 && saveptr && *saveptr) {
+                limit = atoi(strtok_r(NULL, " ", &saveptr));
+            } else if (strcasecmp(tok, "page") == 0 && saveptr && *saveptr) {
+                page = atoi(strtok_r(NULL, " ", &saveptr));
+            } else {
+                if (text[0]) strncat(text, " ", sizeof(text) - strlen(text) - 1);
+                strncat(text, tok, sizeof(text) - strlen(text) - 1);
             }
         }
-        else if (strcasecmp(cmd, "open") == 0) {
-            state.mode = OPEN_CHAT;
-            state.chat_partner[0] = '\0';
-            send_to_sock(sock, "Switched to OPEN_CHAT mode.\n");
+        if (text[0] == '\0') {
+            send_to_sock(sock, "ERROR: usage search <text> [with <user>] [limit N] [page N]\n");
+            return 1;
         }
-        else if (strcasecmp(cmd, "help") == 0) {
-            send_help(sock, &state);
+        handle_search_db_and_send(username, sock, text, with, limit, page);
+    }
+    else if (strcasecmp(cmd, "getbig") == 0) {
+        char *id = strtok_r(NULL, " ", &saveptr);
+        if (!id) { send_to_sock(sock, "ERROR: usage getbig <id>\n"); return 1; }
+        handle_getbig(username, sock, atoll(id));
+    }
+    else if (strcasecmp(cmd, "sync") == 0) {
+        char *last = strtok_r(NULL, " ", &saveptr);
+        if (!last) { send_to_sock(sock, "ERROR: usage sync <last_id>\n"); return 1; }
+        handle_resume_db_and_send(username, sock, atoll(last));
+    }
+    else if (strcasecmp(cmd, "ack") == 0) {
+        /* ack <user> <seq> [<user> <seq> ...]: cumulative, no reply */
+        char partners[ACK_MAX_PAIRS][USERNAME_LEN];
+        long long seqs[ACK_MAX_PAIRS];
+        int n = 0, bad = 0;
+        char *who;
+        while (!bad && (who = strtok_r(NULL, " ", &saveptr)) != NULL) {
+            char *seq = strtok_r(NULL, " ", &saveptr);
+            if (!seq || n == ACK_MAX_PAIRS || atoll(seq) <= 0) { bad = 1; break; }
+            snprintf(partners[n], USERNAME_LEN, "%s", who);
+            seqs[n++] = atoll(seq);
         }
-        else if (strcasecmp(cmd, "exit") == 0) {
-            send_to_sock(sock, "Goodbye\n");
-            break;
+        if (bad || n == 0) {
+            send_to_sock(sock, "ERROR: usage ack <user> <seq> [<user> <seq> ...]\n");
+            return 1;
         }
-        else {
-            send_to_sock(sock, "ERROR: Unknown command. Type 'help'\n");
+        if (acks_store(username, partners, seqs, n) < 0)
+            send_to_sock(sock, "ERROR: ack failed\n");
+    }
+    else if (strcasecmp(cmd, "redeliver") == 0) {
+        handle_redeliver_db_and_send(username, sock, 0);
+    }
+    else if (strcasecmp(cmd, "export") == 0) {
+        /* export <user> [format text|jsonl] */
+        char *target = strtok_r(NULL, " ", &saveptr);
+        char *kw = target ? strtok_r(NULL, " ", &saveptr) : NULL;
+        char *fmt = kw ? strtok_r(NULL, " ", &saveptr) : NULL;
+        if (!target || (kw && (strcasecmp(kw, "format") != 0 || !fmt ||
+                               (strcasecmp(fmt, "text") != 0 && strcasecmp(fmt, "jsonl") != 0)))) {
+            send_to_sock(sock, "ERROR: usage export <user> [format text|jsonl]\n");
+            return 1;
+        }
+        handle_export_db_and_send(username, sock, target, fmt && strcasecmp(fmt, "jsonl") == 0);
+    }
+    else if (strcasecmp(cmd, "deletemessages") == 0) {
+        char *target = strtok_r(NULL, " ", &saveptr);
+        if (!target) { send_to_sock(sock, "ERROR: usage deletemessages <user>\n"); return 1; }
+        trim_whitespace(target);
+        handle_deletemessages_db(username, target, sock);
+    }
+    else if (strcasecmp(cmd, "compress") == 0) {
+        char *arg = strtok_r(NULL, " ", &saveptr);
+        if (arg && strcasecmp(arg, "on") == 0) {
+            /* the acknowledgement itself is always plain text */
+            if (zout_start(&conn->zout))
+                send_to_sock(sock, "COMPRESS ON\n");
+            else
+                send_to_sock(sock, "ERROR: compression unavailable\n");
+        } else if (arg && strcasecmp(arg, "off") == 0) {
+            zout_end(&conn->zout);
+            send_to_sock(sock, "COMPRESS OFF\n");
+        } else {
+            send_to_sock(sock, "ERROR: usage compress on|off\n");
+        }
+    }
+    else if (strcasecmp(cmd, "join") == 0) {
+        /* join #channel [persist] */
+        char *chan = strtok_r(NULL, " ", &saveptr);
+        char *opt = chan ? strtok_r(NULL, " ", &saveptr) : NULL;
+        if (!chan || !channel_name_valid(chan) || (opt && strcasecmp(opt, "persist") != 0)) {
+            send_to_sock(sock, "ERROR: usage join #channel [persist]\n");
+            return 1;
         }
+        int rc = channel_join(chan, sock, opt != NULL);
+        char m[64 + USERNAME_LEN];
+        if (rc < 0) snprintf(m, sizeof(m), "ERROR: cannot join %s (too many channels)\n", chan);
+        else if (rc == 0) snprintf(m, sizeof(m), "Already in %s\n", chan);
+        else snprintf(m, sizeof(m), "Joined %s\n", chan);
+        send_to_sock(sock, m);
+    }
+    else if (strcasecmp(cmd, "leave") == 0) {
+        char *chan = strtok_r(NULL, " ", &saveptr);
+        if (!chan) { send_to_sock(sock, "ERROR: usage leave #channel\n"); return 1; }
+        send_to_sock(sock, channel_leave(chan, sock) ? "Left channel\n" : "ERROR: not in that channel\n");
+    }
+    else if (strcasecmp(cmd, "post") == 0) {
+        char *chan = strtok_r(NULL, " ", &saveptr);
+        char *msg = chan ? strtok_r(NULL, "", &saveptr) : NULL;
+        if (!chan || !msg) { send_to_sock(sock, "ERROR: usage post #channel <message>\n"); return 1; }
+        trim_whitespace(msg);
+        channel_post(username, sock, chan, msg);
+    }
+    else if (strcasecmp(cmd, "channels") == 0) {
+        channel_list(sock);
+    }
+    else if (strcasecmp(cmd, "chanhistory") == 0) {
+        char *chan = strtok_r(NULL, " ", &saveptr);
+        char *n = chan ? strtok_r(NULL, " ", &saveptr) : NULL;
+        if (!chan) { send_to_sock(sock, "ERROR: usage chanhistory #channel [N]\n"); return 1; }
+        if (!channel_is_member(chan, sock)) { send_to_sock(sock, "ERROR: join the channel first\n"); return 1; }
+        int limit = n ? atoi(n) : CHANNEL_HISTORY_DEFAULT;
+        if (limit <= 0 || limit > SEARCH_MAX_LIMIT) limit = CHANNEL_HISTORY_DEFAULT;
+        handle_channel_history_db_and_send(chan, sock, limit);
+    }
+    else if (strcasecmp(cmd, "subscribe") == 0 || strcasecmp(cmd, "unsubscribe") == 0) {
+        char *what = strtok_r(NULL, " ", &saveptr);
+        if (!what || strcasecmp(what, "presence") != 0) {
+            send_to_sock(sock, "ERROR: usage subscribe|unsubscribe presence\n");
+        } else if (strcasecmp(cmd, "subscribe") == 0) {
+            int rc = presence_subscribe(sock);
+            if (rc == 0) send_to_sock(sock, "ERROR: already subscribed\n");
+            else if (rc < 0) send_to_sock(sock, "ERROR: too many presence subscribers\n");
+        } else {
+            presence_unsubscribe(sock);
+            send_to_sock(sock, "OK: unsubscribed\n");
+        }
+    }
+    else if (strcasecmp(cmd, "trace") == 0) {
+        /* trace dump | trace on [N] | trace off; a dump holds everyone's commands */
+        char *arg = strtok_r(NULL, " ", &saveptr);
+        if (!user_is_admin(username)) {
+            send_to_sock(sock, "ERROR: only admins may use trace (--admin)\n");
+        } else if (arg && strcasecmp(arg, "dump") == 0) {
+            trace_dump(sock);
+        } else if (arg && strcasecmp(arg, "on") == 0) {
+            char *n = strtok_r(NULL, " ", &saveptr);
+            int every = n ? atoi(n) : 1;
+            __atomic_store_n(&trace_sample_every, every > 0 ? every : 1, __ATOMIC_RELAXED);
+            send_to_sock(sock, "OK: tracing on\n");
+        } else if (arg && strcasecmp(arg, "off") == 0) {
+            __atomic_store_n(&trace_sample_every, 0, __ATOMIC_RELAXED);
+            send_to_sock(sock, "OK: tracing off\n");
+        } else {
+            send_to_sock(sock, "ERROR: usage trace on [N] | off | dump\n");
+        }
+    }
+    else if (strcasecmp(cmd, "lockstats") == 0) {
+        /* lockstats [N | on | off | reset]; only the report is open to everyone */
+        char *arg = strtok_r(NULL, " ", &saveptr);
+        int change = arg && (strcasecmp(arg, "on") == 0 || strcasecmp(arg, "off") == 0 ||
+                             strcasecmp(arg, "reset") == 0);
+        if (change && !user_is_admin(username)) {
+            send_to_sock(sock, "ERROR: only admins may switch or reset lockstats (--admin)\n");
+            return 1;
+        }
+        if (arg && strcasecmp(arg, "on") == 0) lockprof_enable(1);
+        else if (arg && strcasecmp(arg, "off") == 0) lockprof_enable(0);
+        else if (arg && strcasecmp(arg, "reset") == 0) lockprof_reset();
+        lockprof_report(sock, arg && atoi(arg) > 0 ? atoi(arg) : 10);
+    }
+    else if (strcasecmp(cmd, "stats") == 0) {
+        stats_send(sock);
+    }
+    else if (strcasecmp(cmd, "backup") == 0) {
+        /* backup <name> | backup [status] */
+        char *arg = strtok_r(NULL, " ", &saveptr);
+        char err[128];
+        if (!arg || strcasecmp(arg, "status") == 0) {
+            backup_status(sock);
+        } else if (backup_request(arg, username, err, sizeof(err))) {
+            char line[64 + BACKUP_NAME_LEN];
+            snprintf(line, sizeof(line), "BACKUP started %s\n", arg);
+            send_to_sock(sock, line);
+        } else {
+            char line[160];
+            snprintf(line, sizeof(line), "ERROR: %s\n", err);
+            send_to_sock(sock, line);
+        }
+    }
+    else if (strcasecmp(cmd, "peers") == 0) {
+        fed_report(sock);
+    }
+    else if (strcasecmp(cmd, "getuserlist") == 0) {
+        handle_getuserlist(sock);
+    }
+    else if (strcasecmp(cmd, "Menu") == 0 || strcasecmp(cmd, "menu") == 0) {
+        handle_menu_chatrooms(username, sock, state);
     }
+    else if (strcasecmp(cmd, "select") == 0) {
+        char *partner = strtok_r(NULL, " ", &saveptr);
+        if (!partner) { send_to_sock(sock, "ERROR: usage select <username>\n"); return 1; }
+        trim_whitespace(partner);
+        if (!user_exists(partner)) {
+            send_to_sock(sock, "ERROR: user not connected/known\n");
+            return 1;
+        }
+        /* Enter CLOSED_CHAT with partner */
+        strncpy(state->chat_partner, partner, USERNAME_LEN-1);
+        state->chat_partner[USERNAME_LEN-1] = '\0';
+        state->mode = CLOSED_CHAT;
+        {
+            char m[128];
+            snprintf(m, sizeof(m), "Entered CLOSED_CHAT with %s. Type messages directly to send.\n", state->chat_partner);
+            send_to_sock(sock, m);
+            send_to_sock(sock, "Type /open to return to open chat, /menu to view menu, /exit to quit.\n");
+        }
+    }
+    else if (strcasecmp(cmd, "open") == 0) {
+        state->mode = OPEN_CHAT;
+        state->chat_partner[0] = '\0';
+        send_to_sock(sock, "Switched to OPEN_CHAT mode.\n");
+    }
+    else if (strcasecmp(cmd, "help") == 0) {
+        send_help(sock, state);
+    }
+    else if (strcasecmp(cmd, "exit") == 0) {
+        send_to_sock(sock, "Goodbye\n");
+        return 0;
+    }
+    else {
+        send_to_sock(sock, "ERROR: Unknown command. Type 'help'\n");
+    }
+    return 1;
+}
 
-    remove_client_by_sock(sock);
-    close(sock);
-    log_info("Connection closed for %s", username);
+/* closes the socket and returns the connection to the slab */
+void session_free(conn_t *conn) {
+    close(conn->sock);
+    free(conn->carry);
+    free(conn->carry_out);
+    slab_free(&conn_slab, conn);
+}
+
+/* with an event backend the I/O thread frees the connection once it has
+ * stopped reading the socket */
+static void session_close(conn_t *conn) {
+    if (netio_evented()) netio_release(conn);
+    else session_free(conn);
+}
+
+/* the session timers, once logged in */
+static void session_start(conn_t *conn) {
+    conn->rec_session = record_session_start(conn->username);
+
+    timer_init(&conn->idle_timer, idle_deadline, conn);
+    timer_init(&conn->ping_timer, ping_due, conn);
+    current_conn = conn;
+    session_touch(conn);
+}
+
+/* login, or the greeting of a handed-over session, then the session
+ * timers. With an event backend the login line is the session's first
+ * input instead, so a client at the prompt holds no worker; until then
+ * the idle timer is its login deadline. Returns 0 after closing a session
+ * that never started. */
+static int session_begin(conn_t *conn) {
+    int sock = conn->sock;
+    char *username = conn->username;
+
+    if (conn->resumed) {
+        /* handed over by the previous server process: already logged in
+         * and registered by start_resumed_sessions() */
+        send_to_sock(sock, "Server upgraded, session resumed.\n");
+        log_info("Client resumed: %s (sock=%d)", username, sock);
+    } else if (netio_evented()) {
+        login_prompt(sock);
+        timer_init(&conn->idle_timer, login_deadline, (void *)(intptr_t)sock);
+        timer_arm(&conn->idle_timer, (unsigned long)config.login_timeout * 1000);
+        conn->in_login = 1;
+        return 1;
+    } else if (!client_login(conn)) {
+        session_close(conn);
+        return 0;
+    }
+    session_start(conn);
+    return 1;
+}
+
+/* one input of `len` bytes in conn->inbuf. Returns 0 when the session
+ * should end. */
+static int session_input(conn_t *conn, ssize_t len) {
+    client_chat_state_t *state = &conn->state;
+    int free_text = state->menu != MENU_NONE ? menu_takes_text(state)
+                                             : state->mode == CLOSED_CHAT;
+    record_command(conn->rec_session, conn->inbuf, (size_t)len,
+                   free_text && conn->inbuf[0] != '/');
+
+    /* the span starts once input has arrived: time spent waiting for
+     * the client to type is not server latency */
+    trace_span_t root;
+    int traced = trace_command_start(&root);
+    const char *name = "";
+    int keep = session_dispatch(conn, len, &name);
+    if (traced) trace_command_end(&root, name);
+    return keep;
+}
+
+static void session_end(conn_t *conn) {
+    if (conn->big.id) bigchat_abort(&conn->big);
+    current_conn = NULL;
+    record_session_end(conn->rec_session);
+    timer_cancel(&conn->idle_timer);
+    timer_cancel(&conn->ping_timer);
+    zout_end(&conn->zout);
+
+    remove_client_by_sock(conn->sock);
+    log_info("Connection closed for %s", conn->username);
+    session_close(conn);
+}
+
+void *client_thread(void *arg) {
+    conn_t *conn = arg;
+    if (!session_begin(conn)) return NULL;
+
+    /* main loop */
+    while (running) {
+        memset(conn->inbuf, 0, BUF_SIZE);
+        ssize_t len = session_recv(conn->sock, conn->inbuf, BUF_SIZE-1);
+        if (len <= 0 || !session_input(conn, len)) break;
+    }
+    session_end(conn);
     return NULL;
 }
+
+/* event backends: runs on a worker whenever the session has input and
+ * returns once that input is used up, leaving no thread behind */
+void session_step(conn_t *conn) {
+    if (!conn->started) {
+        conn->started = 1;
+        if (!session_begin(conn)) return;
+    }
+    while (!netio_park(conn)) {
+        if (conn->in_login) {
+            memset(conn->inbuf, 0, BUF_SIZE);
+            ssize_t len = conn_read(conn, conn->inbuf, BUF_SIZE-1);
+            timer_cancel(&conn->idle_timer);
+            conn->in_login = 0;
+            if (len <= 0 || !login_line(conn, len)) {
+                session_close(conn);
+                return;
+            }
+            session_start(conn);
+            continue;
+        }
+        current_conn = conn;
+        if (conn->big.id) {
+            /* bigchat payload, not commands */
+            char chunk[BIG_CHUNK_SIZE];
+            ssize_t n = session_recv(conn->sock, chunk, bigchat_want(&conn->big));
+            if (n <= 0 || !running) {
+                session_end(conn);
+                return;
+            }
+            bigchat_data(&conn->big, chunk, (size_t)n);
+            continue;
+        }
+        memset(conn->inbuf, 0, BUF_SIZE);
+        ssize_t len = session_recv(conn->sock, conn->inbuf, BUF_SIZE-1);
+        if (len <= 0 || !running || !session_input(conn, len)) {
+            session_end(conn);
+            return;
+        }
+    }
+    current_conn = NULL;
+}
+
+/* sessions alive, logged in or still at the login prompt */
+int session_count(void) {
+    pthread_mutex_lock(&conn_slab.lock);
+    int n = (int)conn_slab.in_use;
+    pthread_mutex_unlock(&conn_slab.lock);
+    return n;
+}
+
+/* at capacity: say so and hang up instead of starting a session that
+ * would only fail at login. Returns 0 after refusing. */
+int session_room_for(int sock) {
+    if (session_count() < MAX_CLIENTS) return 1;
+    stat_inc(STAT_REFUSED);
+    const char *full = "ERROR: server full, try again later\n";
+    send(sock, full, strlen(full), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(sock);
+    log_info("Connection refused, server full (sock=%d)", sock);
+    return 0;
+}
+
+static conn_t *conn_new(int sock) {
+    conn_t *conn = slab_alloc(&conn_slab);
+    if (!conn) return NULL;
+    memset(conn, 0, sizeof(*conn));
+    conn->sock = sock;
+    conn->state.mode = OPEN_CHAT;
+    return conn;
+}
+
+/* its own thread, or with an event backend a place in the I/O loop. On
+ * failure the connection is freed and the caller still owns the socket. */
+static int conn_start(conn_t *conn) {
+    if (netio_evented()) {
+        netio_attach(conn);
+        netio_start(conn);
+        return 1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, client_thread, conn) != 0) {
+        perror("pthread_create");
+        slab_free(&conn_slab, conn);
+        return 0;
+    }
+    pthread_detach(tid);
+    return 1;
+}
+
+/* starts a session on a newly accepted socket */
+int start_client_thread(int sock) {
+    conn_t *conn = conn_new(sock);
+    return conn && conn_start(conn);
+}
+
+/* Hot upgrade: registers every handed-over session before starting any,
+ * so none runs a command while a user handed over after it still looks
+ * offline. Takes each session's input (read by the old process, not yet
+ * used) as the first thing its session reads, and sends its output (not
+ * yet sent by the old process) before anything a session sends here.
+ * Sockets that are not adopted are closed. Returns the number adopted. */
+int start_resumed_sessions(resumed_session_t *s, int n) {
+    conn_t *conns[MAX_CLIENTS];
+    if (n > MAX_CLIENTS) n = MAX_CLIENTS;
+    for (int i = 0; i < n; i++) {
+        conn_t *conn = conn_new(s[i].sock);
+        if (conn) {
+            conn->resumed = 1;
+            memcpy(conn->username, s[i].username, USERNAME_LEN);
+            conn->state = s[i].state;
+            conn->carry = s[i].input;
+            conn->carry_len = s[i].input_len;
+            conn->carry_out = s[i].output;
+            conn->carry_out_len = s[i].output_len;
+            s[i].input = s[i].output = NULL;
+            if (!add_client(conn->sock, conn->username, &conn->state)) {
+                send_to_sock(conn->sock, "ERROR: server full\n");
+                free(conn->carry);
+                free(conn->carry_out);
+                slab_free(&conn_slab, conn);
+                conn = NULL;
+            }
+        }
+        if (!conn) close(s[i].sock);
+        conns[i] = conn;
+    }
+
+    int adopted = 0;
+    if (netio_evented()) {
+        /* every output queue exists before any session can send */
+        for (int i = 0; i < n; i++)
+            if (conns[i]) netio_attach(conns[i]);
+        for (int i = 0; i < n; i++) {
+            if (!conns[i]) continue;
+            netio_start(conns[i]);
+            adopted++;
+        }
+        return adopted;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (!conns[i] || !conns[i]->carry_out) continue;
+        send_buf_to_sock(conns[i]->sock, conns[i]->carry_out, conns[i]->carry_out_len);
+        free(conns[i]->carry_out);
+        conns[i]->carry_out = NULL;
+    }
+    for (int i = 0; i < n; i++) {
+        if (!conns[i]) continue;
+        char *carry = conns[i]->carry;
+        if (conn_start(conns[i])) {
+            adopted++;
+        } else {
+            free(carry);
+            remove_client_by_sock(s[i].sock);
+            close(s[i].sock);
+        }
+    }
+    return adopted;
+}
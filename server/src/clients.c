@@ -1,104 +1,277 @@
 #include "clients.h"
 #include "utils.h"
+#include "users.h"
+#include "timer.h"
+#include "logging.h"
+#include "presence.h"
+#include "channels.h"
+#include "federation.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "netio.h"
 
 #include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>   // ← REQUIRED for send()
+#include <sys/sendfile.h> // sendfile()
 #include <arpa/inet.h>    // optional but recommended for sockaddr_in
 
 /* client array `clients` declared in server.h as extern and defined in main.c */
 
 /* add_client, remove_client_by_sock, find_sock_by_username, user_exists, send_to_sock */
 
-int add_client(int sock, const char *username) {
-    pthread_mutex_lock(&clients_lock);
+/* Writers to one socket are serialised so a framed transfer (a header
+ * line followed by raw bytes) is never split by another thread's send.
+ * Locks are striped by descriptor rather than kept per client. */
+#define WRITE_LOCK_STRIPES 64
+static pthread_mutex_t write_locks[WRITE_LOCK_STRIPES] = {
+    [0 ... WRITE_LOCK_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_mutex_t *write_lock(int sock) {
+    return &write_locks[(unsigned)sock % WRITE_LOCK_STRIPES];
+}
+
+int add_client(int sock, const char *username, client_chat_state_t *state) {
+    int user_id = user_intern(username);
+    if (!user_id) return 0;
+
+    LOCK(clients_lock);
     int stored = 0;
     for (int i = 0; i < MAX_CLIENTS; i++) {
         if (!clients[i].active) {
             clients[i].sock = sock;
+            clients[i].user_id = user_id;
+            clients[i].state = state;
             strncpy(clients[i].username, username, USERNAME_LEN - 1);
             clients[i].username[USERNAME_LEN - 1] = '\0';
             clients[i].active = 1;
+            clients[i].gen++;
             stored = 1;
             break;
         }
     }
-    pthread_mutex_unlock(&clients_lock);
+    UNLOCK(clients_lock);
+    if (stored) {
+        presence_changed(username, 1);
+        fed_presence(username, 1);
+    }
     return stored;
 }
 
 void remove_client_by_sock(int sock) {
-    pthread_mutex_lock(&clients_lock);
+    char gone[USERNAME_LEN] = "";
+    presence_unsubscribe(sock);
+    LOCK(clients_lock);
     for (int i = 0; i < MAX_CLIENTS; i++) {
         if (clients[i].active && clients[i].sock == sock) {
+            memcpy(gone, clients[i].username, USERNAME_LEN);
+            /* before the slot can be reused */
+            channel_drop_slot(i);
             clients[i].active = 0;
             clients[i].sock = 0;
+            clients[i].user_id = 0;
+            clients[i].state = NULL;
             clients[i].username[0] = '\0';
             break;
         }
     }
-    pthread_mutex_unlock(&clients_lock);
+    UNLOCK(clients_lock);
+    /* a send_buf_to_slot that found the session still here finishes
+     * before the caller can close the socket */
+    pthread_mutex_lock(write_lock(sock));
+    pthread_mutex_unlock(write_lock(sock));
+    if (gone[0]) {
+        presence_changed(gone, 0);
+        fed_presence(gone, 0);
+    }
 }
 
-int find_sock_by_username(const char *username) {
+int find_sock_by_user_id(int user_id) {
     int sock = -1;
-    pthread_mutex_lock(&clients_lock);
+    if (!user_id) return sock;
+    LOCK(clients_lock);
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].active && strcmp(clients[i].username, username) == 0) {
+        if (clients[i].active && clients[i].user_id == user_id) {
             sock = clients[i].sock;
             break;
         }
     }
-    pthread_mutex_unlock(&clients_lock);
+    UNLOCK(clients_lock);
     return sock;
 }
 
-int user_exists(const char *username) {
-    int exists = 0;
-    pthread_mutex_lock(&clients_lock);
+/* index of the session's clients[] entry, -1 if not logged in; `gen`,
+ * if given, receives the entry's generation */
+int client_slot(int sock, unsigned *gen) {
+    int slot = -1;
+    LOCK(clients_lock);
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].active && strcmp(clients[i].username, username) == 0) {
-            exists = 1; break;
+        if (clients[i].active && clients[i].sock == sock) {
+            slot = i;
+            if (gen) *gen = clients[i].gen;
+            break;
         }
     }
-    pthread_mutex_unlock(&clients_lock);
-    return exists;
+    UNLOCK(clients_lock);
+    return slot;
 }
 
-void send_to_sock(int sock, const char *msg) {
-    if (sock <= 0) return;
-    ssize_t r = send(sock, msg, strlen(msg), 0);
-    (void)r;
+int find_sock_by_username(const char *username) {
+    trace_span_t span;
+    TRACE_BEGIN(&span);
+    int sock = find_sock_by_user_id(user_lookup(username));
+    TRACE_END(&span, "find_sock_by_username");
+    return sock;
 }
 
-/* get_all_users used by menu_view_users */
-void get_all_users(char *out, size_t out_size)
-{
-    out[0] = '\0';
+/* online here or on a linked node */
+int user_exists(const char *username) {
+    return find_sock_by_username(username) != -1 || fed_user_is_remote(username);
+}
 
-    pthread_mutex_lock(&clients_lock);
+static void write_stalled(void *arg) {
+    int sock = (int)(intptr_t)arg;
+    log_info("Write timeout, dropping client (sock=%d)", sock);
+    shutdown(sock, SHUT_RDWR);
+}
 
-    int found = 0;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].active) {
-            strncat(out, clients[i].username, out_size - strlen(out) - 1);
-            strncat(out, "\n", out_size - strlen(out) - 1);
-            found = 1;
+/* Sends all of `data`; the caller holds the socket's write lock. The
+ * common case, where the socket buffer has room, takes one non-blocking
+ * send and no timer. Only a send that would block arms a write-stall
+ * deadline; if the peer stops reading, the deadline shuts the socket down
+ * and the session is reclaimed. Returns 0 once everything is sent. */
+static int send_all_locked(int sock, const char *data, size_t len) {
+    ssize_t r = send(sock, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (r == (ssize_t)len) return 0;
+    if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+    if (r > 0) { data += r; len -= (size_t)r; }
+
+    wheel_timer_t stall;
+    timer_init(&stall, write_stalled, (void *)(intptr_t)sock);
+    timer_arm(&stall, (unsigned long)config.write_timeout * 1000);
+    while (len > 0) {
+        r = send(sock, data, len, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        data += r;
+        len -= (size_t)r;
+    }
+    timer_cancel(&stall);
+    return len == 0 ? 0 : -1;
+}
+
+/* With an event backend the connection's output queue takes the bytes
+ * and the I/O thread sends them (netio_send); otherwise they are written
+ * here. Returns 0 once sent or queued. */
+static int send_all(int sock, const char *data, size_t len) {
+    trace_span_t span;
+    TRACE_BEGIN(&span);
+    int rc = netio_send(sock, data, len, NULL, 0);
+    if (rc == 0) {
+        pthread_mutex_lock(write_lock(sock));
+        rc = send_all_locked(sock, data, len);
+        pthread_mutex_unlock(write_lock(sock));
+    } else {
+        rc = rc > 0 ? 0 : -1;
+    }
+    TRACE_END(&span, "send");
+    return rc;
+}
+
+/* header line plus `len` raw payload bytes, written as one unit */
+int send_frame_to_sock(int sock, const char *header, const void *payload, size_t len) {
+    if (sock <= 0) return -1;
+    int rc = netio_send(sock, header, strlen(header), payload, len);
+    if (rc) return rc > 0 ? 0 : -1;
+    pthread_mutex_lock(write_lock(sock));
+    rc = send_all_locked(sock, header, strlen(header));
+    if (rc == 0 && len) rc = send_all_locked(sock, payload, len);
+    pthread_mutex_unlock(write_lock(sock));
+    return rc;
+}
+
+/* The first `len` bytes of file `fd` as frames of at most
+ * SENDFILE_PIECE bytes: "CHUNK <n>\n" and n raw bytes. The bytes go out
+ * with sendfile(), so they are never copied through user space. Each
+ * frame takes the write lock on its own, so other lines to this socket
+ * go out between frames (never inside one) instead of waiting for the
+ * whole file, and each frame gets a fresh write-stall deadline. With an
+ * event backend each frame waits for the output queue to drain and holds
+ * the I/O thread off the socket instead (netio_direct_begin). */
+int send_file_to_sock(int sock, int fd, size_t len) {
+    if (sock <= 0) return -1;
+    off_t off = 0;
+    wheel_timer_t stall;
+    timer_init(&stall, write_stalled, (void *)(intptr_t)sock);
+    while ((size_t)off < len) {
+        size_t piece = len - (size_t)off < SENDFILE_PIECE ? len - (size_t)off : SENDFILE_PIECE;
+        off_t end = off + (off_t)piece;
+        char header[32];
+        snprintf(header, sizeof(header), "CHUNK %zu\n", piece);
+
+        int direct = netio_direct_begin(sock);
+        if (direct < 0) return -1;
+        pthread_mutex_lock(write_lock(sock));
+        int rc = send_all_locked(sock, header, strlen(header));
+        if (rc == 0) {
+            timer_arm(&stall, (unsigned long)config.write_timeout * 1000);
+            while (off < end) {
+                ssize_t r = sendfile(sock, fd, &off, (size_t)(end - off));
+                if (r < 0 && errno == EINTR) continue;
+                if (r <= 0) break;
+            }
+            timer_cancel(&stall);
         }
+        pthread_mutex_unlock(write_lock(sock));
+        if (direct) netio_direct_end(sock);
+        if (rc != 0 || off < end) return -1;
     }
+    return 0;
+}
+
+/* for the timer thread, which must never block: skipped (returns -1)
+ * while another writer owns the socket. Queuing never blocks. */
+int try_send_to_sock(int sock, const char *msg) {
+    int rc = netio_send(sock, msg, strlen(msg), NULL, 0);
+    if (rc) return rc > 0 ? 0 : -1;
+    if (pthread_mutex_trylock(write_lock(sock)) != 0) return -1;
+    ssize_t r = send(sock, msg, strlen(msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+    pthread_mutex_unlock(write_lock(sock));
+    return r == (ssize_t)strlen(msg) ? 0 : -1;
+}
+
+void send_to_sock(int sock, const char *msg) {
+    if (sock <= 0) return;
+    send_all(sock, msg, strlen(msg));
+}
 
-    pthread_mutex_unlock(&clients_lock);
+/* whole-buffer send for assembled responses, which may exceed one send() */
+void send_buf_to_sock(int sock, const char *data, size_t len) {
+    if (sock <= 0) return;
+    send_all(sock, data, len);
+}
 
-    if (!found) {
-        strncat(out, "(no users)\n", out_size - strlen(out) - 1);
+/* copies the names of everyone online; returns how many */
+int get_online_users(char names[][USERNAME_LEN])
+{
+    int n = 0;
+    LOCK(clients_lock);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].active)
+            memcpy(names[n++], clients[i].username, USERNAME_LEN);
     }
+    UNLOCK(clients_lock);
+    return n;
 }
 
 /* broadcast shutdown to all clients and close sockets */
 void broadcast_shutdown_and_close_all() {
-    pthread_mutex_lock(&clients_lock);
+    LOCK(clients_lock);
     for (int i = 0; i < MAX_CLIENTS; i++) {
         if (clients[i].active) {
             const char *msg = "Server shutting down...\n";
@@ -106,23 +279,46 @@ void broadcast_shutdown_and_close_all() {
             close(clients[i].sock);
             clients[i].active = 0;
             clients[i].sock = 0;
+            clients[i].user_id = 0;
+            clients[i].state = NULL;
             clients[i].username[0] = '\0';
         }
     }
-    pthread_mutex_unlock(&clients_lock);
+    UNLOCK(clients_lock);
 }
 
-void handle_getuserlist(int requester_sock) {
-    char line[128];
-    pthread_mutex_lock(&clients_lock);
-    int found = 0;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].active) {
-            snprintf(line, sizeof(line), "%s\n", clients[i].username);
-            send_to_sock(requester_sock, line);
-            found = 1;
-        }
+/* Like send_buf_to_sock for a socket copied from clients[] earlier: sends
+ * only if `slot` still holds the same session, so a descriptor closed and
+ * reused since then never gets the data. Checked under the write lock,
+ * which remove_client_by_sock waits on before the socket can close.
+ * Returns 0 if sent. */
+int send_buf_to_slot(int slot, unsigned gen, int sock, const char *data, size_t len) {
+    pthread_mutex_t *lock = write_lock(sock);
+    pthread_mutex_lock(lock);
+    LOCK(clients_lock);
+    int same = clients[slot].active && clients[slot].gen == gen && clients[slot].sock == sock;
+    UNLOCK(clients_lock);
+    int rc = -1;
+    if (same) {
+        rc = netio_send(sock, data, len, NULL, 0);
+        if (rc == 0) rc = send_all_locked(sock, data, len);
+        else rc = rc > 0 ? 0 : -1;
     }
-    pthread_mutex_unlock(&clients_lock);
-    if (!found) send_to_sock(requester_sock, "(no users)\n");
+    pthread_mutex_unlock(lock);
+    return rc;
+}
+
+/* one line per user, sent in one write after clients_lock is released */
+void handle_getuserlist(int requester_sock) {
+    char names[MAX_CLIENTS][USERNAME_LEN];
+    int n = get_online_users(names);
+
+    strbuf_t out;
+    sb_init(&out);
+    for (int i = 0; i < n; i++)
+        sb_appendf(&out, "%s\n", names[i]);
+    fed_list_remote(&out);
+    if (out.len == 0) sb_appendf(&out, "(no users)\n");
+    send_buf_to_sock(requester_sock, out.data, out.len);
+    sb_free(&out);
 }
@@ -0,0 +1,47 @@
+#include "compress.h"
+#include "clients.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int zout_start(zout_t *z) {
+    if (z->on) return 1;
+    memset(&z->zs, 0, sizeof(z->zs));
+    if (deflateInit2(&z->zs, COMPRESS_LEVEL, Z_DEFLATED, COMPRESS_WINDOW_BITS,
+                     COMPRESS_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+    z->on = 1;
+    return 1;
+}
+
+void zout_end(zout_t *z) {
+    if (!z->on) return;
+    deflateEnd(&z->zs);
+    z->on = 0;
+}
+
+/* compresses `data` into one frame; returns 0 once it is sent */
+int zout_send(zout_t *z, int sock, const char *data, size_t len) {
+    strbuf_t out;
+    unsigned char chunk[16384];
+    int rc = 0;
+
+    sb_init(&out);
+    z->zs.next_in = (unsigned char *)data;
+    z->zs.avail_in = (uInt)len;
+    do {
+        z->zs.next_out = chunk;
+        z->zs.avail_out = sizeof(chunk);
+        if (deflate(&z->zs, Z_SYNC_FLUSH) == Z_STREAM_ERROR) { rc = -1; break; }
+        if (!sb_append(&out, (const char *)chunk, sizeof(chunk) - z->zs.avail_out)) { rc = -1; break; }
+    } while (z->zs.avail_out == 0);
+
+    if (rc == 0) {
+        char header[32];
+        snprintf(header, sizeof(header), "ZLIB %zu\n", out.len);
+        rc = send_frame_to_sock(sock, header, out.data, out.len);
+    }
+    sb_free(&out);
+    return rc;
+}
@@ -2,175 +2,2074 @@
 #include "server.h"
 #include "clients.h"
 #include "logging.h"  // for log_info()
+#include "users.h"
+#include "utils.h"
+#include "client_thread.h"
+#include "ratelimit.h"
+#include "trace.h"
+#include "shards.h"
+#include "channels.h"
+#include <errno.h>
+#include <limits.h>   // for LLONG_MIN
+#include <stdint.h>
 #include <stdio.h>    // for printf(), fprintf()
 #include <stdlib.h>   // for exit()
 #include <stddef.h>   // for size_t
 #include <sqlite3.h>
 #include <string.h>   // for memset(), strcpy(), etc.
+#include <strings.h>  // for strcasecmp()
+#include <time.h>     // for time()
+#include <sys/stat.h> // for mkdir()
+#include <sys/random.h> // for getrandom()
+#include <unistd.h>     // for usleep()
 
-void init_database(const char *filename) {
-    if (sqlite3_open(filename, &db)) {
-        fprintf(stderr, "Cannot open DB: %s\n", sqlite3_errmsg(db));
-        exit(1);
+/* full-text index over messages.content, kept in sync by triggers so every
+ * insert path (store_message or otherwise) is covered */
+static void init_search_index(sqlite3 *d) {
+    int existed = 0;
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(d,
+            "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'messages_fts';",
+            -1, &stmt, NULL) == SQLITE_OK) {
+        existed = (sqlite3_step(stmt) == SQLITE_ROW);
+        sqlite3_finalize(stmt);
     }
 
     const char *sql =
-        "CREATE TABLE IF NOT EXISTS messages ("
+        "CREATE VIRTUAL TABLE IF NOT EXISTS messages_fts USING fts5("
+        "content, content='messages', content_rowid='id');"
+        /* large (BLOB) messages are filled in with blob I/O, which fires no
+         * triggers, so they stay out of the index altogether */
+        "CREATE TRIGGER IF NOT EXISTS messages_fts_ai AFTER INSERT ON messages "
+        "WHEN typeof(new.content) = 'text' BEGIN "
+        "INSERT INTO messages_fts(rowid, content) VALUES (new.id, new.content); END;"
+        "CREATE TRIGGER IF NOT EXISTS messages_fts_ad AFTER DELETE ON messages "
+        "WHEN typeof(old.content) = 'text' BEGIN "
+        "INSERT INTO messages_fts(messages_fts, rowid, content) VALUES ('delete', old.id, old.content); END;"
+        "CREATE TRIGGER IF NOT EXISTS messages_fts_au AFTER UPDATE OF content ON messages "
+        "WHEN typeof(old.content) = 'text' AND typeof(new.content) = 'text' BEGIN "
+        "INSERT INTO messages_fts(messages_fts, rowid, content) VALUES ('delete', old.id, old.content); "
+        "INSERT INTO messages_fts(rowid, content) VALUES (new.id, new.content); END;";
+
+    char *err = NULL;
+    if (sqlite3_exec(d, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "DB error (search index): %s\n", err);
+        sqlite3_free(err);
+        exit(1);
+    }
+
+    /* first start on an existing database: index the rows already there */
+    if (!existed) {
+        log_info("Building search index...");
+        if (sqlite3_exec(d, "INSERT INTO messages_fts(messages_fts) VALUES ('rebuild');",
+                         NULL, NULL, &err) != SQLITE_OK) {
+            fprintf(stderr, "DB error (search rebuild): %s\n", err);
+            sqlite3_free(err);
+            exit(1);
+        }
+    }
+}
+
+/* PRAGMA user_version tracks the on-disk schema.
+ * 0: legacy table with DATETIME text timestamps
+ * 1: integer epoch timestamps plus conversation/time indexes
+ * 2: users table; messages reference sender/receiver by integer id
+ * 3: sessions table holding per-user resume tokens
+ * 4: search triggers skip BLOB (large, streamed) messages
+ * 5: partners table summarising who has talked to whom
+ * 6: per-conversation sequence numbers (messages.seq) and delivery acks */
+#define SCHEMA_VERSION 6
+
+static void exec_on(sqlite3 *d, const char *sql, const char *what) {
+    char *err = NULL;
+    if (sqlite3_exec(d, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "DB error (%s): %s\n", what, err);
+        sqlite3_free(err);
+        exit(1);
+    }
+}
+
+static void exec_or_die(const char *sql, const char *what) {
+    exec_on(db, sql, what);
+}
+
+static int query_int(sqlite3 *d, const char *sql) {
+    int value = 0;
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(d, sql, -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) value = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return value;
+}
+
+static void set_schema_version(sqlite3 *d, int version) {
+    char sql[64];
+    snprintf(sql, sizeof(sql), "PRAGMA user_version = %d;", version);
+    exec_on(d, sql, "user_version");
+}
+
+static const char *users_schema =
+    "CREATE TABLE IF NOT EXISTS users ("
+    "id INTEGER PRIMARY KEY,"
+    "name TEXT NOT NULL UNIQUE"
+    ");";
+
+static const char *sessions_schema =
+    "CREATE TABLE IF NOT EXISTS sessions ("
+    "user_id INTEGER PRIMARY KEY REFERENCES users(id),"
+    "token TEXT NOT NULL,"
+    "issued_at INTEGER NOT NULL"
+    ");";
+
+static const char *messages_schema =
+    "CREATE TABLE messages ("
+    "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "sender_id INTEGER NOT NULL REFERENCES users(id),"
+    "receiver_id INTEGER NOT NULL REFERENCES users(id),"
+    "content TEXT,"
+    "timestamp INTEGER NOT NULL DEFAULT (CAST(strftime('%s', 'now') AS INTEGER)),"
+    "seq INTEGER"
+    ");";
+
+static const char *messages_indexes =
+    "CREATE INDEX IF NOT EXISTS idx_messages_pair_ts ON messages(sender_id, receiver_id, timestamp);"
+    "CREATE INDEX IF NOT EXISTS idx_messages_receiver_ts ON messages(receiver_id, timestamp);"
+    "CREATE INDEX IF NOT EXISTS idx_messages_pair_seq ON messages(sender_id, receiver_id, seq);";
+
+/* one row per direction for every pair of users with stored messages, so
+ * the partner list is one index range instead of a scan of messages (or,
+ * sharded, of every shard) */
+static const char *partners_schema =
+    "CREATE TABLE IF NOT EXISTS partners ("
+    "user_id INTEGER NOT NULL,"
+    "partner_id INTEGER NOT NULL,"
+    "PRIMARY KEY (user_id, partner_id)"
+    ") WITHOUT ROWID;";
+
+/* Cumulative delivery acks: `user_id` has received everything `partner_id`
+ * sent it up to `seq`. ack_users marks the clients that ack at all, and
+ * from which message id on: older messages are never resent. */
+static const char *acks_schema =
+    "CREATE TABLE IF NOT EXISTS acks ("
+    "user_id INTEGER NOT NULL,"
+    "partner_id INTEGER NOT NULL,"
+    "seq INTEGER NOT NULL,"
+    "PRIMARY KEY (user_id, partner_id)"
+    ") WITHOUT ROWID;"
+    "CREATE TABLE IF NOT EXISTS ack_users ("
+    "user_id INTEGER PRIMARY KEY,"
+    "since_id INTEGER NOT NULL"
+    ");";
+
+static const char *partners_fill =
+    "INSERT OR IGNORE INTO partners (user_id, partner_id) "
+    "SELECT sender_id, receiver_id FROM messages "
+    "UNION SELECT receiver_id, sender_id FROM messages;";
+
+/* v0 -> v1: rewrite DATETIME text as epoch seconds. Row ids are kept so the
+ * search index stays valid; its triggers are recreated by init_search_index */
+static void migrate_to_v1(void) {
+    log_info("Migrating messages to integer timestamps...");
+    exec_or_die("BEGIN;", "migrate v1");
+    exec_or_die("ALTER TABLE messages RENAME TO messages_v0;", "migrate v1");
+    exec_or_die(
+        "CREATE TABLE messages ("
         "id INTEGER PRIMARY KEY AUTOINCREMENT,"
         "sender TEXT,"
         "receiver TEXT,"
         "content TEXT,"
-        "timestamp DATETIME DEFAULT CURRENT_TIMESTAMP"
-        ");";
+        "timestamp INTEGER NOT NULL DEFAULT (CAST(strftime('%s', 'now') AS INTEGER))"
+        ");", "migrate v1");
+    exec_or_die(
+        "INSERT INTO messages (id, sender, receiver, content, timestamp) "
+        "SELECT id, sender, receiver, content, "
+        "COALESCE(CAST(strftime('%s', timestamp) AS INTEGER), CAST(strftime('%s', 'now') AS INTEGER)) "
+        "FROM messages_v0;", "migrate v1");
+    exec_or_die("DROP TABLE messages_v0;", "migrate v1");
+    set_schema_version(db, 1);
+    exec_or_die("COMMIT;", "migrate v1");
+}
 
-    char *err = NULL;
-    if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
-        fprintf(stderr, "DB error: %s\n", err);
-        sqlite3_free(err);
+/* v1 -> v2: intern every sender/receiver into users and store ids instead
+ * of repeated names. Row ids are kept, as in v1. */
+static void migrate_to_v2(void) {
+    log_info("Migrating messages to integer user ids...");
+    exec_or_die("BEGIN;", "migrate v2");
+    exec_or_die(users_schema, "migrate v2");
+    exec_or_die(
+        "INSERT OR IGNORE INTO users (name) "
+        "SELECT sender FROM messages WHERE sender IS NOT NULL "
+        "UNION SELECT receiver FROM messages WHERE receiver IS NOT NULL;", "migrate v2");
+    exec_or_die("ALTER TABLE messages RENAME TO messages_v1;", "migrate v2");
+    exec_or_die(messages_schema, "migrate v2");
+    exec_or_die(
+        "INSERT INTO messages (id, sender_id, receiver_id, content, timestamp) "
+        "SELECT m.id, s.id, r.id, m.content, m.timestamp FROM messages_v1 m "
+        "JOIN users s ON s.name = m.sender JOIN users r ON r.name = m.receiver;", "migrate v2");
+    exec_or_die("DROP TABLE messages_v1;", "migrate v2");
+    exec_or_die(messages_indexes, "migrate v2");
+    set_schema_version(db, 2);
+    exec_or_die("COMMIT;", "migrate v2");
+    exec_or_die("VACUUM;", "migrate v2");
+}
+
+/* v5 -> v6 on a file holding messages: number every existing
+ * conversation in id order. Databases created by migrate_to_v2 in this
+ * run already have the column. */
+static void migrate_seq(sqlite3 *d) {
+    exec_on(d, "BEGIN;", "migrate v6");
+    if (!query_int(d, "SELECT count(*) FROM pragma_table_info('messages') WHERE name = 'seq';"))
+        exec_on(d, "ALTER TABLE messages ADD COLUMN seq INTEGER;", "migrate v6");
+    exec_on(d,
+        "UPDATE messages SET seq = n.seq FROM ("
+        "SELECT id, row_number() OVER (PARTITION BY min(sender_id, receiver_id), max(sender_id, receiver_id) "
+        "ORDER BY id) AS seq FROM messages) AS n "
+        "WHERE messages.id = n.id;", "migrate v6");
+    exec_on(d, messages_indexes, "migrate v6");
+    set_schema_version(d, 6);
+    exec_on(d, "COMMIT;", "migrate v6");
+}
+
+static void migrate_schema(void) {
+    int has_messages = query_int(db,
+        "SELECT count(*) FROM sqlite_master WHERE type = 'table' AND name = 'messages';");
+
+    if (!has_messages) {
+        exec_or_die(users_schema, "create users");
+        exec_or_die(messages_schema, "create messages");
+        exec_or_die(messages_indexes, "create indexes");
+        exec_or_die(sessions_schema, "create sessions");
+        exec_or_die(partners_schema, "create partners");
+        exec_or_die(acks_schema, "create acks");
+        set_schema_version(db, SCHEMA_VERSION);
+        return;
+    }
+
+    int version = query_int(db, "PRAGMA user_version;");
+    if (version < 1) migrate_to_v1();
+    if (version < 2) migrate_to_v2();
+    if (version < 3) {
+        exec_or_die(sessions_schema, "migrate v3");
+        set_schema_version(db, 3);
+    }
+    if (version < 4) {
+        /* init_search_index() recreates them with their WHEN clauses */
+        exec_or_die("DROP TRIGGER IF EXISTS messages_fts_ai;"
+                    "DROP TRIGGER IF EXISTS messages_fts_ad;"
+                    "DROP TRIGGER IF EXISTS messages_fts_au;", "migrate v4");
+        set_schema_version(db, 4);
+    }
+    if (version < 5) {
+        exec_or_die("BEGIN;", "migrate v5");
+        exec_or_die(partners_schema, "migrate v5");
+        exec_or_die(partners_fill, "migrate v5");
+        set_schema_version(db, 5);
+        exec_or_die("COMMIT;", "migrate v5");
+    }
+    if (version < 6) {
+        log_info("Numbering conversations...");
+        exec_or_die(acks_schema, "migrate v6");
+        migrate_seq(db);
+    }
+}
+
+/* ---- sharded layout ---- */
+
+static const char *meta_schema =
+    "CREATE TABLE IF NOT EXISTS meta ("
+    "key TEXT PRIMARY KEY,"
+    "value INTEGER NOT NULL"
+    ");";
+
+/* main.db of a sharded store: everything except messages. The shard
+ * count is recorded, since rows cannot be found again under another. */
+static void prepare_main_sharded(int n) {
+    exec_or_die(users_schema, "create users");
+    exec_or_die(sessions_schema, "create sessions");
+    exec_or_die(partners_schema, "create partners");
+    exec_or_die(acks_schema, "create acks");
+    exec_or_die(meta_schema, "create meta");
+    set_schema_version(db, SCHEMA_VERSION);
+
+    int recorded = query_int(db, "SELECT value FROM meta WHERE key = 'shards';");
+    if (recorded && recorded != n) {
+        fprintf(stderr, "DB error: store was created with --shards %d\n", recorded);
         exit(1);
     }
+    char sql[96];
+    snprintf(sql, sizeof(sql), "INSERT OR IGNORE INTO meta (key, value) VALUES ('shards', %d);", n);
+    exec_or_die(sql, "meta");
+}
 
-    log_info("Database ready.");
+/* a shard file holds messages and their search index only */
+static void prepare_shard(sqlite3 *d) {
+    int has_messages = query_int(d,
+        "SELECT count(*) FROM sqlite_master WHERE type = 'table' AND name = 'messages';");
+    if (!has_messages) {
+        exec_on(d, messages_schema, "create messages");
+        exec_on(d, messages_indexes, "create indexes");
+        set_schema_version(d, SCHEMA_VERSION);
+    } else if (query_int(d, "PRAGMA user_version;") < 6) {
+        migrate_seq(d);
+    }
+    init_search_index(d);
 }
 
-void store_message(const char *sender, const char *receiver, const char *text) {
-    pthread_mutex_lock(&db_lock);
+/* ---- partner summary ---- */
+
+/* Pairs already in the partners table, so store_message only writes there
+ * for the first message of a conversation. Open addressing over
+ * (low id << 32 | high id); PAIR_GONE marks a deleted entry. */
+#define PAIR_GONE 1ull
+static pthread_mutex_t pairs_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *pairs = NULL;
+static size_t pairs_cap = 0;
+static size_t pairs_used = 0;   /* live entries and PAIR_GONE markers */
+
+static uint64_t pair_key(int a, int b) {
+    uint64_t lo = (uint32_t)(a < b ? a : b), hi = (uint32_t)(a < b ? b : a);
+    return lo << 32 | hi;
+}
+
+static size_t pair_slot(uint64_t key, size_t cap) {
+    return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 17) & (cap - 1);
+}
+
+static uint64_t *pair_find_locked(uint64_t key) {
+    if (!pairs_cap) return NULL;
+    for (size_t i = pair_slot(key, pairs_cap); pairs[i]; i = (i + 1) & (pairs_cap - 1))
+        if (pairs[i] == key) return &pairs[i];
+    return NULL;
+}
 
+static void pair_add_locked(uint64_t key) {
+    if (pair_find_locked(key)) return;
+    if ((pairs_used + 1) * 2 > pairs_cap) {
+        size_t cap = pairs_cap ? pairs_cap * 2 : 1024;
+        uint64_t *grown = calloc(cap, sizeof(*grown));
+        if (!grown) return;
+        size_t used = 0;
+        for (size_t i = 0; i < pairs_cap; i++) {
+            if (pairs[i] <= PAIR_GONE) continue;
+            size_t j = pair_slot(pairs[i], cap);
+            while (grown[j]) j = (j + 1) & (cap - 1);
+            grown[j] = pairs[i];
+            used++;
+        }
+        free(pairs);
+        pairs = grown;
+        pairs_cap = cap;
+        pairs_used = used;
+    }
+    size_t i = pair_slot(key, pairs_cap);
+    while (pairs[i]) i = (i + 1) & (pairs_cap - 1);
+    pairs[i] = key;
+    pairs_used++;
+}
+
+static void partners_load(void) {
     sqlite3_stmt *stmt = NULL;
-    const char *sql = "INSERT INTO messages (sender, receiver, content) VALUES (?, ?, ?);";
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    if (sqlite3_prepare_v2(db, "SELECT user_id, partner_id FROM partners WHERE user_id <= partner_id;",
+                           -1, &stmt, NULL) != SQLITE_OK) {
         fprintf(stderr, "DB prepare error: %s\n", sqlite3_errmsg(db));
-        pthread_mutex_unlock(&db_lock);
         return;
     }
+    pthread_mutex_lock(&pairs_lock);
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+        pair_add_locked(pair_key(sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1)));
+    pthread_mutex_unlock(&pairs_lock);
+    sqlite3_finalize(stmt);
+}
 
-    sqlite3_bind_text(stmt, 1, sender, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, receiver, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, text, -1, SQLITE_TRANSIENT);
+/* called after a message between a and b is stored */
+static void partners_note(int a, int b) {
+    uint64_t key = pair_key(a, b);
+    pthread_mutex_lock(&pairs_lock);
+    int known = pair_find_locked(key) != NULL;
+    pthread_mutex_unlock(&pairs_lock);
+    if (known) return;
 
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-        fprintf(stderr, "DB step error: %s\n", sqlite3_errmsg(db));
+    db_lock_acquire();
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO partners (user_id, partner_id) VALUES (?, ?), (?, ?);",
+                           -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, a);
+        sqlite3_bind_int(stmt, 2, b);
+        sqlite3_bind_int(stmt, 3, b);
+        sqlite3_bind_int(stmt, 4, a);
+        if (sqlite3_step(stmt) == SQLITE_DONE) {
+            pthread_mutex_lock(&pairs_lock);
+            pair_add_locked(key);
+            pthread_mutex_unlock(&pairs_lock);
+        }
+        sqlite3_finalize(stmt);
     }
-    sqlite3_finalize(stmt);
+    UNLOCK(db_lock);
+}
+
+static void partners_forget(int a, int b) {
+    db_lock_acquire();
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, "DELETE FROM partners WHERE (user_id = ? AND partner_id = ?) "
+                               "OR (user_id = ? AND partner_id = ?);", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, a);
+        sqlite3_bind_int(stmt, 2, b);
+        sqlite3_bind_int(stmt, 3, b);
+        sqlite3_bind_int(stmt, 4, a);
+        sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+    }
+    pthread_mutex_lock(&pairs_lock);
+    uint64_t *slot = pair_find_locked(pair_key(a, b));
+    if (slot) *slot = PAIR_GONE;
+    pthread_mutex_unlock(&pairs_lock);
+    UNLOCK(db_lock);
+}
 
-    pthread_mutex_unlock(&db_lock);
+/* a deleted conversation numbers from 1 again, so its acks go too */
+static void acks_forget(int a, int b) {
+    db_lock_acquire();
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, "DELETE FROM acks WHERE (user_id = ? AND partner_id = ?) "
+                               "OR (user_id = ? AND partner_id = ?);", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, a);
+        sqlite3_bind_int(stmt, 2, b);
+        sqlite3_bind_int(stmt, 3, b);
+        sqlite3_bind_int(stmt, 4, a);
+        sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+    }
+    UNLOCK(db_lock);
 }
 
-void handle_getmessages_db_and_send(const char *requester, int requester_sock, const char *target) {
-    pthread_mutex_lock(&db_lock);
+/* ---- storage profiles (--storage) ---- */
+
+typedef struct {
+    const char *name;
+    const char *journal_mode;
+    const char *synchronous;
+    int cache_kb;               /* page cache per connection */
+    long long mmap_bytes;
+    int page_size;              /* only a new file takes it */
+} storage_settings_t;
 
+static const storage_settings_t storage_profiles[] = {
+    [STORAGE_DURABLE]    = { "durable",    "DELETE", "FULL",   2000,  0,                 4096 },
+    [STORAGE_BALANCED]   = { "balanced",   "WAL",    "NORMAL", 16384, 64LL << 20,        4096 },
+    [STORAGE_THROUGHPUT] = { "throughput", "WAL",    "OFF",    65536, 256LL << 20,       8192 },
+};
+
+int storage_parse(const char *name) {
+    for (int i = 0; i < (int)(sizeof(storage_profiles) / sizeof(storage_profiles[0])); i++) {
+        if (strcasecmp(name, storage_profiles[i].name) == 0) {
+            config.storage_profile = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const char *storage_name(void) {
+    return storage_profiles[config.storage_profile].name;
+}
+
+static void query_text(sqlite3 *d, const char *sql, char *out, size_t size) {
+    out[0] = '\0';
     sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(d, sql, -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0))
+            snprintf(out, size, "%s", (const char *)sqlite3_column_text(stmt, 0));
+        sqlite3_finalize(stmt);
+    }
+}
+
+/* Applies the profile to a newly opened connection. `wal` forces WAL
+ * whatever the profile says: shards are read and written through
+ * separate connections. A journal mode that can't be changed (another
+ * process, e.g. the one being taken over, has the file open) is kept. */
+void db_tune(sqlite3 *d, int wal) {
+    const storage_settings_t *p = &storage_profiles[config.storage_profile];
+    const char *file = sqlite3_db_filename(d, "main");
+    char sql[96], mode[16];
+
+    if (query_int(d, "SELECT count(*) FROM sqlite_master;") == 0) {
+        snprintf(sql, sizeof(sql), "PRAGMA page_size = %d;", p->page_size);
+        exec_on(d, sql, "page_size");
+    } else if (query_int(d, "PRAGMA page_size;") != p->page_size) {
+        log_info("%s keeps its page size of %d bytes.", file, query_int(d, "PRAGMA page_size;"));
+    }
+
+    const char *want = wal ? "WAL" : p->journal_mode;
+    snprintf(sql, sizeof(sql), "PRAGMA journal_mode = %s;", want);
+    query_text(d, sql, mode, sizeof(mode));
+    if (strcasecmp(mode, want) != 0) {
+        if (wal) {
+            fprintf(stderr, "DB error (WAL on %s): %s\n", file, sqlite3_errmsg(d));
+            exit(1);
+        }
+        query_text(d, "PRAGMA journal_mode;", mode, sizeof(mode));
+        log_info("%s stays in journal mode %s.", file, mode);
+    }
+
+    snprintf(sql, sizeof(sql), "PRAGMA synchronous = %s;", p->synchronous);
+    exec_on(d, sql, "synchronous");
+    snprintf(sql, sizeof(sql), "PRAGMA cache_size = -%d;", p->cache_kb);
+    exec_on(d, sql, "cache_size");
+    snprintf(sql, sizeof(sql), "PRAGMA mmap_size = %lld;", p->mmap_bytes);
+    query_text(d, sql, mode, sizeof(mode));
+}
+
+void init_database(const char *filename) {
+    char path[4096];
+    if (config.shards > 0) {
+        if (mkdir(filename, 0700) < 0 && errno != EEXIST) die(filename);
+        snprintf(path, sizeof(path), "%s/" SHARD_MAIN_FILE, filename);
+    } else {
+        snprintf(path, sizeof(path), "%s", filename);
+    }
+
+    if (sqlite3_open(path, &db)) {
+        fprintf(stderr, "Cannot open DB: %s\n", sqlite3_errmsg(db));
+        exit(1);
+    }
+    /* a --takeover process opens the file while the old one still writes */
+    sqlite3_busy_timeout(db, 5000);
+    db_tune(db, 0);
+
+    if (config.shards > 0) {
+        prepare_main_sharded(config.shards);
+        shards_open(filename, config.shards, prepare_shard);
+    } else {
+        migrate_schema();
+        init_search_index(db);
+        shards_init_single();
+    }
+    users_load();
+    partners_load();
+
+    log_info("Database ready (storage %s).", storage_name());
+}
+
+/* ---- warm-up (--warmup) ---- */
+
+/* a conversation in one direction */
+static uint64_t warm_key(int sender_id, int receiver_id) {
+    return (uint64_t)(uint32_t)sender_id << 32 | (uint32_t)receiver_id;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int int_cmp(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* reads the newest rows of one shard, newest first, and collects their
+ * conversations in both directions; returns the number of rows */
+static long long warm_rows(shard_t *s, uint64_t **keys, size_t *nkeys) {
+    size_t cap = 0;
+    long long rows = 0, before = INT64_MAX;
     const char *sql =
-        "SELECT timestamp, sender, receiver, content FROM messages "
-        "WHERE (sender = ? AND receiver = ?) OR (sender = ? AND receiver = ?) "
-        "ORDER BY id ASC;";
+        "SELECT id, sender_id, receiver_id, length(content) FROM messages "
+        "WHERE id < ? ORDER BY id DESC LIMIT ?;";
+    while (rows < WARMUP_ROWS) {
+        int got = 0;
+        lockprof_acquire(s->lock, LOCKPROF_SITE("warmup"));
+        sqlite3_stmt *stmt = NULL;
+        if (sqlite3_prepare_v2(s->db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, before);
+            sqlite3_bind_int(stmt, 2, WARMUP_CHUNK);
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                before = sqlite3_column_int64(stmt, 0);
+                int a = sqlite3_column_int(stmt, 1), b = sqlite3_column_int(stmt, 2);
+                got++;
+                if (*nkeys + 2 > cap) {
+                    cap = cap ? 2 * cap : 256;
+                    uint64_t *grown = realloc(*keys, cap * sizeof(**keys));
+                    if (!grown) continue;
+                    *keys = grown;
+                }
+                (*keys)[(*nkeys)++] = warm_key(a, b);
+                (*keys)[(*nkeys)++] = warm_key(b, a);
+            }
+            sqlite3_finalize(stmt);
+        }
+        lockprof_release(s->lock);
+        rows += got;
+        if (got < WARMUP_CHUNK) break;
+        usleep(WARMUP_YIELD_MS * 1000);
+    }
+    return rows;
+}
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        pthread_mutex_unlock(&db_lock);
-        send_to_sock(requester_sock, "ERROR: DB prepare failed\n");
+/* Walks one index range with `stmt`, which selects (key, id) in order
+ * from ?3/?4 on, at most ?5 rows. Each WARMUP_CHUNK entries take one lock
+ * hold, then the walk resumes past the last entry read, so a long
+ * conversation never holds the shard for its whole length. Returns the
+ * entries read. */
+static long long warm_range(shard_t *s, sqlite3_stmt *stmt, int a, int b) {
+    long long key = LLONG_MIN, id = LLONG_MIN, total = 0;
+    for (;;) {
+        int got = 0;
+        lockprof_acquire(s->lock, LOCKPROF_SITE("warmup"));
+        sqlite3_bind_int(stmt, 1, a);
+        sqlite3_bind_int(stmt, 2, b);
+        sqlite3_bind_int64(stmt, 3, key);
+        sqlite3_bind_int64(stmt, 4, id);
+        sqlite3_bind_int(stmt, 5, WARMUP_CHUNK);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            key = sqlite3_column_int64(stmt, 0);
+            id = sqlite3_column_int64(stmt, 1);
+            got++;
+        }
+        sqlite3_reset(stmt);
+        lockprof_release(s->lock);
+        total += got;
+        if (got < WARMUP_CHUNK) return total;
+        usleep(WARMUP_YIELD_MS * 1000);
+    }
+}
+
+/* the history and redelivery ranges of each conversation direction, and
+ * the receiver range once per receiver rather than once per partner */
+static void *warmup_thread(void *arg) {
+    (void)arg;
+    enum { PAIR_TS, PAIR_SEQ, RECEIVER_TS, NSTMTS };
+    static const char *const index_sql[NSTMTS] = {
+        [PAIR_TS] = "SELECT timestamp, id FROM messages INDEXED BY idx_messages_pair_ts "
+                    "WHERE sender_id = ?1 AND receiver_id = ?2 AND (timestamp, id) > (?3, ?4) "
+                    "ORDER BY timestamp, id LIMIT ?5;",
+        [PAIR_SEQ] = "SELECT seq, id FROM messages INDEXED BY idx_messages_pair_seq "
+                     "WHERE sender_id = ?1 AND receiver_id = ?2 AND (seq, id) > (?3, ?4) "
+                     "ORDER BY seq, id LIMIT ?5;",
+        [RECEIVER_TS] = "SELECT timestamp, id FROM messages INDEXED BY idx_messages_receiver_ts "
+                        "WHERE receiver_id = ?2 AND (timestamp, id) > (?3, ?4) "
+                        "ORDER BY timestamp, id LIMIT ?5;",
+    };
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long long rows = 0, entries = 0;
+    size_t conversations = 0, receivers = 0;
+
+    for (int i = 0; i < nshards; i++) {
+        shard_t *s = &shards[i];
+        uint64_t *keys = NULL;
+        size_t nkeys = 0;
+        rows += warm_rows(s, &keys, &nkeys);
+        qsort(keys, nkeys, sizeof(*keys), u64_cmp);
+
+        sqlite3_stmt *stmts[NSTMTS] = { NULL };
+        lockprof_acquire(s->lock, LOCKPROF_SITE("warmup"));
+        for (int j = 0; j < NSTMTS; j++)
+            if (sqlite3_prepare_v2(s->db, index_sql[j], -1, &stmts[j], NULL) != SQLITE_OK) stmts[j] = NULL;
+        lockprof_release(s->lock);
+
+        int *rcv = nkeys ? malloc(nkeys * sizeof(*rcv)) : NULL;
+        size_t nrcv = 0;
+        for (size_t k = 0; k < nkeys; k++) {
+            if (k && keys[k] == keys[k - 1]) continue;
+            int a = (int)(keys[k] >> 32), b = (int)(uint32_t)keys[k];
+            for (int j = PAIR_TS; j <= PAIR_SEQ; j++)
+                if (stmts[j]) entries += warm_range(s, stmts[j], a, b);
+            if (rcv) rcv[nrcv++] = b;
+            conversations++;
+            usleep(WARMUP_YIELD_MS * 1000);
+        }
+
+        /* keys are sorted by sender, so receivers repeat out of order */
+        if (rcv) qsort(rcv, nrcv, sizeof(*rcv), int_cmp);
+        for (size_t k = 0; k < nrcv && stmts[RECEIVER_TS]; k++) {
+            if (k && rcv[k] == rcv[k - 1]) continue;
+            entries += warm_range(s, stmts[RECEIVER_TS], 0, rcv[k]);
+            receivers++;
+            usleep(WARMUP_YIELD_MS * 1000);
+        }
+        free(rcv);
+
+        lockprof_acquire(s->lock, LOCKPROF_SITE("warmup"));
+        for (int j = 0; j < NSTMTS; j++) sqlite3_finalize(stmts[j]);
+        lockprof_release(s->lock);
+        free(keys);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    log_info("Warm-up done: %lld messages, %zu conversation directions, %zu receivers, "
+             "%lld index entries in %lld ms.", rows, conversations, receivers, entries,
+             (long long)(t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000);
+    return NULL;
+}
+
+/* runs once the listener is up, so clients are served while it reads */
+void db_warmup_start(void) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, warmup_thread, NULL) != 0) {
+        perror("pthread_create");
         return;
     }
+    pthread_detach(tid);
+}
 
-    sqlite3_bind_text(stmt, 1, requester, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, target, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, target, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 4, requester, -1, SQLITE_TRANSIENT);
+/* the shard holding the conversation between ids a and b; channel posts
+ * are kept together under the channel */
+static shard_t *conversation_shard(int a, int b) {
+    if (nshards == 1) return &shards[0];
+    if (user_name(b)[0] == CHANNEL_PREFIX) return &shards[shard_of(b, b)];
+    if (user_name(a)[0] == CHANNEL_PREFIX) return &shards[shard_of(a, a)];
+    return &shards[shard_of(a, b)];
+}
 
-    char line[BUF_SIZE];
-    int row_count = 0;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        const unsigned char *ts = sqlite3_column_text(stmt, 0);
-        const unsigned char *sender = sqlite3_column_text(stmt, 1);
-        const unsigned char *receiver = sqlite3_column_text(stmt, 2);
-        const unsigned char *content = sqlite3_column_text(stmt, 3);
+static unsigned long long shard_bit(const shard_t *s) {
+    return 1ull << (s - shards);
+}
+
+/* the insert is the hottest statement: prepared once, reset per call.
+ * Guarded by db_lock like every other use of `db`. Sharded stores prepare
+ * theirs on each shard's writer connection instead. */
+static sqlite3_stmt *insert_stmt = NULL;
+
+/* returns the new message id, 0 on failure; *seq (if not NULL) gets the
+ * message's number in its conversation */
+long long store_message(const char *sender, const char *receiver, const char *text, long long *seq) {
+    trace_span_t span, step;
+    TRACE_BEGIN(&span);
 
-        snprintf(line, sizeof(line), "%s %s->%s: %s\n",
+    /* interning may insert into users, so it runs before db_lock is taken */
+    int sender_id = user_intern(sender);
+    int receiver_id = user_intern(receiver);
+    if (!sender_id || !receiver_id) return 0;
+
+    shard_t *s = conversation_shard(sender_id, receiver_id);
+    if (s->wdb) {
+        TRACE_BEGIN(&step);
+        long long id = shard_store(s, sender_id, receiver_id, text, (long long)time(NULL), seq);
+        TRACE_END(&step, "shard insert");
+        if (id) partners_note(sender_id, receiver_id);
+        TRACE_END(&span, "store_message");
+        return id;
+    }
+
+    db_lock_acquire();
+
+    if (!insert_stmt) {
+        const char *sql =
+            "INSERT INTO messages (sender_id, receiver_id, content, timestamp, seq) "
+            "VALUES (?1, ?2, ?3, ?4, " MESSAGE_NEXT_SEQ("?1", "?2") ") RETURNING id, seq;";
+        if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &insert_stmt, NULL) != SQLITE_OK) {
+            fprintf(stderr, "DB prepare error: %s\n", sqlite3_errmsg(db));
+            insert_stmt = NULL;
+            UNLOCK(db_lock);
+            return 0;
+        }
+    }
+    sqlite3_stmt *stmt = insert_stmt;
+
+    sqlite3_bind_int(stmt, 1, sender_id);
+    sqlite3_bind_int(stmt, 2, receiver_id);
+    /* `text` outlives the step, so SQLite need not copy it */
+    sqlite3_bind_text(stmt, 3, text, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, (sqlite3_int64)time(NULL));
+
+    long long id = 0;
+    TRACE_BEGIN(&step);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        id = sqlite3_column_int64(stmt, 0);
+        if (seq) *seq = sqlite3_column_int64(stmt, 1);
+        if (sqlite3_step(stmt) != SQLITE_DONE) id = 0;
+    }
+    if (!id) fprintf(stderr, "DB step error: %s\n", sqlite3_errmsg(db));
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    TRACE_END(&step, "sqlite insert");
+
+    UNLOCK(db_lock);
+    if (id) partners_note(sender_id, receiver_id);
+    TRACE_END(&span, "store_message");
+    return id;
+}
+
+void close_database(void) {
+    shards_close();
+    db_lock_acquire();
+    if (insert_stmt) sqlite3_finalize(insert_stmt);
+    insert_stmt = NULL;
+    if (db) sqlite3_close(db);
+    db = NULL;
+    UNLOCK(db_lock);
+}
+
+/* every request takes db_lock through db_lock_acquire(), so overload
+ * protection sees how long requests queue for the database and the lock
+ * profiler attributes the wait to the calling site */
+void db_lock_acquire_at(lockprof_site_t *site) {
+    long long waited = lockprof_acquire(&db_lock, site);
+    overload_note_db_wait(waited);
+    if (waited && trace_current)
+        trace_record("db_lock wait", trace_now_us() - waited / 1000, waited / 1000);
+}
+
+/* every listing selects the same columns from `messages m`. Large
+ * messages are BLOBs written by the streaming path; typeof()/length() let
+ * SQLite answer without loading them, so a listing never pulls a whole
+ * large payload into memory. The raw timestamp orders merged results. */
+#define MESSAGE_COLUMNS \
+    "datetime(m.timestamp, 'unixepoch'), m.sender_id, m.receiver_id, " \
+    "CASE WHEN typeof(m.content) = 'blob' THEN NULL ELSE m.content END, m.id, length(m.content), " \
+    "m.timestamp, m.seq "
+#define COL_SENDER 1
+#define COL_ID 4
+#define COL_TIMESTAMP 6
+#define COL_SEQ 7
+#define COL_RANK 8
+
+static void format_message_row(sqlite3_stmt *stmt, char *line, size_t line_size) {
+    const unsigned char *ts = sqlite3_column_text(stmt, 0);
+    const unsigned char *content = sqlite3_column_text(stmt, 3);
+
+    if (!content && sqlite3_column_int64(stmt, 5) > 0) {
+        snprintf(line, line_size, "%s %s->%s: [large message, %lld bytes: getbig %lld]\n",
                  ts ? (const char*)ts : "",
-                 sender ? (const char*)sender : "",
-                 receiver ? (const char*)receiver : "",
-                 content ? (const char*)content : "");
-        send_to_sock(requester_sock, line);
-        row_count++;
+                 user_name(sqlite3_column_int(stmt, 1)),
+                 user_name(sqlite3_column_int(stmt, 2)),
+                 (long long)sqlite3_column_int64(stmt, 5),
+                 (long long)sqlite3_column_int64(stmt, 4));
+        return;
     }
 
-    if (row_count == 0) send_to_sock(requester_sock, "(no messages)\n");
+    if (!content && sqlite3_column_type(stmt, 5) == SQLITE_NULL) {
+        snprintf(line, line_size, "%s %s->%s: [large message aborted]\n",
+                 ts ? (const char*)ts : "",
+                 user_name(sqlite3_column_int(stmt, 1)),
+                 user_name(sqlite3_column_int(stmt, 2)));
+        return;
+    }
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_lock);
+    snprintf(line, line_size, "%s %s->%s: %s\n",
+             ts ? (const char*)ts : "",
+             user_name(sqlite3_column_int(stmt, 1)),
+             user_name(sqlite3_column_int(stmt, 2)),
+             content ? (const char*)content : "");
+}
+
+/* Formatted rows gathered from one or more shards and put in order by
+ * (key, id) before anything is sent. The lines share one buffer. */
+typedef struct {
+    double key;
+    long long id;
+    long long seq;
+    int sender_id;
+    size_t off;
+    size_t len;
+} msg_row_t;
+
+typedef struct {
+    msg_row_t *rows;
+    size_t n;
+    size_t cap;
+    strbuf_t text;
+    size_t limit;               /* keep only the newest `limit` rows, 0 = all */
+    int truncated;              /* rows were dropped to stay within it */
+} rowset_t;
+
+typedef void (*bind_fn)(sqlite3_stmt *stmt, void *arg);
+
+static void rowset_init(rowset_t *rs) {
+    memset(rs, 0, sizeof(*rs));
+    sb_init(&rs->text);
+}
+
+static void rowset_free(rowset_t *rs) {
+    free(rs->rows);
+    sb_free(&rs->text);
+}
+
+static int row_cmp(const void *a, const void *b) {
+    const msg_row_t *x = a, *y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+/* sorts, then keeps the rows with the largest keys up to rs->limit and
+ * copies their text into a fresh buffer, so the dropped lines' memory
+ * goes too */
+static void rowset_trim(rowset_t *rs) {
+    qsort(rs->rows, rs->n, sizeof(*rs->rows), row_cmp);
+    if (rs->n <= rs->limit) return;
+    size_t drop = rs->n - rs->limit;
+    strbuf_t text;
+    sb_init(&text);
+    for (size_t i = 0; i < rs->limit; i++) {
+        msg_row_t r = rs->rows[drop + i];
+        size_t off = text.len;
+        sb_append(&text, rs->text.data + r.off, r.len);
+        r.off = off;
+        rs->rows[i] = r;
+    }
+    sb_free(&rs->text);
+    rs->text = text;
+    rs->n = rs->limit;
+    rs->truncated = 1;
+}
+
+/* line prefixes for collect_rows() */
+#define ROW_PLAIN 0
+#define ROW_ID 1                /* "#<id> " */
+#define ROW_ID_SEQ 2            /* "#<id>/<seq> " */
+
+/* Runs `sql` (MESSAGE_COLUMNS first) on every shard in `mask`, each under
+ * its own lock, keyed by column `keycol`. Each line starts with `prefix`.
+ * Rows from several shards are merged. With rs->limit set, the set is
+ * trimmed to the largest keys whenever it doubles, so it never holds more
+ * than twice the limit. Returns 0 if a statement could not be prepared or
+ * failed part way. */
+static int collect_rows(unsigned long long mask, const char *sql, bind_fn bind, void *arg,
+                        int keycol, int prefix, rowset_t *rs) {
+    char line[BUF_SIZE];
+    int ok = 1;
+    int touched = 0;
+    for (int i = 0; i < nshards && ok; i++) {
+        if (!(mask & (1ull << i))) continue;
+        shard_t *s = &shards[i];
+        touched++;
+
+        shard_lock(s);
+        sqlite3_stmt *stmt = NULL;
+        if (sqlite3_prepare_v2(s->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+            shard_unlock(s);
+            return 0;
+        }
+        bind(stmt, arg);
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (rs->n == rs->cap) {
+                size_t cap = rs->cap ? 2 * rs->cap : 64;
+                msg_row_t *grown = realloc(rs->rows, cap * sizeof(*grown));
+                if (!grown) { rc = SQLITE_NOMEM; break; }
+                rs->rows = grown;
+                rs->cap = cap;
+            }
+            msg_row_t *r = &rs->rows[rs->n];
+            r->key = sqlite3_column_double(stmt, keycol);
+            r->id = sqlite3_column_int64(stmt, COL_ID);
+            r->seq = sqlite3_column_int64(stmt, COL_SEQ);
+            r->sender_id = sqlite3_column_int(stmt, COL_SENDER);
+            r->off = rs->text.len;
+            format_message_row(stmt, line, sizeof(line));
+            if (prefix == ROW_ID) sb_appendf(&rs->text, "#%lld ", r->id);
+            else if (prefix == ROW_ID_SEQ) sb_appendf(&rs->text, "#%lld/%lld ", r->id, r->seq);
+            sb_append(&rs->text, line, strlen(line));
+            r->len = rs->text.len - r->off;
+            rs->n++;
+            if (rs->limit && rs->n >= 2 * rs->limit) rowset_trim(rs);
+        }
+        if (rc != SQLITE_DONE) ok = 0;
+        sqlite3_finalize(stmt);
+        shard_unlock(s);
+    }
+    if (rs->limit) rowset_trim(rs);
+    else if (touched > 1) qsort(rs->rows, rs->n, sizeof(*rs->rows), row_cmp);
+    return ok;
+}
+
+/* rows [from, to) in batches of about HISTORY_BATCH_BYTES */
+static void send_rows(int sock, const rowset_t *rs, size_t from, size_t to, strbuf_t *out) {
+    for (size_t i = from; i < to; i++) {
+        sb_append(out, rs->text.data + rs->rows[i].off, rs->rows[i].len);
+        if (out->len >= HISTORY_BATCH_BYTES) {
+            session_send_bulk(sock, out->data, out->len);
+            out->len = 0;
+        }
+    }
+}
+
+typedef struct {
+    int requester_id;
+    const int *partner_ids;
+    int nids;
+    long long since, until;
+} history_args_t;
+
+static void bind_history(sqlite3_stmt *stmt, void *arg) {
+    const history_args_t *h = arg;
+    int idx = 1;
+    sqlite3_bind_int(stmt, idx++, h->requester_id);
+    for (int i = 0; i < h->nids; i++)
+        sqlite3_bind_int(stmt, idx++, h->partner_ids[i]);
+    sqlite3_bind_int(stmt, idx++, h->requester_id);
+    for (int i = 0; i < h->nids; i++)
+        sqlite3_bind_int(stmt, idx++, h->partner_ids[i]);
+    sqlite3_bind_int64(stmt, idx++, h->since);
+    sqlite3_bind_int64(stmt, idx++, h->until);
+    sqlite3_bind_int(stmt, idx++, HISTORY_MAX_ROWS + 1);
+}
+
+/* one query path for every history view: the requester's conversations with
+ * `partners` (all partners when npartners == 0), bounded by [since, until].
+ * Both bounds are epoch seconds; HISTORY_NO_LIMIT_LOW/HIGH leave a side open.
+ * Named partners only touch their conversations' shards. Each shard is read
+ * newest first and stops past HISTORY_MAX_ROWS, so a long history costs
+ * bounded memory; the reply says when older messages were left out. */
+void handle_history_db_and_send(const char *requester, int requester_sock,
+                                const char *const *partners, int npartners,
+                                long long since, long long until) {
+    int requester_id = user_lookup(requester);
+    int partner_ids[MAX_ROOM_USERS];
+    int nids = 0;
+
+    if (npartners > MAX_ROOM_USERS) npartners = MAX_ROOM_USERS;
+    for (int i = 0; i < npartners; i++) {
+        int id = user_lookup(partners[i]);
+        if (id) partner_ids[nids++] = id;
+    }
+
+    /* unknown names have no stored messages */
+    if (!requester_id || (npartners > 0 && nids == 0)) {
+        send_to_sock(requester_sock, "(no messages)\n");
+        return;
+    }
+
+    /* placeholders only, ids are always bound */
+    char sql[1024];
+    char in_list[2 * MAX_ROOM_USERS + 1] = {0};
+    for (int i = 0; i < nids; i++)
+        strcat(in_list, i ? ",?" : "?");
+
+    unsigned long long mask = 0;
+    if (nids == 0) {
+        mask = shard_mask_all();
+        snprintf(sql, sizeof(sql),
+            "SELECT " MESSAGE_COLUMNS "FROM messages m "
+            "WHERE (sender_id = ? OR receiver_id = ?) AND timestamp BETWEEN ? AND ? "
+            "ORDER BY timestamp DESC, id DESC LIMIT ?;");
+    } else {
+        for (int i = 0; i < nids; i++)
+            mask |= shard_bit(conversation_shard(requester_id, partner_ids[i]));
+        snprintf(sql, sizeof(sql),
+            "SELECT " MESSAGE_COLUMNS "FROM messages m "
+            "WHERE ((sender_id = ? AND receiver_id IN (%s)) OR (receiver_id = ? AND sender_id IN (%s))) "
+            "AND timestamp BETWEEN ? AND ? "
+            "ORDER BY timestamp DESC, id DESC LIMIT ?;", in_list, in_list);
+    }
+
+    history_args_t args = { requester_id, partner_ids, nids, since, until };
+    rowset_t rs;
+    rowset_init(&rs);
+    rs.limit = HISTORY_MAX_ROWS;
+    if (!collect_rows(mask, sql, bind_history, &args, COL_TIMESTAMP, ROW_PLAIN, &rs)) {
+        rowset_free(&rs);
+        send_to_sock(requester_sock, "ERROR: DB prepare failed\n");
+        return;
+    }
+
+    /* rows are batched so a long history is a few large writes (and, with
+     * compression on, a few well-compressed frames) rather than one per row */
+    strbuf_t out;
+    sb_init(&out);
+    if (rs.truncated)
+        sb_appendf(&out, "(newest %d messages; use since/until for older ones)\n", HISTORY_MAX_ROWS);
+    send_rows(requester_sock, &rs, 0, rs.n, &out);
+    if (rs.n == 0) sb_append(&out, "(no messages)\n", 14);
+    if (out.len) session_send_bulk(requester_sock, out.data, out.len);
+    sb_free(&out);
+    rowset_free(&rs);
 }
 
+void handle_getmessages_db_and_send(const char *requester, int requester_sock, const char *target,
+                                    long long since, long long until) {
+    handle_history_db_and_send(requester, requester_sock, &target, 1, since, until);
+}
+
+static void export_forget(int a, int b);
+
 void handle_deletemessages_db(const char *user_a, const char *user_b, int requester_sock) {
-    pthread_mutex_lock(&db_lock);
+    int a = user_lookup(user_a);
+    int b = user_lookup(user_b);
+    if (!a || !b) {
+        send_to_sock(requester_sock, "OK: messages deleted\n");
+        return;
+    }
+
+    shard_t *s = conversation_shard(a, b);
+    shard_lock(s);
 
     sqlite3_stmt *stmt = NULL;
     const char *sql =
-        "DELETE FROM messages WHERE (sender = ? AND receiver = ?) OR (sender = ? AND receiver = ?);";
+        "DELETE FROM messages WHERE (sender_id = ? AND receiver_id = ?) OR (sender_id = ? AND receiver_id = ?);";
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        pthread_mutex_unlock(&db_lock);
+    if (sqlite3_prepare_v2(s->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        shard_unlock(s);
         send_to_sock(requester_sock, "ERROR: DB prepare failed\n");
         return;
     }
 
-    sqlite3_bind_text(stmt, 1, user_a, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, user_b, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, user_b, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 4, user_a, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 1, a);
+    sqlite3_bind_int(stmt, 2, b);
+    sqlite3_bind_int(stmt, 3, b);
+    sqlite3_bind_int(stmt, 4, a);
 
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-        send_to_sock(requester_sock, "ERROR: delete failed\n");
-    } else {
+    int ok = sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_finalize(stmt);
+    shard_unlock(s);
+
+    if (ok) {
+        partners_forget(a, b);
+        acks_forget(a, b);
+        export_forget(a, b);
         send_to_sock(requester_sock, "OK: messages deleted\n");
+    } else {
+        send_to_sock(requester_sock, "ERROR: delete failed\n");
     }
+}
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_lock);
+static void bind_user_twice(sqlite3_stmt *stmt, void *arg) {
+    int user_id = *(const int *)arg;
+    sqlite3_bind_int(stmt, 1, user_id);
+    sqlite3_bind_int(stmt, 2, user_id);
 }
 
 void get_messages_for_user(const char *username, char *out, size_t out_size)
 {
     out[0] = '\0';
 
-    pthread_mutex_lock(&db_lock);
+    int user_id = user_lookup(username);
+    if (!user_id) {
+        snprintf(out, out_size, "(no messages)\n");
+        return;
+    }
 
-    sqlite3_stmt *stmt;
     const char *sql =
-        "SELECT timestamp, sender, receiver, content "
-        "FROM messages WHERE sender = ? OR receiver = ? "
-        "ORDER BY id ASC;";
+        "SELECT " MESSAGE_COLUMNS
+        "FROM messages m WHERE sender_id = ? OR receiver_id = ? "
+        "ORDER BY timestamp ASC, id ASC;";
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        pthread_mutex_unlock(&db_lock);
+    rowset_t rs;
+    rowset_init(&rs);
+    if (!collect_rows(shard_mask_all(), sql, bind_user_twice, &user_id, COL_TIMESTAMP, ROW_PLAIN, &rs)) {
+        rowset_free(&rs);
         snprintf(out, out_size, "ERROR reading DB\n");
         return;
     }
 
-    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, username, -1, SQLITE_TRANSIENT);
+    for (size_t i = 0; i < rs.n; i++) {
+        size_t room = out_size - strlen(out) - 1;
+        size_t n = rs.rows[i].len < room ? rs.rows[i].len : room;
+        strncat(out, rs.text.data + rs.rows[i].off, n);
+    }
 
-    char line[256];
-    int count = 0;
+    if (rs.n == 0)
+        strncat(out, "(no messages)\n", out_size - strlen(out) - 1);
+    rowset_free(&rs);
+}
+
+/* distinct conversation partners of `username`, by name, from the partner
+ * summary in the main database; sent in one write after db_lock is
+ * released */
+int handle_chatrooms_db_and_send(const char *username, int sock) {
+    int user_id = user_lookup(username);
+    if (!user_id) return 0;
 
+    db_lock_acquire();
+
+    sqlite3_stmt *stmt = NULL;
+    const char *sql =
+        "SELECT u.name FROM partners p JOIN users u ON u.id = p.partner_id "
+        "WHERE p.user_id = ? ORDER BY u.name ASC;";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        UNLOCK(db_lock);
+        send_to_sock(sock, "ERROR: DB prepare failed\n");
+        return -1;
+    }
+
+    sqlite3_bind_int(stmt, 1, user_id);
+
+    strbuf_t out;
+    sb_init(&out);
+    int i = 0;
     while (sqlite3_step(stmt) == SQLITE_ROW) {
-        const unsigned char *ts = sqlite3_column_text(stmt, 0);
-        const unsigned char *sender = sqlite3_column_text(stmt, 1);
-        const unsigned char *receiver = sqlite3_column_text(stmt, 2);
-        const unsigned char *content = sqlite3_column_text(stmt, 3);
+        const unsigned char *partner = sqlite3_column_text(stmt, 0);
+        if (partner && strlen((const char*)partner) > 0) {
+            sb_appendf(&out, "%d) Chat with %s\n", i + 1, (const char*)partner);
+            i++;
+        }
+    }
 
-        snprintf(line, sizeof(line),
-            "%s %s->%s: %s\n",
-            ts ? (const char*)ts : "",
-            sender ? (const char*)sender : "",
-            receiver ? (const char*)receiver : "",
-            content ? (const char*)content : "");
+    sqlite3_finalize(stmt);
+    UNLOCK(db_lock);
+    if (out.len) send_buf_to_sock(sock, out.data, out.len);
+    sb_free(&out);
+    return i;
+}
+
+/* turn free text into an FTS5 query: every word becomes a quoted term so
+ * user input can never be parsed as FTS syntax (AND/OR/NEAR, column filters) */
+static int build_fts_query(const char *text, char *out, size_t out_size) {
+    size_t o = 0;
+    int terms = 0;
+    const char *p = text;
 
-        strncat(out, line, out_size - strlen(out) - 1);
-        count++;
+    while (*p) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (!*p) break;
+        if (o + 4 >= out_size) break;
+        if (terms > 0) out[o++] = ' ';
+        out[o++] = '"';
+        while (*p && *p != ' ' && *p != '\t' && o + 3 < out_size) {
+            if (*p == '"') out[o++] = '"';
+            out[o++] = *p++;
+        }
+        out[o++] = '"';
+        terms++;
+        while (*p && *p != ' ' && *p != '\t') p++;
     }
+    out[o] = '\0';
+    return terms;
+}
 
-    if (count == 0)
-        strncat(out, "(no messages)\n", out_size - strlen(out) - 1);
+typedef struct {
+    const char *query;
+    int requester_id;
+    int with_id;
+    int rows;
+} search_args_t;
+
+static void bind_search(sqlite3_stmt *stmt, void *arg) {
+    const search_args_t *a = arg;
+    int idx = 1;
+    sqlite3_bind_text(stmt, idx++, a->query, -1, SQLITE_TRANSIENT);
+    if (a->with_id) {
+        sqlite3_bind_int(stmt, idx++, a->requester_id);
+        sqlite3_bind_int(stmt, idx++, a->with_id);
+        sqlite3_bind_int(stmt, idx++, a->with_id);
+        sqlite3_bind_int(stmt, idx++, a->requester_id);
+    } else {
+        sqlite3_bind_int(stmt, idx++, a->requester_id);
+        sqlite3_bind_int(stmt, idx++, a->requester_id);
+    }
+    sqlite3_bind_int(stmt, idx++, a->rows);
+}
+
+/* Each shard returns its best rows up to the end of the requested page and
+ * the page is cut from the merge. bm25 ranks come from each shard's own
+ * index, so ordering across shards is close rather than exact. */
+void handle_search_db_and_send(const char *requester, int requester_sock, const char *text,
+                               const char *with, int limit, int page) {
+    char query[BUF_SIZE];
+    if (build_fts_query(text, query, sizeof(query)) == 0) {
+        send_to_sock(requester_sock, "ERROR: usage search <text> [with <user>] [limit N] [page N]\n");
+        return;
+    }
+    if (limit <= 0) limit = SEARCH_DEFAULT_LIMIT;
+    if (limit > SEARCH_MAX_LIMIT) limit = SEARCH_MAX_LIMIT;
+    if (page <= 0) page = 1;
+    if ((long long)page * limit > SEARCH_MAX_DEPTH) {
+        char err[96];
+        snprintf(err, sizeof(err), "ERROR: search reaches at most %d results deep\n", SEARCH_MAX_DEPTH);
+        send_to_sock(requester_sock, err);
+        return;
+    }
+
+    int requester_id = user_lookup(requester);
+    int with_id = with ? user_lookup(with) : 0;
+    if (!requester_id || (with && !with_id)) {
+        send_to_sock(requester_sock, "(no matches)\n");
+        return;
+    }
+
+    /* only the requester's own conversations are searchable; best matches first */
+    const char *sql_all =
+        "SELECT " MESSAGE_COLUMNS ", rank FROM messages_fts "
+        "JOIN messages m ON m.id = messages_fts.rowid "
+        "WHERE messages_fts MATCH ? AND (m.sender_id = ? OR m.receiver_id = ?) "
+        "ORDER BY rank LIMIT ?;";
+    const char *sql_with =
+        "SELECT " MESSAGE_COLUMNS ", rank FROM messages_fts "
+        "JOIN messages m ON m.id = messages_fts.rowid "
+        "WHERE messages_fts MATCH ? AND ((m.sender_id = ? AND m.receiver_id = ?) OR (m.sender_id = ? AND m.receiver_id = ?)) "
+        "ORDER BY rank LIMIT ?;";
+
+    /* one extra row tells whether another page exists */
+    size_t skip = (size_t)(page - 1) * (size_t)limit;
+    search_args_t args = { query, requester_id, with_id, (int)(skip + (size_t)limit + 1) };
+    unsigned long long mask = with ? shard_bit(conversation_shard(requester_id, with_id))
+                                   : shard_mask_all();
+
+    rowset_t rs;
+    rowset_init(&rs);
+    int ok = collect_rows(mask, with ? sql_with : sql_all, bind_search, &args, COL_RANK, ROW_PLAIN, &rs);
+
+    strbuf_t out;
+    sb_init(&out);
+    size_t end = rs.n < skip + (size_t)limit ? rs.n : skip + (size_t)limit;
+    if (ok && skip < end) send_rows(requester_sock, &rs, skip, end, &out);
+
+    if (!ok)
+        sb_appendf(&out, "ERROR: search failed\n");
+    else if (skip >= end)
+        sb_appendf(&out, "(no matches)\n");
+    else if (rs.n > end && (long long)(page + 1) * limit <= SEARCH_MAX_DEPTH)
+        sb_appendf(&out, "(more results: add 'page %d')\n", page + 1);
+    session_send_bulk(requester_sock, out.data, out.len);
+    sb_free(&out);
+    rowset_free(&rs);
+}
+
+/* issues a fresh resume token for `username`, replacing the previous one.
+ * `out` must hold RESUME_TOKEN_LEN + 1 bytes. */
+int session_issue_token(const char *username, char *out) {
+    unsigned char raw[RESUME_TOKEN_LEN / 2];
+    if (getrandom(raw, sizeof(raw), 0) != (ssize_t)sizeof(raw)) return 0;
+    for (size_t i = 0; i < sizeof(raw); i++)
+        snprintf(out + 2 * i, 3, "%02x", raw[i]);
+
+    int user_id = user_intern(username);
+    if (!user_id) return 0;
+
+    db_lock_acquire();
+    sqlite3_stmt *stmt = NULL;
+    const char *sql =
+        "INSERT INTO sessions (user_id, token, issued_at) VALUES (?, ?, ?) "
+        "ON CONFLICT(user_id) DO UPDATE SET token = excluded.token, issued_at = excluded.issued_at;";
+    int ok = 0;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, out, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)time(NULL));
+        ok = (sqlite3_step(stmt) == SQLITE_DONE);
+        sqlite3_finalize(stmt);
+    }
+    UNLOCK(db_lock);
+    return ok;
+}
+
+int session_check_token(const char *username, const char *token) {
+    int user_id = user_lookup(username);
+    if (!user_id || !token) return 0;
+
+    db_lock_acquire();
+    sqlite3_stmt *stmt = NULL;
+    int ok = 0;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM sessions WHERE user_id = ? AND token = ?;",
+                           -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, token, -1, SQLITE_TRANSIENT);
+        ok = (sqlite3_step(stmt) == SQLITE_ROW);
+        sqlite3_finalize(stmt);
+    }
+    UNLOCK(db_lock);
+    return ok;
+}
+
+typedef struct {
+    long long last_id;
+    long long upto;
+    int user_id;
+} resume_args_t;
+
+static void bind_resume(sqlite3_stmt *stmt, void *arg) {
+    const resume_args_t *r = arg;
+    sqlite3_bind_int64(stmt, 1, r->last_id);
+    sqlite3_bind_int64(stmt, 2, r->upto);
+    sqlite3_bind_int(stmt, 3, r->user_id);
+    sqlite3_bind_int(stmt, 4, r->user_id);
+    sqlite3_bind_int(stmt, 5, RESUME_MAX_MESSAGES + 1);
+}
+
+/* every message to or from `username` with id > last_id, oldest first,
+ * assembled into one response and sent after the shard locks are released.
+ * Sharded, ids still being committed elsewhere bound the range so a later
+ * sync cannot skip them. */
+void handle_resume_db_and_send(const char *username, int sock, long long last_id) {
+    int user_id = user_lookup(username);
+    strbuf_t out;
+    sb_init(&out);
+    rowset_t rs;
+    rowset_init(&rs);
+
+    size_t count = 0;
+    long long newest = last_id;
+    int more = 0;
+
+    if (user_id) {
+        /* unary + keeps the planner on the rowid range (id > ?): a resume
+         * after a short disconnect only touches the newest rows */
+        const char *sql =
+            "SELECT " MESSAGE_COLUMNS "FROM messages m "
+            "WHERE id > ? AND id <= ? AND (+sender_id = ? OR +receiver_id = ?) "
+            "ORDER BY id ASC LIMIT ?;";
+        resume_args_t args = { last_id, shard_id_watermark(), user_id };
+        if (!collect_rows(shard_mask_all(), sql, bind_resume, &args, COL_ID, ROW_ID, &rs)) {
+            rowset_free(&rs);
+            sb_free(&out);
+            send_to_sock(sock, "ERROR: DB prepare failed\n");
+            return;
+        }
+        count = rs.n;
+        if (count > RESUME_MAX_MESSAGES) {
+            count = RESUME_MAX_MESSAGES;
+            more = 1;
+        }
+        if (count) newest = rs.rows[count - 1].id;
+    }
+
+    sb_appendf(&out, "RESUME %zu message(s) after #%lld\n", count, last_id);
+    for (size_t i = 0; i < count; i++)
+        sb_append(&out, rs.text.data + rs.rows[i].off, rs.rows[i].len);
+    if (more)
+        sb_appendf(&out, "(more: sync %lld)\n", newest);
+    sb_appendf(&out, "END RESUME #%lld\n", newest);
+    session_send_bulk(sock, out.data, out.len);
+
+    rowset_free(&rs);
+    sb_free(&out);
+}
+
+/* ---- delivery acknowledgements ---- */
+
+/* highest message id stored so far; the caller holds db_lock */
+static long long last_message_id_locked(void) {
+    if (shards[0].wdb) return shard_id_watermark();
+    sqlite3_stmt *stmt = NULL;
+    long long id = 0;
+    if (sqlite3_prepare_v2(db, "SELECT coalesce(max(id), 0) FROM messages;", -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) id = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return id;
+}
+
+/* "ack <user> <seq> ...": `username` has received every message from
+ * partners[i] numbered up to seqs[i]. Acks only move forward. The first
+ * ack makes the user an acking client; see handle_redeliver_db_and_send.
+ * Returns the number of pairs recorded, -1 on a database error. */
+int acks_store(const char *username, char partners[][USERNAME_LEN], const long long *seqs, int n) {
+    int user_id = user_intern(username);
+    if (!user_id) return -1;
+    int partner_ids[ACK_MAX_PAIRS];
+    for (int i = 0; i < n && i < ACK_MAX_PAIRS; i++)
+        partner_ids[i] = user_lookup(partners[i]);
+
+    int stored = 0, ok = 1;
+    db_lock_acquire();
+    /* not exec_or_die: a busy or failing database fails this ack, not the server */
+    if (sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "DB error (acks): %s\n", sqlite3_errmsg(db));
+        UNLOCK(db_lock);
+        return -1;
+    }
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO ack_users (user_id, since_id) VALUES (?, ?);",
+                           -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_int64(stmt, 2, last_message_id_locked());
+        ok = sqlite3_step(stmt) == SQLITE_DONE;
+        sqlite3_finalize(stmt);
+    } else {
+        ok = 0;
+    }
+    const char *sql =
+        "INSERT INTO acks (user_id, partner_id, seq) VALUES (?, ?, ?) "
+        "ON CONFLICT(user_id, partner_id) DO UPDATE SET seq = max(seq, excluded.seq);";
+    if (ok && sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+        for (int i = 0; i < n && i < ACK_MAX_PAIRS && ok; i++) {
+            if (!partner_ids[i] || seqs[i] <= 0) continue;
+            sqlite3_bind_int(stmt, 1, user_id);
+            sqlite3_bind_int(stmt, 2, partner_ids[i]);
+            sqlite3_bind_int64(stmt, 3, seqs[i]);
+            ok = sqlite3_step(stmt) == SQLITE_DONE;
+            sqlite3_reset(stmt);
+            stored += ok;
+        }
+        sqlite3_finalize(stmt);
+    } else {
+        ok = 0;
+    }
+    if (ok && sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) ok = 0;
+    if (!ok) {
+        fprintf(stderr, "DB error (acks): %s\n", sqlite3_errmsg(db));
+        if (!sqlite3_get_autocommit(db)) sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    }
+    UNLOCK(db_lock);
+    return ok ? stored : -1;
+}
+
+typedef struct {
+    int partner_id;
+    long long seq;
+} ack_t;
+
+static int ack_cmp(const void *a, const void *b) {
+    const ack_t *x = a, *y = b;
+    return (x->partner_id > y->partner_id) - (x->partner_id < y->partner_id);
+}
+
+/* the user's ack state: 0 if it has never acked, else 1 with `*since`
+ * and every acked conversation, sorted by partner (free *acks) */
+static int acks_load(int user_id, long long *since, ack_t **acks, size_t *nacks) {
+    *acks = NULL;
+    *nacks = 0;
+    int acking = 0;
+    size_t cap = 0;
+    db_lock_acquire();
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, "SELECT since_id FROM ack_users WHERE user_id = ?;", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, user_id);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            *since = sqlite3_column_int64(stmt, 0);
+            acking = 1;
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (acking && sqlite3_prepare_v2(db, "SELECT partner_id, seq FROM acks WHERE user_id = ? ORDER BY partner_id;",
+                                     -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, user_id);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (*nacks == cap) {
+                cap = cap ? 2 * cap : 16;
+                ack_t *grown = realloc(*acks, cap * sizeof(**acks));
+                if (!grown) break;
+                *acks = grown;
+            }
+            (*acks)[*nacks].partner_id = sqlite3_column_int(stmt, 0);
+            (*acks)[*nacks].seq = sqlite3_column_int64(stmt, 1);
+            (*nacks)++;
+        }
+        sqlite3_finalize(stmt);
+    }
+    UNLOCK(db_lock);
+    return acking;
+}
 
+/* everyone `user_id` has a conversation with, from the partner summary
+ * (free *ids) */
+static void partner_ids_load(int user_id, int **ids, size_t *n) {
+    *ids = NULL;
+    *n = 0;
+    size_t cap = 0;
+    db_lock_acquire();
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, "SELECT partner_id FROM partners WHERE user_id = ?;", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, user_id);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (*n == cap) {
+                cap = cap ? 2 * cap : 16;
+                int *grown = realloc(*ids, cap * sizeof(**ids));
+                if (!grown) break;
+                *ids = grown;
+            }
+            (*ids)[(*n)++] = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    UNLOCK(db_lock);
+}
+
+typedef struct {
+    int partner_id;
+    int user_id;
+    long long acked;
+    long long after;
+    long long upto;
+    int limit;
+} redeliver_args_t;
+
+static void bind_redeliver(sqlite3_stmt *stmt, void *arg) {
+    const redeliver_args_t *r = arg;
+    sqlite3_bind_int(stmt, 1, r->partner_id);
+    sqlite3_bind_int(stmt, 2, r->user_id);
+    sqlite3_bind_int64(stmt, 3, r->acked);
+    sqlite3_bind_int64(stmt, 4, r->after);
+    sqlite3_bind_int64(stmt, 5, r->upto);
+    sqlite3_bind_int(stmt, 6, r->limit);
+}
+
+/* Resends what an acking client has not acked: messages to it, newer than
+ * its first ack, numbered above its ack for that conversation. Each
+ * partner is one idx_messages_pair_seq range starting just past the ack,
+ * so acked rows are never read. A capped list still holds a prefix of
+ * every conversation it touches, which the client can ack as usual; the
+ * lines are then put in id order. Clients that never acked get nothing;
+ * at login they are not even told. */
+void handle_redeliver_db_and_send(const char *username, int sock, int at_login) {
+    int user_id = user_lookup(username);
+    long long since = 0;
+    ack_t *acks = NULL;
+    size_t nacks = 0;
+    if (!user_id || !acks_load(user_id, &since, &acks, &nacks)) {
+        if (!at_login) send_to_sock(sock, "REDELIVER 0\nEND REDELIVER\n");
+        return;
+    }
+    int *partners = NULL;
+    size_t npartners = 0;
+    partner_ids_load(user_id, &partners, &npartners);
+
+    const char *sql =
+        "SELECT " MESSAGE_COLUMNS "FROM messages m INDEXED BY idx_messages_pair_seq "
+        "WHERE m.sender_id = ? AND m.receiver_id = ? AND m.seq > ? AND m.id > ? AND m.id <= ? "
+        "ORDER BY m.seq ASC LIMIT ?;";
+    redeliver_args_t args = { 0, user_id, 0, since, shard_id_watermark(), 0 };
+    rowset_t rs;
+    rowset_init(&rs);
+    int more = 0, ok = 1;
+    for (size_t i = 0; ok && i < npartners; i++) {
+        if (rs.n == REDELIVER_MAX_MESSAGES) {
+            more = 1;
+            break;
+        }
+        ack_t key = { partners[i], 0 };
+        const ack_t *a = bsearch(&key, acks, nacks, sizeof(*acks), ack_cmp);
+        args.partner_id = partners[i];
+        args.acked = a ? a->seq : 0;
+        /* one row past the budget tells whether anything is left */
+        args.limit = REDELIVER_MAX_MESSAGES - (int)rs.n + 1;
+        ok = collect_rows(shard_bit(conversation_shard(user_id, partners[i])), sql, bind_redeliver,
+                          &args, COL_ID, ROW_ID_SEQ, &rs);
+        if (rs.n > REDELIVER_MAX_MESSAGES) {
+            rs.n = REDELIVER_MAX_MESSAGES;
+            more = 1;
+        }
+    }
+    free(partners);
+    free(acks);
+
+    if (!ok) {
+        rowset_free(&rs);
+        send_to_sock(sock, "ERROR: DB prepare failed\n");
+        return;
+    }
+    qsort(rs.rows, rs.n, sizeof(*rs.rows), row_cmp);
+    strbuf_t out;
+    sb_init(&out);
+    sb_appendf(&out, "REDELIVER %zu\n", rs.n);
+    for (size_t i = 0; i < rs.n; i++)
+        sb_append(&out, rs.text.data + rs.rows[i].off, rs.rows[i].len);
+    if (more) sb_appendf(&out, "(more: ack these, then redeliver)\n");
+    sb_appendf(&out, "END REDELIVER\n");
+    session_send_bulk(sock, out.data, out.len);
+    sb_free(&out);
+    rowset_free(&rs);
+}
+
+/* ---- transcript export ---- */
+
+/* A transcript is written once to an unlinked temp file and sent with
+ * sendfile(). Finished files stay open in a small cache keyed by
+ * conversation and format. A file is reused while the conversation's
+ * newest seq is unchanged; a delete drops it. export_lock is never
+ * held together with a shard lock. */
+typedef struct {
+    int lo, hi;                 /* the two user ids, lo <= hi */
+    int jsonl;
+    long long last_seq;         /* newest message in the file */
+    int fd;
+    size_t size;
+    int refs;                   /* one for the cache, one per sender */
+    unsigned long used;
+} export_t;
+
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+static export_t *export_cache[EXPORT_CACHE_ENTRIES];
+static unsigned long export_clock;
+static unsigned long export_generation;   /* bumped by every delete */
+
+static void export_unref_locked(export_t *e) {
+    if (--e->refs > 0) return;
+    close(e->fd);
+    free(e);
+}
+
+static void export_forget(int a, int b) {
+    int lo = a < b ? a : b, hi = a < b ? b : a;
+    pthread_mutex_lock(&export_lock);
+    export_generation++;
+    for (int i = 0; i < EXPORT_CACHE_ENTRIES; i++) {
+        export_t *e = export_cache[i];
+        if (e && e->lo == lo && e->hi == hi) {
+            export_unref_locked(e);
+            export_cache[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&export_lock);
+}
+
+/* the cached file for this state of the conversation, with a reference
+ * for the caller; out-of-date files are dropped on the way */
+static export_t *export_find(int lo, int hi, int jsonl, long long last_seq) {
+    export_t *found = NULL;
+    pthread_mutex_lock(&export_lock);
+    for (int i = 0; i < EXPORT_CACHE_ENTRIES; i++) {
+        export_t *e = export_cache[i];
+        if (!e || e->lo != lo || e->hi != hi || e->jsonl != jsonl) continue;
+        if (e->last_seq != last_seq) {
+            export_unref_locked(e);
+            export_cache[i] = NULL;
+            continue;
+        }
+        e->refs++;
+        e->used = ++export_clock;
+        found = e;
+        break;
+    }
+    pthread_mutex_unlock(&export_lock);
+    return found;
+}
+
+/* caches `e` unless a delete happened since `generation`, replacing an
+ * older file for the same key or else the least recently used one */
+static void export_insert(export_t *e, unsigned long generation) {
+    pthread_mutex_lock(&export_lock);
+    if (generation == export_generation) {
+        int slot = -1;
+        for (int i = 0; i < EXPORT_CACHE_ENTRIES; i++) {
+            export_t *c = export_cache[i];
+            if (c && c->lo == e->lo && c->hi == e->hi && c->jsonl == e->jsonl) { slot = i; break; }
+            if (slot < 0 || (export_cache[slot] && (!c || c->used < export_cache[slot]->used))) slot = i;
+        }
+        if (export_cache[slot]) export_unref_locked(export_cache[slot]);
+        export_cache[slot] = e;
+        e->refs++;
+        e->used = ++export_clock;
+    }
+    pthread_mutex_unlock(&export_lock);
+}
+
+static void export_release(export_t *e) {
+    pthread_mutex_lock(&export_lock);
+    export_unref_locked(e);
+    pthread_mutex_unlock(&export_lock);
+}
+
+static void sb_append_json(strbuf_t *sb, const char *s) {
+    sb_append(sb, "\"", 1);
+    const char *run = s;
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        sb_append(sb, run, (size_t)(s - run));
+        if (c == '"' || c == '\\') sb_appendf(sb, "\\%c", c);
+        else sb_appendf(sb, "\\u%04x", c);
+        run = s + 1;
+    }
+    sb_append(sb, run, (size_t)(s - run));
+    sb_append(sb, "\"", 1);
+}
+
+static void format_export_row(sqlite3_stmt *stmt, int jsonl, strbuf_t *sb) {
+    long long id = sqlite3_column_int64(stmt, COL_ID);
+    long long seq = sqlite3_column_int64(stmt, COL_SEQ);
+    if (!jsonl) {
+        char line[BUF_SIZE];
+        format_message_row(stmt, line, sizeof(line));
+        sb_appendf(sb, "#%lld/%lld %s", id, seq, line);
+        return;
+    }
+    const unsigned char *content = sqlite3_column_text(stmt, 3);
+    sb_appendf(sb, "{\"id\":%lld,\"seq\":%lld,\"ts\":%lld,\"from\":", id, seq,
+               (long long)sqlite3_column_int64(stmt, COL_TIMESTAMP));
+    sb_append_json(sb, user_name(sqlite3_column_int(stmt, 1)));
+    sb_append(sb, ",\"to\":", 6);
+    sb_append_json(sb, user_name(sqlite3_column_int(stmt, 2)));
+    if (content) {
+        sb_append(sb, ",\"text\":", 8);
+        sb_append_json(sb, (const char *)content);
+        sb_append(sb, "}\n", 2);
+    } else if (sqlite3_column_type(stmt, 5) == SQLITE_NULL) {
+        sb_appendf(sb, ",\"text\":null,\"aborted\":true}\n");
+    } else {
+        sb_appendf(sb, ",\"text\":null,\"size\":%lld}\n", (long long)sqlite3_column_int64(stmt, 5));
+    }
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return 0;
+        data += w;
+        len -= (size_t)w;
+    }
+    return 1;
+}
+
+/* Writes messages 1..last_seq of the conversation to a new temp file.
+ * Each chunk of seqs is read under the shard lock and written to the
+ * file after it is released. */
+static export_t *export_build(shard_t *s, int a, int b, int jsonl, long long last_seq) {
+    char path[] = "/tmp/chat-export-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return NULL;
+    unlink(path);
+
+    const char *sql =
+        "SELECT " MESSAGE_COLUMNS "FROM messages m "
+        "WHERE (sender_id = ?1 AND receiver_id = ?2 AND seq BETWEEN ?3 AND ?4) "
+        "OR (sender_id = ?2 AND receiver_id = ?1 AND seq BETWEEN ?3 AND ?4) "
+        "ORDER BY seq;";
+    sqlite3_stmt *stmt = NULL;
+    shard_lock(s);
+    int ok = sqlite3_prepare_v2(s->db, sql, -1, &stmt, NULL) == SQLITE_OK;
+    shard_unlock(s);
+
+    strbuf_t chunk;
+    sb_init(&chunk);
+    for (long long from = 1; ok && from <= last_seq; from += EXPORT_CHUNK) {
+        shard_lock(s);
+        sqlite3_bind_int(stmt, 1, a);
+        sqlite3_bind_int(stmt, 2, b);
+        sqlite3_bind_int64(stmt, 3, from);
+        sqlite3_bind_int64(stmt, 4, from + EXPORT_CHUNK - 1);
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+            format_export_row(stmt, jsonl, &chunk);
+        ok = rc == SQLITE_DONE;
+        sqlite3_reset(stmt);
+        shard_unlock(s);
+
+        if (ok && chunk.len) ok = write_all(fd, chunk.data, chunk.len);
+        chunk.len = 0;
+    }
+    sb_free(&chunk);
+    shard_lock(s);
     sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_lock);
+    shard_unlock(s);
+
+    struct stat st;
+    export_t *e = ok && fstat(fd, &st) == 0 ? calloc(1, sizeof(*e)) : NULL;
+    if (!e) {
+        close(fd);
+        return NULL;
+    }
+    e->lo = a < b ? a : b;
+    e->hi = a < b ? b : a;
+    e->jsonl = jsonl;
+    e->last_seq = last_seq;
+    e->fd = fd;
+    e->size = (size_t)st.st_size;
+    e->refs = 1;
+    return e;
+}
+
+/* "export <user> [format text|jsonl]": the whole conversation as
+ * EXPORT <n> <format>, the n bytes in CHUNK frames, then END EXPORT.
+ * Text lines match history with an #id/seq prefix; jsonl has one object
+ * per message. */
+void handle_export_db_and_send(const char *requester, int sock, const char *target, int jsonl) {
+    const char *format = jsonl ? "jsonl" : "text";
+    char header[64];
+    int a = user_lookup(requester);
+    int b = user_lookup(target);
+    if (!a || !b) {
+        snprintf(header, sizeof(header), "EXPORT 0 %s\nEND EXPORT\n", format);
+        send_to_sock(sock, header);
+        return;
+    }
+
+    /* read before the probe, so a delete after it keeps the result
+     * out of the cache */
+    pthread_mutex_lock(&export_lock);
+    unsigned long generation = export_generation;
+    pthread_mutex_unlock(&export_lock);
+
+    shard_t *s = conversation_shard(a, b);
+    long long last_seq = 0;
+    shard_lock(s);
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(s->db, "SELECT " MESSAGE_NEXT_SEQ("?1", "?2") " - 1;", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, a);
+        sqlite3_bind_int(stmt, 2, b);
+        if (sqlite3_step(stmt) == SQLITE_ROW) last_seq = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    shard_unlock(s);
+
+    int cached = 1;
+    export_t *e = export_find(a < b ? a : b, a < b ? b : a, jsonl, last_seq);
+    if (!e) {
+        cached = 0;
+        e = export_build(s, a, b, jsonl, last_seq);
+        if (!e) {
+            send_to_sock(sock, "ERROR: export failed\n");
+            return;
+        }
+        export_insert(e, generation);
+    }
+
+    snprintf(header, sizeof(header), "EXPORT %zu %s\n", e->size, format);
+    send_to_sock(sock, header);
+    if (send_file_to_sock(sock, e->fd, e->size) == 0) send_to_sock(sock, "END EXPORT\n");
+    log_info("%s exported %s/%s (%zu bytes%s)", requester, target, format, e->size, cached ? ", cached" : "");
+    export_release(e);
+}
+
+/* ---- large messages: a BLOB row written and read back in chunks ---- */
+
+/* reserves a zero-filled row of `size` bytes; returns its id, 0 on failure */
+long long big_message_begin(const char *sender, const char *receiver, long long size, long long *seq) {
+    int sender_id = user_intern(sender);
+    int receiver_id = user_intern(receiver);
+    if (!sender_id || !receiver_id) return 0;
+
+    /* sharded ids come from the shared counter, see shards.c */
+    shard_t *s = conversation_shard(sender_id, receiver_id);
+    long long want = s->wdb ? shard_id_begin() : 0;
+
+    shard_lock(s);
+    sqlite3_stmt *stmt = NULL;
+    long long id = 0;
+    const char *sql =
+        "INSERT INTO messages (id, sender_id, receiver_id, content, timestamp, seq) "
+        "VALUES (?1, ?2, ?3, zeroblob(?4), ?5, " MESSAGE_NEXT_SEQ("?2", "?3") ") RETURNING id, seq;";
+    if (sqlite3_prepare_v2(s->db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+        if (want) sqlite3_bind_int64(stmt, 1, want);
+        else sqlite3_bind_null(stmt, 1);
+        sqlite3_bind_int(stmt, 2, sender_id);
+        sqlite3_bind_int(stmt, 3, receiver_id);
+        sqlite3_bind_int64(stmt, 4, size);
+        sqlite3_bind_int64(stmt, 5, (sqlite3_int64)time(NULL));
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            id = sqlite3_column_int64(stmt, 0);
+            *seq = sqlite3_column_int64(stmt, 1);
+            if (sqlite3_step(stmt) != SQLITE_DONE) id = 0;
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (!id) fprintf(stderr, "DB error (large message): %s\n", sqlite3_errmsg(s->db));
+    shard_unlock(s);
+
+    if (want) shard_id_end(want);
+    if (id) partners_note(sender_id, receiver_id);
+    return id;
+}
+
+/* one chunk per call. The blob handle lives only inside the shard lock so
+ * no transaction stays open while a slow sender trickles bytes in. The row
+ * is in whichever shard opens it. */
+static int big_message_io(long long id, void *buf, int n, long long offset, int writing) {
+    int rc = SQLITE_ERROR;
+    for (int i = 0; i < nshards && rc != SQLITE_OK; i++) {
+        shard_t *s = &shards[i];
+        shard_lock(s);
+        sqlite3_blob *blob = NULL;
+        rc = sqlite3_blob_open(s->db, "main", "messages", "content", id, writing, &blob);
+        if (rc == SQLITE_OK) {
+            rc = writing ? sqlite3_blob_write(blob, buf, n, (int)offset)
+                         : sqlite3_blob_read(blob, buf, n, (int)offset);
+            sqlite3_blob_close(blob);
+            shard_unlock(s);
+            break;
+        }
+        shard_unlock(s);
+    }
+    return rc == SQLITE_OK;
+}
+
+int big_message_write(long long id, const void *data, int n, long long offset) {
+    return big_message_io(id, (void *)data, n, offset, 1);
+}
+
+int big_message_read(long long id, void *buf, int n, long long offset) {
+    return big_message_io(id, buf, n, offset, 0);
+}
+
+/* drops the payload of a partially received message. The row stays, with
+ * NULL content, so its seq is never handed out again: the recipient saw
+ * it in the BIGMSG line and may already have acked it. */
+void big_message_abort(long long id) {
+    int a = 0, b = 0;
+    const char *sql =
+        "UPDATE messages SET content = NULL WHERE id = ? AND typeof(content) = 'blob' "
+        "RETURNING sender_id, receiver_id;";
+    for (int i = 0; i < nshards && !a; i++) {
+        shard_t *s = &shards[i];
+        shard_lock(s);
+        sqlite3_stmt *stmt = NULL;
+        if (sqlite3_prepare_v2(s->db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, id);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                a = sqlite3_column_int(stmt, 0);
+                b = sqlite3_column_int(stmt, 1);
+                sqlite3_step(stmt);
+            }
+            sqlite3_finalize(stmt);
+        }
+        shard_unlock(s);
+    }
+    /* an export made during the transfer listed it as a large message */
+    if (a) export_forget(a, b);
+}
+
+/* participants and size of large message `id`, if `requester` is one of them */
+int big_message_info(long long id, const char *requester, char *from, char *to, long long *size,
+                     long long *seq) {
+    int requester_id = user_lookup(requester);
+    if (!requester_id) return 0;
+
+    int ok = 0;
+    const char *sql =
+        "SELECT sender_id, receiver_id, length(content), seq FROM messages "
+        "WHERE id = ? AND typeof(content) = 'blob' AND (sender_id = ? OR receiver_id = ?);";
+    for (int i = 0; i < nshards && !ok; i++) {
+        shard_t *s = &shards[i];
+        shard_lock(s);
+        sqlite3_stmt *stmt = NULL;
+        if (sqlite3_prepare_v2(s->db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, id);
+            sqlite3_bind_int(stmt, 2, requester_id);
+            sqlite3_bind_int(stmt, 3, requester_id);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                snprintf(from, USERNAME_LEN, "%s", user_name(sqlite3_column_int(stmt, 0)));
+                snprintf(to, USERNAME_LEN, "%s", user_name(sqlite3_column_int(stmt, 1)));
+                *size = sqlite3_column_int64(stmt, 2);
+                *seq = sqlite3_column_int64(stmt, 3);
+                ok = 1;
+            }
+            sqlite3_finalize(stmt);
+        }
+        shard_unlock(s);
+    }
+    return ok;
+}
+
+typedef struct {
+    int channel_id;
+    int limit;
+} channel_args_t;
+
+static void bind_channel(sqlite3_stmt *stmt, void *arg) {
+    const channel_args_t *c = arg;
+    sqlite3_bind_int(stmt, 1, c->channel_id);
+    sqlite3_bind_int(stmt, 2, c->limit);
+}
+
+/* the last `limit` stored posts of a channel, oldest first */
+void handle_channel_history_db_and_send(const char *channel, int sock, int limit) {
+    int channel_id = user_lookup(channel);
+    if (!channel_id) {
+        send_to_sock(sock, "(no messages)\n");
+        return;
+    }
+
+    const char *sql =
+        "SELECT * FROM (SELECT " MESSAGE_COLUMNS "FROM messages m "
+        "WHERE receiver_id = ? ORDER BY id DESC LIMIT ?) ORDER BY 5 ASC;";
+    channel_args_t args = { channel_id, limit };
+    rowset_t rs;
+    rowset_init(&rs);
+    if (!collect_rows(shard_bit(conversation_shard(channel_id, channel_id)), sql, bind_channel,
+                      &args, COL_ID, ROW_PLAIN, &rs)) {
+        rowset_free(&rs);
+        send_to_sock(sock, "ERROR: DB prepare failed\n");
+        return;
+    }
+
+    strbuf_t out;
+    sb_init(&out);
+    send_rows(sock, &rs, 0, rs.n, &out);
+    if (rs.n == 0) sb_appendf(&out, "(no messages)\n");
+    if (out.len) session_send_bulk(sock, out.data, out.len);
+    sb_free(&out);
+    rowset_free(&rs);
 }
@@ -0,0 +1,803 @@
+#include "federation.h"
+#include "server.h"
+#include "clients.h"
+#include "database.h"
+#include "presence.h"
+#include "logging.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/* Peer links carry newline-terminated control lines and framed messages:
+ *     HELLO <node> <epoch>          first line in each direction
+ *     ONLINE <user> / OFFLINE <user> presence gossip (a snapshot on link-up)
+ *     MSG <seq> <flen> <tlen> <mlen>\n<from><to><text>
+ *     ACK <seq>                     everything up to seq has been delivered
+ * Forwarded messages stay queued until acked. A writer thread per link sends
+ * whatever is queued as one batch without waiting for earlier acks, and the
+ * reader acks once per batch received. After a reconnect the unacked tail is
+ * sent again; the receiver skips sequence numbers it already took,
+ * unless the sender's epoch changed (it restarted and numbers from 1).
+ * The reader only parses: received messages go to the link's inbox and a
+ * delivery thread stores and pushes them, acking once the inbox drains, so
+ * a slow database never stalls the socket. Inbound links are taken only
+ * from addresses named by --peer-allow or --peer.
+ * Links form a full mesh: users are only known on directly linked nodes.
+ *
+ * Lock order: fed_lock (slots, remote users), then a link's wlock, then its
+ * lock, then clients_lock. */
+
+#define FED_RBUF_SIZE (2 * FED_BATCH_BYTES)
+#define FED_MAX_TEXT (4 * BUF_SIZE)
+#define MAX_REMOTE_USERS (MAX_PEERS * MAX_CLIENTS)
+
+typedef struct fed_msg {
+    unsigned long long seq;
+    char from[USERNAME_LEN];
+    char to[USERNAME_LEN];
+    size_t len;
+    struct fed_msg *next;
+    char text[];
+} fed_msg_t;
+
+typedef struct {
+    int used;
+    int outbound;                   /* we dial host:port and redial on loss */
+    char host[256];
+    char port[16];
+    char node[USERNAME_LEN];        /* from the peer's HELLO */
+    int sock;                       /* -1 while the link is down */
+    pthread_mutex_t lock;           /* sock, ctl, queue, counters */
+    pthread_cond_t cond;
+    pthread_mutex_t wlock;          /* one writer on the socket at a time */
+    strbuf_t ctl;                   /* control lines waiting to go out */
+    fed_msg_t *head, *tail;         /* unacked messages, oldest first */
+    fed_msg_t *unsent;              /* first queued message not yet written */
+    int queued;
+    unsigned long long next_seq;
+    unsigned long long peer_epoch;  /* receive side: duplicate suppression */
+    unsigned long long accepted;    /* newest seq put in the inbox */
+    unsigned long long delivered;   /* newest seq stored, what ACK reports */
+    fed_msg_t *in_head, *in_tail;   /* received, waiting for the delivery thread */
+    pthread_cond_t in_cond;         /* inbox or ack_due changed */
+    int ack_due;
+    unsigned long sent, received, batches;
+} peer_t;
+
+typedef struct {
+    char name[USERNAME_LEN];
+    int peer;
+} remote_user_t;
+
+static pthread_mutex_t fed_lock = PTHREAD_MUTEX_INITIALIZER;
+static peer_t peers[MAX_PEERS];
+static remote_user_t remote[MAX_REMOTE_USERS];
+static int nremote;
+static unsigned long long epoch;
+static int enabled;
+static char node_default[USERNAME_LEN];
+static char allow_hosts[MAX_PEERS][256];
+static int nallow_hosts;
+static struct in_addr allowed[MAX_ALLOWED_ADDRS];
+static int nallowed;
+
+static const char *node_name(void) {
+    return config.node_name ? config.node_name : node_default;
+}
+
+int fed_enabled(void) {
+    return enabled;
+}
+
+/* the caller marks the slot used */
+static void peer_init(peer_t *p) {
+    p->sock = -1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    pthread_cond_init(&p->in_cond, NULL);
+    pthread_mutex_init(&p->wlock, NULL);
+    sb_init(&p->ctl);
+}
+
+/* "host:port", from --peer; called before fed_start */
+int fed_add_peer(const char *spec) {
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec || !colon[1] || (size_t)(colon - spec) >= sizeof(peers[0].host) ||
+        strlen(colon + 1) >= sizeof(peers[0].port))
+        return 0;
+    for (int i = 0; i < MAX_PEERS; i++) {
+        peer_t *p = &peers[i];
+        if (p->used) continue;
+        peer_init(p);
+        p->used = 1;
+        p->outbound = 1;
+        memcpy(p->host, spec, (size_t)(colon - spec));
+        snprintf(p->port, sizeof(p->port), "%s", colon + 1);
+        return 1;
+    }
+    fprintf(stderr, "at most %d peers\n", MAX_PEERS);
+    return 0;
+}
+
+/* --peer-allow; resolved in fed_start */
+int fed_allow_peer(const char *host) {
+    if (!host[0] || strlen(host) >= sizeof(allow_hosts[0])) return 0;
+    if (nallow_hosts == MAX_PEERS) {
+        fprintf(stderr, "at most %d --peer-allow hosts\n", MAX_PEERS);
+        return 0;
+    }
+    snprintf(allow_hosts[nallow_hosts++], sizeof(allow_hosts[0]), "%s", host);
+    return 1;
+}
+
+static void allow_resolve(const char *host) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;      /* the peer port listens on IPv4 */
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+        log_info("Peer allowlist: cannot resolve %s", host);
+        return;
+    }
+    for (struct addrinfo *a = res; a && nallowed < MAX_ALLOWED_ADDRS; a = a->ai_next)
+        allowed[nallowed++] = ((struct sockaddr_in *)a->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+}
+
+static int peer_addr_allowed(const struct sockaddr_in *from) {
+    for (int i = 0; i < nallowed; i++)
+        if (allowed[i].s_addr == from->sin_addr.s_addr) return 1;
+    return 0;
+}
+
+/* ---- remote users ---- */
+
+static int remote_find(const char *name) {
+    for (int i = 0; i < nremote; i++)
+        if (strcmp(remote[i].name, name) == 0) return i;
+    return -1;
+}
+
+static void remote_set(int peer, const char *name, int online) {
+    int changed = 0;
+    pthread_mutex_lock(&fed_lock);
+    int i = remote_find(name);
+    if (online && i < 0 && nremote < MAX_REMOTE_USERS) {
+        snprintf(remote[nremote].name, USERNAME_LEN, "%s", name);
+        remote[nremote].peer = peer;
+        nremote++;
+        changed = 1;
+    } else if (online && i >= 0) {
+        remote[i].peer = peer;
+    } else if (!online && i >= 0 && remote[i].peer == peer) {
+        remote[i] = remote[--nremote];
+        changed = 1;
+    }
+    pthread_mutex_unlock(&fed_lock);
+    if (changed) presence_changed(name, online);
+}
+
+static void remote_drop_peer(int peer) {
+    char gone[MAX_REMOTE_USERS][USERNAME_LEN];
+    int n = 0;
+    pthread_mutex_lock(&fed_lock);
+    for (int i = nremote - 1; i >= 0; i--) {
+        if (remote[i].peer != peer) continue;
+        memcpy(gone[n++], remote[i].name, USERNAME_LEN);
+        remote[i] = remote[--nremote];
+    }
+    pthread_mutex_unlock(&fed_lock);
+    for (int i = 0; i < n; i++) presence_changed(gone[i], 0);
+}
+
+static int remote_peer_of(const char *name) {
+    pthread_mutex_lock(&fed_lock);
+    int i = remote_find(name);
+    int peer = i >= 0 ? remote[i].peer : -1;
+    pthread_mutex_unlock(&fed_lock);
+    return peer;
+}
+
+int fed_user_is_remote(const char *username) {
+    return enabled && remote_peer_of(username) >= 0;
+}
+
+int fed_remote_users(char names[][USERNAME_LEN], int max) {
+    int n = 0;
+    pthread_mutex_lock(&fed_lock);
+    for (int i = 0; i < nremote && n < max; i++)
+        memcpy(names[n++], remote[i].name, USERNAME_LEN);
+    pthread_mutex_unlock(&fed_lock);
+    return n;
+}
+
+/* "name@node" lines for getuserlist */
+void fed_list_remote(strbuf_t *out) {
+    pthread_mutex_lock(&fed_lock);
+    for (int i = 0; i < nremote; i++)
+        sb_appendf(out, "%s@%s\n", remote[i].name, peers[remote[i].peer].node);
+    pthread_mutex_unlock(&fed_lock);
+}
+
+/* ---- sending side ---- */
+
+/* tell every live link; lines are batched with the next write */
+void fed_presence(const char *username, int online) {
+    if (!enabled) return;
+    for (int i = 0; i < MAX_PEERS; i++) {
+        peer_t *p = &peers[i];
+        if (!__atomic_load_n(&p->used, __ATOMIC_ACQUIRE)) continue;
+        pthread_mutex_lock(&p->lock);
+        if (p->sock >= 0) {
+            sb_appendf(&p->ctl, "%s %s\n", online ? "ONLINE" : "OFFLINE", username);
+            pthread_cond_signal(&p->cond);
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/* Queues `text` for the node `to` is logged in on. Returns 1 when queued,
+ * 0 when `to` is not a remote user, and -1 when it is but the message
+ * could not be queued (the link's queue is full, or the text too long). */
+int fed_forward(const char *from, const char *to, const char *text) {
+    if (!enabled) return 0;
+    int idx = remote_peer_of(to);
+    if (idx < 0) return 0;
+
+    size_t len = strlen(text);
+    if (len > FED_MAX_TEXT) return -1;
+    fed_msg_t *m = malloc(sizeof(*m) + len);
+    if (!m) return -1;
+    snprintf(m->from, USERNAME_LEN, "%s", from);
+    snprintf(m->to, USERNAME_LEN, "%s", to);
+    memcpy(m->text, text, len);
+    m->len = len;
+    m->next = NULL;
+
+    peer_t *p = &peers[idx];
+    pthread_mutex_lock(&p->lock);
+    if (p->queued >= FED_MAX_UNACKED) {
+        pthread_mutex_unlock(&p->lock);
+        free(m);
+        return -1;
+    }
+    m->seq = ++p->next_seq;
+    if (p->tail) p->tail->next = m;
+    else p->head = m;
+    p->tail = m;
+    if (!p->unsent) p->unsent = m;
+    p->queued++;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return 1;
+}
+
+static int send_all_fd(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t r = send(fd, data, len, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        data += r;
+        len -= (size_t)r;
+    }
+    return 0;
+}
+
+/* Drains the control lines and as many queued messages as fit in one
+ * batch, then writes them without waiting for acks. A link that goes down
+ * meanwhile rewinds `unsent`, so nothing taken here is lost. */
+static void *link_writer(void *arg) {
+    peer_t *p = arg;
+    strbuf_t batch;
+    sb_init(&batch);
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->sock < 0 || (p->ctl.len == 0 && !p->unsent))
+            pthread_cond_wait(&p->cond, &p->lock);
+
+        int fd = p->sock;
+        batch.len = 0;
+        if (p->ctl.len) sb_append(&batch, p->ctl.data, p->ctl.len);
+        p->ctl.len = 0;
+        int n = 0;
+        while (p->unsent && batch.len < FED_BATCH_BYTES) {
+            fed_msg_t *m = p->unsent;
+            size_t flen = strlen(m->from), tlen = strlen(m->to);
+            sb_appendf(&batch, "MSG %llu %zu %zu %zu\n", m->seq, flen, tlen, m->len);
+            sb_append(&batch, m->from, flen);
+            sb_append(&batch, m->to, tlen);
+            sb_append(&batch, m->text, m->len);
+            p->unsent = m->next;
+            n++;
+        }
+        if (n) {
+            p->sent += (unsigned long)n;
+            p->batches++;
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        pthread_mutex_lock(&p->wlock);
+        pthread_mutex_lock(&p->lock);
+        int same = p->sock == fd;
+        pthread_mutex_unlock(&p->lock);
+        if (same && batch.len && send_all_fd(fd, batch.data, batch.len) < 0)
+            shutdown(fd, SHUT_RDWR);
+        pthread_mutex_unlock(&p->wlock);
+
+        pthread_mutex_lock(&p->lock);
+    }
+    return NULL;
+}
+
+/* ---- receiving side ---- */
+
+static void link_acked(peer_t *p, unsigned long long seq) {
+    pthread_mutex_lock(&p->lock);
+    while (p->head && p->head->seq <= seq) {
+        fed_msg_t *m = p->head;
+        p->head = m->next;
+        if (p->unsent == m) p->unsent = m->next;
+        p->queued--;
+        free(m);
+    }
+    if (!p->head) p->tail = NULL;
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* stored here as well, so the recipient's history is complete on its node */
+static void deliver(const char *from, const char *to, const char *text) {
+    long long seq = 0;
+    long long id = store_message(from, to, text, &seq);
+    if (!id) {
+        log_info("%s sent message to %s (from a peer, not stored - dropped)", from, to);
+        return;
+    }
+    int sock = find_sock_by_username(to);
+    if (sock > 0) {
+        strbuf_t line;
+        sb_init(&line);
+        sb_appendf(&line, "#%lld/%lld %s -> %s: %s\n", id, seq, from, to, text);
+        send_buf_to_sock(sock, line.data, line.len);
+        sb_free(&line);
+    }
+    log_info("%s sent message to %s (from a peer, %s)", from, to, sock > 0 ? "delivered" : "stored - offline");
+}
+
+/* Delivers the inbox in order. A message leaves the inbox only after it is
+ * stored, so run_link can wait for an empty inbox before resetting the
+ * sequence on a new epoch. The ack goes out when the inbox drains, or every
+ * FED_ACK_EVERY messages while it stays busy. */
+static void *link_deliverer(void *arg) {
+    peer_t *p = arg;
+    unsigned since_ack = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->in_head && !p->ack_due)
+            pthread_cond_wait(&p->in_cond, &p->lock);
+
+        if (p->in_head && since_ack < FED_ACK_EVERY) {
+            fed_msg_t *m = p->in_head;
+            pthread_mutex_unlock(&p->lock);
+            deliver(m->from, m->to, m->text);
+            pthread_mutex_lock(&p->lock);
+            p->in_head = m->next;
+            if (!p->in_head) {
+                p->in_tail = NULL;
+                pthread_cond_broadcast(&p->in_cond);
+            }
+            p->delivered = m->seq;
+            p->received++;
+            p->ack_due = 1;
+            since_ack++;
+            free(m);
+            if (p->in_head && since_ack < FED_ACK_EVERY) continue;
+        }
+
+        int fd = p->sock;
+        unsigned long long seq = p->delivered;
+        p->ack_due = 0;
+        since_ack = 0;
+        pthread_mutex_unlock(&p->lock);
+
+        if (fd >= 0) {
+            char ack[32];
+            int alen = snprintf(ack, sizeof(ack), "ACK %llu\n", seq);
+            pthread_mutex_lock(&p->wlock);
+            pthread_mutex_lock(&p->lock);
+            int same = p->sock == fd;
+            pthread_mutex_unlock(&p->lock);
+            if (same && send_all_fd(fd, ack, (size_t)alen) < 0)
+                shutdown(fd, SHUT_RDWR);
+            pthread_mutex_unlock(&p->wlock);
+        }
+        pthread_mutex_lock(&p->lock);
+    }
+    return NULL;
+}
+
+/* the writer and delivery threads live as long as the slot */
+static void start_link_threads(peer_t *p) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, link_writer, p) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    pthread_detach(tid);
+    if (pthread_create(&tid, NULL, link_deliverer, p) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    pthread_detach(tid);
+}
+
+/* Handles every complete line and frame in buf; returns how many bytes
+ * were consumed, or -1 on a malformed frame. Sets *msgs if a MSG frame
+ * was among them. */
+static long link_input(peer_t *p, int idx, char *buf, size_t len, int *msgs) {
+    size_t off = 0;
+    while (off < len) {
+        char *nl = memchr(buf + off, '\n', len - off);
+        if (!nl) break;
+        *nl = '\0';
+        char *line = buf + off;
+        size_t next = (size_t)(nl - buf) + 1;
+
+        if (strncmp(line, "MSG ", 4) == 0) {
+            unsigned long long seq;
+            size_t flen, tlen, mlen;
+            if (sscanf(line + 4, "%llu %zu %zu %zu", &seq, &flen, &tlen, &mlen) != 4 ||
+                flen == 0 || flen >= USERNAME_LEN || tlen == 0 || tlen >= USERNAME_LEN ||
+                mlen > FED_MAX_TEXT)
+                return -1;
+            if (len - next < flen + tlen + mlen) {
+                *nl = '\n';     /* parsed again once the rest has arrived */
+                break;
+            }
+            char from[USERNAME_LEN], to[USERNAME_LEN];
+            memcpy(from, buf + next, flen);
+            from[flen] = '\0';
+            memcpy(to, buf + next + flen, tlen);
+            to[tlen] = '\0';
+            /* duplicates are dropped but still acked, so a resent tail
+             * that was already taken leaves the sender's queue */
+            if (seq > p->accepted) {
+                fed_msg_t *m = malloc(sizeof(*m) + mlen + 1);
+                if (!m) return -1;
+                m->seq = seq;
+                memcpy(m->from, from, USERNAME_LEN);
+                memcpy(m->to, to, USERNAME_LEN);
+                memcpy(m->text, buf + next + flen + tlen, mlen);
+                m->text[mlen] = '\0';
+                m->len = mlen;
+                m->next = NULL;
+                p->accepted = seq;
+                pthread_mutex_lock(&p->lock);
+                if (p->in_tail) p->in_tail->next = m;
+                else p->in_head = m;
+                p->in_tail = m;
+                pthread_mutex_unlock(&p->lock);
+            }
+            *msgs = 1;
+            next += flen + tlen + mlen;
+        } else if (strncmp(line, "ONLINE ", 7) == 0) {
+            remote_set(idx, line + 7, 1);
+        } else if (strncmp(line, "OFFLINE ", 8) == 0) {
+            remote_set(idx, line + 8, 0);
+        } else if (strncmp(line, "ACK ", 4) == 0) {
+            link_acked(p, strtoull(line + 4, NULL, 10));
+        } else {
+            log_info("Peer %s: ignoring '%.40s'", p->node, line);
+        }
+        off = next;
+    }
+    return (long)off;
+}
+
+/* Runs a handshaken link on the calling thread until it drops. */
+static void run_link(peer_t *p, int idx, int fd, unsigned long long peer_epoch) {
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+    if (config.write_timeout > 0) {
+        struct timeval tv = { config.write_timeout, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+    /* the snapshot goes out first, ahead of any gossip queued after it */
+    pthread_mutex_lock(&p->lock);
+    if (peer_epoch != p->peer_epoch) {
+        /* the old epoch's messages are delivered before numbering restarts */
+        while (p->in_head)
+            pthread_cond_wait(&p->in_cond, &p->lock);
+        p->peer_epoch = peer_epoch;
+        p->accepted = 0;
+        p->delivered = 0;
+    }
+    p->sock = fd;
+    p->unsent = p->head;
+    p->ctl.len = 0;
+    char names[MAX_CLIENTS][USERNAME_LEN];
+    int n = get_online_users(names);
+    for (int i = 0; i < n; i++)
+        sb_appendf(&p->ctl, "ONLINE %s\n", names[i]);
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    log_info("Peer link to %s up", p->node);
+
+    char *rbuf = malloc(FED_RBUF_SIZE);
+    size_t fill = 0;
+    while (rbuf) {
+        ssize_t r = recv(fd, rbuf + fill, FED_RBUF_SIZE - fill, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        fill += (size_t)r;
+
+        int msgs = 0;
+        long used = link_input(p, idx, rbuf, fill, &msgs);
+        if (msgs) {
+            pthread_mutex_lock(&p->lock);
+            p->ack_due = 1;
+            pthread_cond_signal(&p->in_cond);
+            pthread_mutex_unlock(&p->lock);
+        }
+        if (used < 0) {
+            log_info("Peer %s sent a malformed frame", p->node);
+            break;
+        }
+        memmove(rbuf, rbuf + used, fill - (size_t)used);
+        fill -= (size_t)used;
+        if (fill == FED_RBUF_SIZE) break;
+    }
+    free(rbuf);
+
+    pthread_mutex_lock(&p->wlock);
+    pthread_mutex_lock(&p->lock);
+    p->sock = -1;
+    p->unsent = p->head;
+    p->ctl.len = 0;
+    int queued = p->queued;
+    pthread_mutex_unlock(&p->lock);
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+    pthread_mutex_unlock(&p->wlock);
+
+    remote_drop_peer(idx);
+    log_info("Peer link to %s down (%d message(s) awaiting ack)", p->node, queued);
+}
+
+/* ---- handshake ---- */
+
+static int send_hello(int fd) {
+    char hello[64 + USERNAME_LEN];
+    int n = snprintf(hello, sizeof(hello), "HELLO %s %llu\n", node_name(), epoch);
+    return send_all_fd(fd, hello, (size_t)n);
+}
+
+/* reads the peer's HELLO byte by byte, so nothing after it is consumed */
+static int read_hello(int fd, char node[USERNAME_LEN], unsigned long long *peer_epoch) {
+    char line[64 + USERNAME_LEN];
+    size_t n = 0;
+    while (n < sizeof(line) - 1) {
+        ssize_t r = recv(fd, line + n, 1, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return 0;
+        if (line[n] == '\n') break;
+        n++;
+    }
+    line[n] = '\0';
+
+    char name[USERNAME_LEN];
+    if (sscanf(line, "HELLO %31s %llu", name, peer_epoch) != 2) return 0;
+    if (strcmp(name, node_name()) == 0) {
+        log_info("Peer link refused: peer has our own node name %s", name);
+        return 0;
+    }
+    memcpy(node, name, USERNAME_LEN);
+    return 1;
+}
+
+static void hello_timeout(int fd, int sec) {
+    struct timeval tv = { sec, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/* outbound links: dial, handshake, run, and dial again after FED_RETRY_MS */
+static void *link_dialer(void *arg) {
+    peer_t *p = arg;
+    int idx = (int)(p - peers);
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    while (running) {
+        int fd = -1;
+        if (getaddrinfo(p->host, p->port, &hints, &res) == 0) {
+            for (struct addrinfo *a = res; a && fd < 0; a = a->ai_next) {
+                fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+                if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            freeaddrinfo(res);
+        }
+
+        if (fd >= 0) {
+            char node[USERNAME_LEN];
+            unsigned long long peer_epoch;
+            hello_timeout(fd, 5);
+            if (send_hello(fd) == 0 && read_hello(fd, node, &peer_epoch)) {
+                hello_timeout(fd, 0);
+                pthread_mutex_lock(&p->lock);
+                memcpy(p->node, node, USERNAME_LEN);
+                pthread_mutex_unlock(&p->lock);
+                run_link(p, idx, fd, peer_epoch);
+            } else {
+                close(fd);
+            }
+        }
+        usleep(FED_RETRY_MS * 1000);
+    }
+    return NULL;
+}
+
+/* Inbound links land in the slot that last served the same node, or a free
+ * one. A node that is already connected is turned away. */
+static void *link_accepted(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char node[USERNAME_LEN];
+    unsigned long long peer_epoch;
+    hello_timeout(fd, 5);
+    if (!read_hello(fd, node, &peer_epoch)) {
+        close(fd);
+        return NULL;
+    }
+
+    peer_t *p = NULL;
+    int fresh = 0, busy = 0;
+    pthread_mutex_lock(&fed_lock);
+    for (int i = 0; i < MAX_PEERS && !p; i++) {
+        if (!peers[i].used || strcmp(peers[i].node, node) != 0) continue;
+        pthread_mutex_lock(&peers[i].lock);
+        busy = peers[i].sock >= 0;
+        pthread_mutex_unlock(&peers[i].lock);
+        if (!busy) p = &peers[i];
+        else break;
+    }
+    for (int i = 0; i < MAX_PEERS && !p && !busy; i++) {
+        if (peers[i].used) continue;
+        p = &peers[i];
+        peer_init(p);
+        memcpy(p->node, node, USERNAME_LEN);
+        fresh = 1;
+        __atomic_store_n(&p->used, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&fed_lock);
+
+    if (!p) {
+        log_info("Peer link from %s refused (%s)", node, busy ? "already linked" : "no free slot");
+        close(fd);
+        return NULL;
+    }
+    if (fresh) start_link_threads(p);
+    if (send_hello(fd) < 0) {
+        close(fd);
+        return NULL;
+    }
+    hello_timeout(fd, 0);
+    run_link(p, (int)(p - peers), fd, peer_epoch);
+    return NULL;
+}
+
+static void *peer_listener(void *arg) {
+    int lfd = (int)(intptr_t)arg;
+    while (running) {
+        struct sockaddr_in from;
+        socklen_t flen = sizeof(from);
+        int fd = accept(lfd, (struct sockaddr *)&from, &flen);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("peer accept");
+            break;
+        }
+        if (!peer_addr_allowed(&from)) {
+            char addr[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &from.sin_addr, addr, sizeof(addr));
+            log_info("Peer link from %s refused (not in --peer-allow)", addr);
+            close(fd);
+            continue;
+        }
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, link_accepted, (void *)(intptr_t)fd) != 0) {
+            perror("pthread_create");
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    close(lfd);
+    return NULL;
+}
+
+static void start_thread(void *(*fn)(void *), void *arg) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, fn, arg) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    pthread_detach(tid);
+}
+
+void fed_start(void) {
+    int outbound = 0;
+    for (int i = 0; i < MAX_PEERS; i++) outbound += peers[i].used;
+    if (!outbound && !config.peer_port) return;
+
+    epoch = ((unsigned long long)time(NULL) << 20) ^ (unsigned long long)getpid();
+    if (!config.node_name) snprintf(node_default, sizeof(node_default), "node-%d", config.port);
+    enabled = 1;
+
+    if (config.peer_port) {
+        for (int i = 0; i < nallow_hosts; i++) allow_resolve(allow_hosts[i]);
+        for (int i = 0; i < MAX_PEERS; i++)
+            if (peers[i].used) allow_resolve(peers[i].host);
+        if (!nallowed) log_info("Peer port %d: no allowed addresses, every link will be refused",
+                                config.peer_port);
+        int lfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (lfd < 0) die("peer socket");
+        int yes = 1;
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(config.peer_port);
+        addr.sin_addr.s_addr = INADDR_ANY;
+        if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, MAX_PEERS) < 0)
+            die("peer bind");
+        start_thread(peer_listener, (void *)(intptr_t)lfd);
+    }
+
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (!peers[i].used) continue;
+        start_link_threads(&peers[i]);
+        start_thread(link_dialer, &peers[i]);
+    }
+    log_info("Cluster node %s: %d outbound peer(s), peer port %d", node_name(), outbound,
+             config.peer_port);
+}
+
+/* the peers command */
+void fed_report(int sock) {
+    if (!enabled) {
+        send_to_sock(sock, "Cluster mode is off (see --peer, --peer-port)\n");
+        return;
+    }
+    strbuf_t out;
+    sb_init(&out);
+    sb_appendf(&out, "Node %s\n", node_name());
+    for (int i = 0; i < MAX_PEERS; i++) {
+        peer_t *p = &peers[i];
+        if (!__atomic_load_n(&p->used, __ATOMIC_ACQUIRE)) continue;
+        pthread_mutex_lock(&p->lock);
+        sb_appendf(&out, "  %-16s %-3s %-8s %s%s%s unacked=%d sent=%lu batches=%lu received=%lu\n",
+                   p->node[0] ? p->node : "?", p->outbound ? "out" : "in",
+                   p->sock >= 0 ? "up" : "down", p->host, p->outbound ? ":" : "",
+                   p->port, p->queued, p->sent, p->batches, p->received);
+        pthread_mutex_unlock(&p->lock);
+    }
+    send_buf_to_sock(sock, out.data, out.len);
+    sb_free(&out);
+}
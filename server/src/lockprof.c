@@ -0,0 +1,154 @@
+#include "lockprof.h"
+#include "clients.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static int enabled;
+static lockprof_site_t *sites;       /* every site that has recorded, newest first */
+
+/* locks this thread holds with a profiled acquire, for hold times */
+#define HELD_MAX 4
+static __thread struct {
+    pthread_mutex_t *m;
+    lockprof_site_t *site;
+    long long since;
+} held[HELD_MAX];
+static __thread int nheld;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int bucket(long long ns) {
+    long long us = ns / 1000;
+    int b = 0;
+    while (us > 1 && b < LOCKPROF_BUCKETS - 1) { us >>= 1; b++; }
+    return b;
+}
+
+static void add_max(unsigned long long *max, unsigned long long v) {
+    unsigned long long cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (v > cur && !__atomic_compare_exchange_n(max, &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void register_site(lockprof_site_t *site) {
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&site->registered, &expected, 1, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;
+    lockprof_site_t *head = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+    do {
+        site->next = head;
+    } while (!__atomic_compare_exchange_n(&sites, &head, site, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/* Locks `m`. Returns how long the caller waited in ns (0 if the lock was
+ * free), which db_lock_acquire() also feeds to overload detection. */
+long long lockprof_acquire(pthread_mutex_t *m, lockprof_site_t *site) {
+    long long waited = 0;
+    if (pthread_mutex_trylock(m) != 0) {
+        long long start = now_ns();
+        pthread_mutex_lock(m);
+        waited = now_ns() - start;
+    }
+    if (!site || !__atomic_load_n(&enabled, __ATOMIC_RELAXED)) return waited;
+
+    register_site(site);
+    __atomic_fetch_add(&site->acquires, 1, __ATOMIC_RELAXED);
+    if (waited) {
+        __atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&site->wait_ns, (unsigned long long)waited, __ATOMIC_RELAXED);
+        add_max(&site->wait_max_ns, (unsigned long long)waited);
+    }
+    __atomic_fetch_add(&site->wait_hist[bucket(waited)], 1, __ATOMIC_RELAXED);
+    if (nheld < HELD_MAX) {
+        held[nheld].m = m;
+        held[nheld].site = site;
+        held[nheld].since = now_ns();
+        nheld++;
+    }
+    return waited;
+}
+
+void lockprof_release(pthread_mutex_t *m) {
+    for (int i = nheld - 1; i >= 0; i--) {
+        if (held[i].m != m) continue;
+        lockprof_site_t *site = held[i].site;
+        long long hold = now_ns() - held[i].since;
+        held[i] = held[--nheld];
+        __atomic_fetch_add(&site->hold_ns, (unsigned long long)hold, __ATOMIC_RELAXED);
+        add_max(&site->hold_max_ns, (unsigned long long)hold);
+        __atomic_fetch_add(&site->hold_hist[bucket(hold)], 1, __ATOMIC_RELAXED);
+        break;
+    }
+    pthread_mutex_unlock(m);
+}
+
+void lockprof_enable(int on) {
+    __atomic_store_n(&enabled, on, __ATOMIC_RELAXED);
+}
+
+/* sites stay registered; only their numbers are cleared */
+void lockprof_reset(void) {
+    for (lockprof_site_t *s = __atomic_load_n(&sites, __ATOMIC_ACQUIRE); s; s = s->next) {
+        __atomic_store_n(&s->acquires, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->contended, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->wait_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->wait_max_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->hold_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->hold_max_ns, 0, __ATOMIC_RELAXED);
+        for (int b = 0; b < LOCKPROF_BUCKETS; b++) {
+            __atomic_store_n(&s->wait_hist[b], 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&s->hold_hist[b], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* upper bound (us) of the bucket holding the 99th percentile */
+static unsigned long long p99_us(const unsigned long *hist, unsigned long total) {
+    if (!total) return 0;
+    unsigned long seen = 0;
+    for (int b = 0; b < LOCKPROF_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen * 100 >= total * 99) return 1ULL << (b + 1);
+    }
+    return 1ULL << LOCKPROF_BUCKETS;
+}
+
+/* the `top` sites with the most total wait, worst first */
+void lockprof_report(int sock, int top) {
+    lockprof_site_t *order[256];
+    int n = 0;
+    for (lockprof_site_t *s = __atomic_load_n(&sites, __ATOMIC_ACQUIRE); s && n < 256; s = s->next)
+        if (s->acquires) order[n++] = s;
+
+    for (int i = 1; i < n; i++) {
+        lockprof_site_t *s = order[i];
+        int j = i;
+        for (; j > 0 && order[j - 1]->wait_ns < s->wait_ns; j--) order[j] = order[j - 1];
+        order[j] = s;
+    }
+
+    strbuf_t out;
+    sb_init(&out);
+    sb_appendf(&out, "LOCKSTATS %s, %d site(s)\n",
+               __atomic_load_n(&enabled, __ATOMIC_RELAXED) ? "recording" : "off", n);
+    for (int i = 0; i < n && i < top; i++) {
+        lockprof_site_t *s = order[i];
+        sb_appendf(&out,
+                   "%-12s %s:%d  n=%lu contended=%lu  wait total=%.1fms max=%lluus p99<%lluus"
+                   "  hold avg=%lluus max=%lluus p99<%lluus\n",
+                   s->lock, s->func, s->line, s->acquires, s->contended,
+                   s->wait_ns / 1e6, s->wait_max_ns / 1000, p99_us(s->wait_hist, s->acquires),
+                   s->hold_ns / s->acquires / 1000, s->hold_max_ns / 1000,
+                   p99_us(s->hold_hist, s->acquires));
+    }
+    send_buf_to_sock(sock, out.data, out.len);
+    sb_free(&out);
+}
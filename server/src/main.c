@@ -3,6 +3,20 @@
 #include "database.h"
 #include "clients.h"
 #include "client_thread.h" /* not ideal to include, but client_thread is compiled separately; here only prototypes used */
+#include "upgrade.h"
+#include "timer.h"
+#include "ratelimit.h"
+#include "presence.h"
+#include "lockprof.h"
+#include "users.h"
+#include "trace.h"
+#include "record.h"
+#include "federation.h"
+#include "shards.h"
+#include "netio.h"
+#include "backup.h"
+#include <getopt.h>
+#include <limits.h>
 #include <signal.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -13,6 +27,7 @@
 #include <pthread.h>
 #include <unistd.h>
 
+server_config_t config;
 int server_fd;
 int running = 1;
 sqlite3 *db = NULL;
@@ -31,54 +46,200 @@ static void handle_sigint(int sig) {
     broadcast_shutdown_and_close_all();
     if (server_fd > 0) close(server_fd);
 
-    pthread_mutex_lock(&db_lock);
-    if (db) sqlite3_close(db);
-    pthread_mutex_unlock(&db_lock);
+    close_database();
+    record_close();
 
     exit(0);
 }
 
-int main(int argc, char **argv) {
-    if (argc != 3) {
-        printf("Usage: %s <port> <database>\n", argv[0]);
-        return 1;
+static void usage(const char *prog) {
+    printf("Usage: %s <port> <database> [options]\n"
+           "  --upgrade-sock <path>   accept hot-upgrade requests on this unix socket\n"
+           "  --takeover              take listener and sessions over from the server\n"
+           "                          running on --upgrade-sock instead of binding\n"
+           "  --login-timeout <sec>   time allowed to log in (default %d, 0 = none)\n"
+           "  --idle-timeout <sec>    disconnect after this much silence (default %d, 0 = none)\n"
+           "  --write-timeout <sec>   disconnect a client whose socket stays full this long\n"
+           "                          (default %d, 0 = none)\n"
+           "  --ping-interval <sec>   send PING after this much silence (default %d, 0 = none)\n"
+           "  --max-message-size <bytes>\n"
+           "                          largest message accepted by bigchat (default %d)\n"
+           "  --rate-limit <class>=<per-sec>/<burst>\n"
+           "                          per-session command limits, class chat, query or other\n"
+           "                          (defaults chat=5/20 query=2/10 other=10/30, 0 = unlimited)\n"
+           "  --overload-ms <ms>      refuse queries while db waits average this long\n"
+           "                          (default %d, 0 = never)\n"
+           "  --lock-profile          record db_lock/clients_lock contention from startup\n"
+           "                          (see the lockstats command)\n"
+           "  --trace-sample <N>      trace one command in N (default 0 = off)\n"
+           "  --record <file>         write an anonymized capture of client commands\n"
+           "                          for tools/replay\n"
+           "  --peer <host:port>      link to another server's peer port (repeatable)\n"
+           "  --peer-port <port>      accept links from other servers on this port\n"
+           "  --peer-allow <host>     accept peer links from this host (repeatable;\n"
+           "                          --peer hosts are allowed too)\n"
+           "  --node <name>           this server's name in the cluster (default node-<port>)\n"
+           "  --shards <N>            <database> is a directory; spread messages over N\n"
+           "                          files by conversation (1..%d)\n"
+           "  --io <backend>          threads (default, a thread per connection), epoll,\n"
+           "                          or uring (io_uring, falls back to epoll)\n"
+           "  --backup-dir <dir>      enable the backup command, writing into <dir>\n"
+           "  --backup-every <sec>    also back up to <dir>/auto[.db] this often\n"
+           "  --admin <user>          allow <user> to run backups and change the profilers\n"
+           "                          (repeatable)\n"
+           "  --storage <profile>     durable (default), balanced or throughput: journal,\n"
+           "                          sync, cache, mmap and page size settings\n"
+           "  --warmup                read recent history into cache after startup\n",
+           prog, DEFAULT_LOGIN_TIMEOUT, DEFAULT_IDLE_TIMEOUT, DEFAULT_WRITE_TIMEOUT, DEFAULT_PING_INTERVAL,
+           DEFAULT_MAX_MESSAGE_SIZE, DEFAULT_OVERLOAD_MS, MAX_SHARDS);
+}
+
+static void parse_args(int argc, char **argv) {
+    static const struct option opts[] = {
+        { "upgrade-sock", required_argument, NULL, 'u' },
+        { "takeover",     no_argument,       NULL, 't' },
+        { "login-timeout", required_argument, NULL, 'L' },
+        { "idle-timeout",  required_argument, NULL, 'I' },
+        { "write-timeout", required_argument, NULL, 'W' },
+        { "ping-interval", required_argument, NULL, 'P' },
+        { "max-message-size", required_argument, NULL, 'M' },
+        { "rate-limit",    required_argument, NULL, 'R' },
+        { "overload-ms",   required_argument, NULL, 'O' },
+        { "lock-profile",  no_argument,       NULL, 'K' },
+        { "trace-sample",  required_argument, NULL, 'T' },
+        { "record",        required_argument, NULL, 'r' },
+        { "peer",          required_argument, NULL, 'p' },
+        { "peer-port",     required_argument, NULL, 'N' },
+        { "peer-allow",    required_argument, NULL, 'a' },
+        { "node",          required_argument, NULL, 'n' },
+        { "shards",        required_argument, NULL, 'S' },
+        { "io",            required_argument, NULL, 'i' },
+        { "backup-dir",    required_argument, NULL, 'B' },
+        { "backup-every",  required_argument, NULL, 'E' },
+        { "admin",         required_argument, NULL, 'A' },
+        { "storage",       required_argument, NULL, 's' },
+        { "warmup",        no_argument,       NULL, 'w' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    memset(&config, 0, sizeof(config));
+    config.login_timeout = DEFAULT_LOGIN_TIMEOUT;
+    config.idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    config.write_timeout = DEFAULT_WRITE_TIMEOUT;
+    config.ping_interval = DEFAULT_PING_INTERVAL;
+    config.max_message_size = DEFAULT_MAX_MESSAGE_SIZE;
+    config.overload_ms = DEFAULT_OVERLOAD_MS;
+    int c;
+    while ((c = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (c) {
+        case 'u': config.upgrade_sock = optarg; break;
+        case 't': config.takeover = 1; break;
+        case 'L': config.login_timeout = atoi(optarg); break;
+        case 'I': config.idle_timeout = atoi(optarg); break;
+        case 'W': config.write_timeout = atoi(optarg); break;
+        case 'P': config.ping_interval = atoi(optarg); break;
+        case 'M': config.max_message_size = atoll(optarg); break;
+        case 'R':
+            if (!rl_parse(optarg)) { usage(argv[0]); exit(1); }
+            break;
+        case 'O': config.overload_ms = atoi(optarg); break;
+        case 'K': config.lock_profile = 1; break;
+        case 'T': trace_sample_every = atoi(optarg); break;
+        case 'r': config.record_file = optarg; break;
+        case 'p':
+            if (!fed_add_peer(optarg)) { usage(argv[0]); exit(1); }
+            break;
+        case 'N': config.peer_port = atoi(optarg); break;
+        case 'a':
+            if (!fed_allow_peer(optarg)) { usage(argv[0]); exit(1); }
+            break;
+        case 'n': config.node_name = optarg; break;
+        case 'S': config.shards = atoi(optarg); break;
+        case 'i':
+            if (!netio_parse(optarg)) { usage(argv[0]); exit(1); }
+            break;
+        case 'B': config.backup_dir = optarg; break;
+        case 'E': config.backup_every = atoi(optarg); break;
+        case 'A':
+            if (!user_add_admin(optarg)) { usage(argv[0]); exit(1); }
+            break;
+        case 's':
+            if (!storage_parse(optarg)) { usage(argv[0]); exit(1); }
+            break;
+        case 'w': config.warmup = 1; break;
+        default: usage(argv[0]); exit(1);
+        }
+    }
+
+    /* blob offsets are ints in the SQLite API */
+    if (argc - optind != 2 || (config.takeover && !config.upgrade_sock) ||
+        config.max_message_size <= 0 || config.max_message_size > INT_MAX ||
+        config.shards < 0 || config.shards > MAX_SHARDS ||
+        config.backup_every < 0 || (config.backup_every && !config.backup_dir)) {
+        usage(argv[0]);
+        exit(1);
     }
+    config.port = atoi(argv[optind]);
+    config.dbfile = argv[optind + 1];
+}
 
-    int port = atoi(argv[1]);
-    const char *dbfile = argv[2];
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+
+    int port = config.port;
+    const char *dbfile = config.dbfile;
 
     signal(SIGINT, handle_sigint);
+    signal(SIGPIPE, SIG_IGN);
 
     memset(clients, 0, sizeof(clients));
     init_database(dbfile);
+    timers_start();
+    presence_start();
+    if (config.record_file && !record_open(config.record_file)) die("record");
+    lockprof_enable(config.lock_profile);
+    fed_start();
+    netio_init();
+    backup_start();
 
-    log_info("Creating socket...");
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) die("socket");
+    if (config.takeover) {
+        log_info("Taking over from running server via %s...", config.upgrade_sock);
+        if (!upgrade_takeover(config.upgrade_sock)) die("takeover");
+    } else {
+        log_info("Creating socket...");
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_fd < 0) die("socket");
 
-    log_server_lan_ip();
+        log_server_lan_ip();
 
-    int yes = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) die("setsockopt");
+        int yes = 1;
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) die("setsockopt");
 #ifdef SO_REUSEPORT
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
 #endif
 
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = INADDR_ANY;
+        struct sockaddr_in addr;
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = INADDR_ANY;
+
+        log_info("Binding to port %d...", port);
+        if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) die("bind");
+        log_info("Listening for connections...");
+        if (listen(server_fd, 10) < 0) die("listen");
+    }
+
+    if (config.upgrade_sock) upgrade_listen(config.upgrade_sock);
 
-    log_info("Binding to port %d...", port);
-    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) die("bind");
-    log_info("Listening for connections...");
-    if (listen(server_fd, 10) < 0) die("listen");
+    if (config.warmup) db_warmup_start();
+    if (netio_evented()) netio_run(server_fd);
 
     while (running) {
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
 
         log_info("Waiting for incoming connections...");
+        session_wait_readable(server_fd);
         int client_sock = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
         if (client_sock < 0) {
             if (errno == EINTR) continue;
@@ -86,21 +247,16 @@ int main(int argc, char **argv) {
             continue;
         }
 
-        log_info("New connection accepted (sock=%d)", client_sock);
+        if (!session_room_for(client_sock)) continue;
 
-        int *psock = malloc(sizeof(int));
-        if (!psock) { close(client_sock); continue; }
-        *psock = client_sock;
+        log_info("New connection accepted (sock=%d)", client_sock);
 
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, client_thread, psock) != 0) {
-            perror("pthread_create"); free(psock); close(client_sock); continue;
-        }
-        pthread_detach(tid);
+        if (!start_client_thread(client_sock)) close(client_sock);
     }
 
     broadcast_shutdown_and_close_all();
     if (server_fd > 0) close(server_fd);
-    pthread_mutex_lock(&db_lock); if (db) sqlite3_close(db); pthread_mutex_unlock(&db_lock);
+    close_database();
+    record_close();
     return 0;
 }
@@ -4,6 +4,7 @@
 #include "messaging.h"
 #include "database.h"
 #include "server.h"
+#include "client_thread.h"
 
 #include <stdio.h>        // snprintf(), printf()
 #include <string.h>       // strlen(), memset(), strcmp(), etc.
@@ -14,91 +15,23 @@
 #include <arpa/inet.h>    // inet_addr(), htons(), htonl()
 #include <unistd.h>       // close()
 
-/* show distinct chat partners for username */
-void handle_menu_chatrooms(const char *username, int sock, client_chat_state_t *state) {
-    char buf[BUF_SIZE];
-    int n;
-
-    while (1) {
-        pthread_mutex_lock(&db_lock);
-
-        sqlite3_stmt *stmt = NULL;
-        const char *sql =
-            "SELECT DISTINCT CASE WHEN sender = ? THEN receiver WHEN receiver = ? THEN sender END as partner "
-            "FROM messages WHERE sender = ? OR receiver = ? ORDER BY partner ASC;";
-
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-            pthread_mutex_unlock(&db_lock);
-            send_to_sock(sock, "ERROR: DB prepare failed\n");
-            return;
-        }
-
-        sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 2, username, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 3, username, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 4, username, -1, SQLITE_TRANSIENT);
-
-        int i = 0;
-        send_to_sock(sock, "---- Menu: Chat Rooms ----\n");
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const unsigned char *partner = sqlite3_column_text(stmt, 0);
-            if (partner && strlen((const char*)partner) > 0) {
-                snprintf(buf, sizeof(buf), "%d) Chat with %s\n", i + 1, (const char*)partner);
-                send_to_sock(sock, buf);
-                i++;
-            }
-        }
-        if (i == 0)
-            send_to_sock(sock, "(no chat rooms)\n");
-
-        sqlite3_finalize(stmt);
-        pthread_mutex_unlock(&db_lock);
-
-        send_to_sock(sock, "Commands: select <username>   back   listusers   help\n");
-
-        // Receive user input
-        memset(buf, 0, sizeof(buf));
-        n = recv(sock, buf, sizeof(buf) - 1, 0);
-        if (n <= 0) return;
-        buf[n] = '\0';
-        trim_whitespace(buf);
-
-        // Handle commands
-        if (strcasecmp(buf, "back") == 0) {
-            send_help(sock, state); // <-- go back to main help after exiting
-          return;
-        }
-        else if (strcasecmp(buf, "listusers") == 0) {
-            menu_view_users(sock);
-        }
-        else if (strcasecmp(buf, "help") == 0) {
-            send_help(sock, state);
-        }
-        else if (strncasecmp(buf, "select ", 7) == 0) {
-            char *partner = buf + 7;
-            trim_whitespace(partner);
-            if (!user_exists(partner)) {
-                send_to_sock(sock, "ERROR: User does not exist.\n");
-                continue;
-            }
-            // Start closed chat with selected partner
-            menu_start_closed_chat(username, sock, state);;
-        }
-        else {
-            send_to_sock(sock, "Unknown command. Type 'help'\n");
-        }
+/* chat-room list; a database error leaves the menu */
+static void show_rooms(const char *username, int sock, client_chat_state_t *state) {
+    send_to_sock(sock, "---- Menu: Chat Rooms ----\n");
+    int rooms = handle_chatrooms_db_and_send(username, sock);
+    if (rooms < 0) {
+        state->menu = MENU_NONE;
+        return;
     }
-}
+    if (rooms == 0)
+        send_to_sock(sock, "(no chat rooms)\n");
 
-/* interactive menu (text choices) */
-void handle_menu(const char *username, int sock, client_chat_state_t *state)
-{
-    char buf[512];
-    int n;
-
-menu_start:
+    send_to_sock(sock, "Commands: select <username>   back   listusers   help\n");
+    state->menu = MENU_ROOMS;
+}
 
-    snprintf(buf, sizeof(buf),
+static void show_main(int sock, client_chat_state_t *state) {
+    send_to_sock(sock,
         "=== MAIN MENU ===\n"
         "1. Start Open Chat\n"
         "2. Start Closed Chat (one partner)\n"
@@ -108,251 +41,265 @@ menu_start:
         "6. Exit menu\n"
         "Enter choice:\n"
     );
-    send(sock, buf, strlen(buf), 0);
+    state->menu = MENU_MAIN;
+}
 
-    memset(buf, 0, sizeof(buf));
-    n = recv(sock, buf, sizeof(buf), 0);
-    if (n <= 0) return;
+/* a menu chat ended (or never started): back to the screen it came from */
+static void menu_resume(const char *username, int sock, client_chat_state_t *state) {
+    if (state->menu_return == MENU_MAIN) show_main(sock, state);
+    else show_rooms(username, sock, state);
+}
 
-    int choice = atoi(buf);
+/* show distinct chat partners for username */
+void handle_menu_chatrooms(const char *username, int sock, client_chat_state_t *state) {
+    state->menu_return = MENU_ROOMS;
+    show_rooms(username, sock, state);
+}
 
-    switch (choice)
+/* interactive menu (text choices) */
+void handle_menu(const char *username, int sock, client_chat_state_t *state) {
+    (void)username;
+    state->menu_return = MENU_MAIN;
+    show_main(sock, state);
+}
+
+void menu_start_open_chat(const char *username, int sock, client_chat_state_t *state)
+{
+    (void)username;
+    const char *msg =
+        "[MENU] Entering OPEN CHAT.\n"
+        "Type messages normally. Type /exit to return to menu.\n";
+    send_to_sock(sock, msg);
+    state->menu = MENU_OPEN_CHAT;
+}
+
+void menu_start_closed_chat(const char *username, int sock, client_chat_state_t *state)
+{
+    (void)username;
+    send_to_sock(sock, "Enter username to start Closed Chat:\n");
+    state->menu = MENU_CLOSED_ASK;
+}
+
+void menu_start_semiclosed_chat(const char *username, int sock, client_chat_state_t *state)
+{
+    (void)username;
+    const char *intro =
+        "Enter usernames for the chat room, separated by spaces.\n"
+        "Example: Bob Alice Charlie\n";
+    send_to_sock(sock, intro);
+    state->menu = MENU_ROOM_ASK;
+}
+
+static void rooms_input(const char *username, int sock, client_chat_state_t *state, char *buf) {
+    trim_whitespace(buf);
+
+    if (strcasecmp(buf, "back") == 0) {
+        state->menu = MENU_NONE;
+        send_help(sock, state); // <-- go back to main help after exiting
+        return;
+    }
+    else if (strcasecmp(buf, "listusers") == 0) {
+        menu_view_users(sock);
+    }
+    else if (strcasecmp(buf, "help") == 0) {
+        send_help(sock, state);
+    }
+    else if (strncasecmp(buf, "select ", 7) == 0) {
+        char *partner = buf + 7;
+        trim_whitespace(partner);
+        if (user_exists(partner)) {
+            // Start closed chat with selected partner
+            menu_start_closed_chat(username, sock, state);
+            return;
+        }
+        send_to_sock(sock, "ERROR: User does not exist.\n");
+    }
+    else {
+        send_to_sock(sock, "Unknown command. Type 'help'\n");
+    }
+    show_rooms(username, sock, state);
+}
+
+static void main_input(const char *username, int sock, client_chat_state_t *state, char *buf) {
+    switch (atoi(buf))
     {
         case 1:
-            menu_start_open_chat(username, sock);
-            goto menu_start;
+            menu_start_open_chat(username, sock, state);
+            return;
 
         case 2:
             menu_start_closed_chat(username, sock, state);
-            goto menu_start;
+            return;
 
         case 3:
             menu_start_semiclosed_chat(username, sock, state);
-            goto menu_start;
+            return;
 
         case 4:
             menu_view_users(sock);
-            goto menu_start;
+            break;
 
         case 5:
             menu_view_messages(username, sock, state);
-            goto menu_start;
+            break;
 
         case 6:
-            send(sock, "Leaving menu...\n", 16, 0);
+            send_to_sock(sock, "Leaving menu...\n");
+            state->menu = MENU_NONE;
             return;
 
         default:
-            send(sock, "Invalid choice.\n", 16, 0);
-            goto menu_start;
-    }
-}
-
-void menu_start_open_chat(const char *username, int sock)
-{
-    const char *msg =
-        "[MENU] Entering OPEN CHAT.\n"
-        "Type messages normally. Type /exit to return to menu.\n";
-    send(sock, msg, strlen(msg), 0);
-
-    char line[512];
-    int n;
-
-    while ((n = recv(sock, line, sizeof(line), 0)) > 0)
-    {
-        line[n] = 0;
-
-        if (strcmp(line, "/exit\n") == 0)
+            send_to_sock(sock, "Invalid choice.\n");
             break;
-
-        broadcast_message(username, line);
     }
-
-    send(sock, "[MENU] Returned from Open Chat.\n", 32, 0);
+    show_main(sock, state);
 }
 
-void menu_start_closed_chat(const char *username, int sock, client_chat_state_t *state)
-{
-    char out[256];
-    snprintf(out, sizeof(out),
-             "Enter username to start Closed Chat:\n");
-    send(sock, out, strlen(out), 0);
-
-    char partner[64];
-    int n = recv(sock, partner, sizeof(partner), 0);
-    if (n <= 0) return;
-    partner[n - 1] = 0;
-
+static void closed_ask_input(const char *username, int sock, client_chat_state_t *state, char *partner) {
+    partner[strcspn(partner, "\r\n")] = 0;
     if (!user_exists(partner)) {
-        send(sock, "User does not exist.\n", 21, 0);
+        send_to_sock(sock, "User does not exist.\n");
+        menu_resume(username, sock, state);
         return;
     }
+    strncpy(state->menu_partner, partner, USERNAME_LEN - 1);
+    state->menu_partner[USERNAME_LEN - 1] = '\0';
 
+    char out[256];
     snprintf(out, sizeof(out),
              "[MENU] Closed Chat with %s started.\n"
-             "Type /exit to leave.\n", partner);
-    send(sock, out, strlen(out), 0);
-
-    char buf[512];
-
-    while ((n = recv(sock, buf, sizeof(buf), 0)) > 0)
-    {
-        buf[n] = 0;
-
-        if (strcmp(buf, "/exit\n") == 0)
-            break;
-
-        send_private_message(username, partner, buf);
-    }
-
-    send(sock, "[MENU] Returned from Closed Chat.\n", 35, 0);
-    send_help(sock, state); // <-- go back to main help after exiting
+             "Type /exit to leave.\n", state->menu_partner);
+    send_to_sock(sock, out);
+    state->menu = MENU_CLOSED_CHAT;
 }
 
-void menu_start_semiclosed_chat(const char *username, int sock, client_chat_state_t *state)
-{
-    const char *intro =
-        "Enter usernames for the chat room, separated by spaces.\n"
-        "Example: Bob Alice Charlie\n";
-    send(sock, intro, strlen(intro), 0);
-
-    char line[512];
-    int n = recv(sock, line, sizeof(line), 0);
-    if (n <= 0) return;
-    line[n - 1] = 0;
+static void room_ask_input(const char *username, int sock, client_chat_state_t *state, char *line) {
+    line[strcspn(line, "\r\n")] = 0;
 
-    // Parse users
-    char *members[10];
-    int count = 0;
+    // Parse users straight into the session's room state
+    state->menu_prev_mode = state->mode;
+    state->room_size = 0;
 
-    char *tok = strtok(line, " ");
-    while (tok && count < 10)
+    char *saveptr = NULL;
+    char *tok = strtok_r(line, " ", &saveptr);
+    while (tok && state->room_size < MAX_ROOM_USERS)
     {
-        if (user_exists(tok))
-            members[count++] = strdup(tok);
-        tok = strtok(NULL, " ");
+        if (user_exists(tok)) {
+            strncpy(state->room_partners[state->room_size], tok, USERNAME_LEN - 1);
+            state->room_partners[state->room_size][USERNAME_LEN - 1] = '\0';
+            state->room_size++;
+        }
+        tok = strtok_r(NULL, " ", &saveptr);
     }
 
-    if (count == 0) {
-        send(sock, "No valid users.\n", 16, 0);
+    if (state->room_size == 0) {
+        send_to_sock(sock, "No valid users.\n");
+        menu_resume(username, sock, state);
         return;
     }
 
-    send(sock, "[MENU] Semi-Closed room created.\nType /exit to leave.\n", 55, 0);
+    state->mode = SEMI_CLOSED_CHAT;
+    send_to_sock(sock, "[MENU] Semi-Closed room created.\nType /exit to leave.\n");
+    state->menu = MENU_ROOM_CHAT;
+}
 
-    while ((n = recv(sock, line, sizeof(line), 0)) > 0)
-    {
-        line[n] = 0;
-        if (strcmp(line, "/exit\n") == 0)
+/* one line of input while state->menu != MENU_NONE */
+void menu_input(const char *username, int sock, client_chat_state_t *state, char *line)
+{
+    switch (state->menu) {
+    case MENU_ROOMS:
+        rooms_input(username, sock, state, line);
+        break;
+
+    case MENU_MAIN:
+        main_input(username, sock, state, line);
+        break;
+
+    case MENU_OPEN_CHAT:
+        if (strcmp(line, "/exit\n") != 0) {
+            broadcast_message(username, line);
             break;
+        }
+        send_to_sock(sock, "[MENU] Returned from Open Chat.\n");
+        menu_resume(username, sock, state);
+        break;
+
+    case MENU_CLOSED_ASK:
+        closed_ask_input(username, sock, state, line);
+        break;
 
-        for (int i = 0; i < count; i++)
-            send_private_message(username, members[i], line);
+    case MENU_CLOSED_CHAT:
+        if (strcmp(line, "/exit\n") != 0) {
+            send_private_message(username, state->menu_partner, line);
+            break;
+        }
+        state->menu_partner[0] = '\0';
+        send_to_sock(sock, "[MENU] Returned from Closed Chat.\n");
+        send_help(sock, state); // <-- go back to main help after exiting
+        menu_resume(username, sock, state);
+        break;
+
+    case MENU_ROOM_ASK:
+        room_ask_input(username, sock, state, line);
+        break;
+
+    case MENU_ROOM_CHAT:
+        line[strcspn(line, "\r\n")] = 0;
+        if (strcmp(line, "/exit") != 0) {
+            int unstored = 0;
+            int unforwarded = send_to_room(username, state->room_partners, state->room_size, line,
+                                           &unstored);
+            if (unstored) {
+                char note[96];
+                snprintf(note, sizeof(note),
+                         "ERROR: could not store message, %d member(s) did not get it\n", unstored);
+                send_to_sock(sock, note);
+            }
+            if (unforwarded) {
+                char note[96];
+                snprintf(note, sizeof(note),
+                         "ERROR: peer link backed up, %d member(s) did not get this message\n",
+                         unforwarded);
+                send_to_sock(sock, note);
+            }
+            break;
+        }
+        state->mode = state->menu_prev_mode;
+        state->room_size = 0;
+        send_to_sock(sock, "[MENU] Returned from Semi-Closed chat.\n");
+        send_help(sock, state); // <-- go back to main help after exiting
+        menu_resume(username, sock, state);
+        break;
+
+    case MENU_NONE:
+        break;
     }
+}
 
-    send(sock, "[MENU] Returned from Semi-Closed chat.\n", 40, 0);
-    send_help(sock, state); // <-- go back to main help after exiting
+/* chat steps take free text rather than commands */
+int menu_takes_text(const client_chat_state_t *state) {
+    return state->menu == MENU_OPEN_CHAT || state->menu == MENU_CLOSED_CHAT ||
+           state->menu == MENU_ROOM_CHAT;
 }
 
 void menu_view_users(int sock)
 {
-    char out[1024];
-    get_all_users(out, sizeof(out));
-    send(sock, out, strlen(out), 0);
+    handle_getuserlist(sock);
 }
 
 void menu_view_messages(const char *username, int sock, client_chat_state_t *state)
 {
-    char out[2048];  // bigger buffer to avoid truncation
-    memset(out, 0, sizeof(out));
-
-    pthread_mutex_lock(&db_lock);
-
-    sqlite3_stmt *stmt = NULL;
-    const char *sql_open = "SELECT sender, message, timestamp FROM messages WHERE mode = ? ORDER BY timestamp ASC;";
-    const char *sql_closed =
-        "SELECT sender, message, timestamp FROM messages "
-        "WHERE (sender = ? AND receiver = ?) OR (sender = ? AND receiver = ?) "
-        "ORDER BY timestamp ASC;";
-
-    int rc;
-
-    if (!state || state->mode == OPEN_CHAT) {
-        // Fetch only open chat messages
-        rc = sqlite3_prepare_v2(db, sql_open, -1, &stmt, NULL);
-        if (rc != SQLITE_OK) {
-            send_to_sock(sock, "ERROR: Failed to prepare DB query.\n");
-            pthread_mutex_unlock(&db_lock);
-            return;
-        }
-        sqlite3_bind_int(stmt, 1, OPEN_CHAT);
-    } else {
-        // CLOSED_CHAT or SEMI_CLOSED_CHAT: fetch messages involving this user
-        rc = sqlite3_prepare_v2(db, sql_closed, -1, &stmt, NULL);
-        if (rc != SQLITE_OK) {
-            send_to_sock(sock, "ERROR: Failed to prepare DB query.\n");
-            pthread_mutex_unlock(&db_lock);
-            return;
-        }
-
-        // Bind parameters depending on chat mode
-        if (state->mode == CLOSED_CHAT) {
-            sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
-            sqlite3_bind_text(stmt, 2, state->chat_partner, -1, SQLITE_TRANSIENT);
-            sqlite3_bind_text(stmt, 3, state->chat_partner, -1, SQLITE_TRANSIENT);
-            sqlite3_bind_text(stmt, 4, username, -1, SQLITE_TRANSIENT);
-        } else if (state->mode == SEMI_CLOSED_CHAT) {
-            // For semi-closed chat, we join all room partners
-            // For simplicity, fetch messages from any of the partners
-            // We'll do this with a dynamic query
-            char query[1024];
-            snprintf(query, sizeof(query),
-                "SELECT sender, message, timestamp FROM messages WHERE (receiver IN (");
-
-            for (int i = 0; i < state->room_size; i++) {
-                strcat(query, "'");
-                strcat(query, state->room_partners[i]);
-                strcat(query, "'");
-                if (i < state->room_size - 1) strcat(query, ",");
-            }
-            strcat(query, ") AND sender = ?) OR (sender = ? AND receiver IN (");
-
-            for (int i = 0; i < state->room_size; i++) {
-                strcat(query, "'");
-                strcat(query, state->room_partners[i]);
-                strcat(query, "'");
-                if (i < state->room_size - 1) strcat(query, ",");
-            }
-            strcat(query, ")) ORDER BY timestamp ASC;");
-
-            rc = sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
-            if (rc != SQLITE_OK) {
-                send_to_sock(sock, "ERROR: Failed to prepare DB query.\n");
-                pthread_mutex_unlock(&db_lock);
-                return;
-            }
-
-            sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
-            sqlite3_bind_text(stmt, 2, username, -1, SQLITE_TRANSIENT);
-        }
-    }
-
-    // Collect results
-    char line[512];
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        const unsigned char *sender = sqlite3_column_text(stmt, 0);
-        const unsigned char *msg = sqlite3_column_text(stmt, 1);
-        const unsigned char *ts = sqlite3_column_text(stmt, 2);
-
-        snprintf(line, sizeof(line), "[%s] %s: %s\n",
-                 ts ? (const char*)ts : "",
-                 sender ? (const char*)sender : "",
-                 msg ? (const char*)msg : "");
-        strncat(out, line, sizeof(out) - strlen(out) - 1);
+    const char *partners[MAX_ROOM_USERS];
+    int npartners = 0;
+
+    if (state && state->mode == CLOSED_CHAT && state->chat_partner[0]) {
+        partners[npartners++] = state->chat_partner;
+    } else if (state && state->mode == SEMI_CLOSED_CHAT) {
+        for (int i = 0; i < state->room_size && i < MAX_ROOM_USERS; i++)
+            partners[npartners++] = state->room_partners[i];
     }
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_lock);
-
-    send(sock, out, strlen(out), 0);
+    /* OPEN_CHAT (or an empty room): everything this user sent or received */
+    handle_history_db_and_send(username, sock, partners, npartners,
+                               HISTORY_NO_LIMIT_LOW, HISTORY_NO_LIMIT_HIGH);
 }
@@ -4,37 +4,110 @@
 #include "logging.h"
 #include "utils.h"
 #include "server.h"
+#include "msgbuf.h"
+#include "client_thread.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "federation.h"
 #include <string.h>     // strlen, strcpy if used
 #include <stdio.h>      // <-- for snprintf
 
+/* one formatted payload, sent to every active client. The socket list is
+ * copied under clients_lock and the sends happen after it is released. */
 void broadcast_message(const char *sender, const char *msg)
 {
-    char buf[BUF_SIZE];
-    snprintf(buf, sizeof(buf), "[Broadcast] %s: %s", sender, msg);
+    msgbuf_t *mb = msgbuf_format("[Broadcast] %s: %s", sender, msg);
+    if (!mb) return;
 
-    pthread_mutex_lock(&clients_lock);
+    int socks[MAX_CLIENTS];
+    int n = 0;
+    LOCK(clients_lock);
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].active) {
-            send_to_sock(clients[i].sock, buf);
-        }
+        if (clients[i].active) socks[n++] = clients[i].sock;
     }
-    pthread_mutex_unlock(&clients_lock);
+    UNLOCK(clients_lock);
+
+    for (int i = 0; i < n; i++)
+        send_buf_to_sock(socks[i], mb->data, mb->len);
+    msgbuf_free(mb);
 }
 
-void send_to_user(const char *from, const char *to, const char *message) {
-    char final[BUF_SIZE];
-    int n = snprintf(final, sizeof(final), "%s -> %s: %s\n", from, to, message);
-    if (n >= (int)sizeof(final)) final[sizeof(final)-1] = '\0';
+/* returns the stored id (0 if storing failed) and its seq in *seq, for
+ * the sender's confirmation. *unforwarded (may be NULL) is set when `to`
+ * is on another node and the link to it would not take the message. */
+long long send_to_user(const char *from, const char *to, const char *message, long long *seq,
+                       int *unforwarded) {
+    trace_span_t span;
+    TRACE_BEGIN(&span);
 
-    store_message(from, to, message);
+    /* store first so the recipient sees the id it can later resume from,
+     * and the conversation number it acks */
+    long long id = store_message(from, to, message, seq);
+    int fwd = 0;
+    if (unforwarded) *unforwarded = 0;
+    if (!id) {
+        /* nothing the recipient could ack; the sender is told to retry */
+        log_info("%s sent message to %s (not stored - dropped)", from, to);
+        TRACE_END(&span, "send_to_user");
+        return 0;
+    }
 
     int sock = find_sock_by_username(to);
     if (sock > 0) {
-        send_to_sock(sock, final);
+        msgbuf_t *mb = msgbuf_format("#%lld/%lld %s -> %s: %s\n", id, *seq, from, to, message);
+        if (mb) {
+            send_buf_to_sock(sock, mb->data, mb->len);
+            msgbuf_free(mb);
+        }
         log_info("%s sent message to %s (delivered)", from, to);
+    } else if ((fwd = fed_forward(from, to, message)) > 0) {
+        log_info("%s sent message to %s (forwarded to peer)", from, to);
+    } else if (fwd < 0) {
+        log_info("%s sent message to %s (stored - peer link backed up)", from, to);
     } else {
         log_info("%s sent message to %s (stored - offline)", from, to);
     }
+    if (unforwarded) *unforwarded = fwd < 0;
+    TRACE_END(&span, "send_to_user");
+    return id;
+}
+
+/* semi-closed room: one stored row per member (so each conversation's
+ * history is complete), and each online member's line carries the #id/seq
+ * of its own row so it can be acked like a direct message. A member whose
+ * row could not be stored gets nothing; they are counted in *unstored.
+ * Returns how many members on other nodes the message could not be
+ * forwarded to. */
+int send_to_room(const char *from, char members[][USERNAME_LEN], int count, const char *message,
+                 int *unstored) {
+    char names[MAX_ROOM_USERS * USERNAME_LEN] = {0};
+    long long ids[MAX_ROOM_USERS], seqs[MAX_ROOM_USERS];
+    if (count > MAX_ROOM_USERS) count = MAX_ROOM_USERS;
+    for (int i = 0; i < count; i++) {
+        seqs[i] = 0;
+        ids[i] = store_message(from, members[i], message, &seqs[i]);
+        if (i) strncat(names, ",", sizeof(names) - strlen(names) - 1);
+        strncat(names, members[i], sizeof(names) - strlen(names) - 1);
+    }
+
+    int unforwarded = 0;
+    *unstored = 0;
+    for (int i = 0; i < count; i++) {
+        if (!ids[i]) {
+            (*unstored)++;
+            continue;
+        }
+        int sock = find_sock_by_username(members[i]);
+        if (sock <= 0) {
+            if (fed_forward(from, members[i], message) < 0) unforwarded++;
+            continue;
+        }
+        msgbuf_t *mb = msgbuf_format("#%lld/%lld [Room %s] %s: %s\n", ids[i], seqs[i], names, from, message);
+        if (!mb) continue;
+        send_buf_to_sock(sock, mb->data, mb->len);
+        msgbuf_free(mb);
+    }
+    return unforwarded;
 }
 
 void send_private_message(const char *sender, const char *receiver, const char *msg)
@@ -44,5 +117,164 @@ void send_private_message(const char *sender, const char *receiver, const char *
     snprintf(clean, sizeof(clean), "%s", msg);
     clean[strcspn(clean, "\r\n")] = 0;
 
-    send_to_user(sender, receiver, clean);
+    long long seq = 0;
+    send_to_user(sender, receiver, clean, &seq, NULL);
+}
+
+/* Large messages. After "bigchat <user> <size>" the server answers READY
+ * (or an ERROR, before any payload is read) and the client then sends
+ * exactly <size> raw bytes. Each chunk is written straight into the stored
+ * BLOB and relayed to the recipient as a frame:
+ *     BIGMSG #id/seq from -> to <size>\n
+ *     CHUNK #id <n>\n<n bytes>      (repeated)
+ *     END #id\n                     (or ABORT #id\n)
+ * so neither side ever holds the whole payload. bigchat_begin() checks the
+ * request and starts the transfer; the payload is then fed in with
+ * bigchat_data() as it arrives, so with an event backend each chunk is
+ * just one more input of the session. `early` is the length of payload
+ * the client sent in the same read as the command line. Returns 1 if the
+ * transfer started. */
+int bigchat_begin(const char *from, int sock, const char *to, long long size,
+                  size_t early, bigmsg_t *bm)
+{
+    char line[128 + 2 * USERNAME_LEN];
+
+    memset(bm, 0, sizeof(*bm));
+    if (size <= 0 || size > config.max_message_size) {
+        snprintf(line, sizeof(line), "ERROR: message size must be 1..%lld bytes\n",
+                 config.max_message_size);
+        send_to_sock(sock, line);
+        return 0;
+    }
+    if ((long long)early > size) {
+        send_to_sock(sock, "ERROR: more data than announced\n");
+        return 0;
+    }
+    if (!user_exists(to)) {
+        send_to_sock(sock, "ERROR: target username does not exist\n");
+        return 0;
+    }
+    if (fed_user_is_remote(to)) {
+        send_to_sock(sock, "ERROR: large messages cannot be sent to users on another node\n");
+        return 0;
+    }
+
+    long long seq = 0;
+    long long id = big_message_begin(from, to, size, &seq);
+    if (!id) {
+        send_to_sock(sock, "ERROR: could not store message\n");
+        return 0;
+    }
+    bm->id = id;
+    bm->seq = seq;
+    bm->size = size;
+    bm->sock = sock;
+    snprintf(bm->from, sizeof(bm->from), "%s", from);
+    snprintf(bm->to, sizeof(bm->to), "%s", to);
+
+    bm->peer = find_sock_by_username(to);
+    snprintf(line, sizeof(line), "BIGMSG #%lld/%lld %s -> %s %lld\n", id, seq, from, to, size);
+    if (bm->peer > 0 && send_frame_to_sock(bm->peer, line, NULL, 0) != 0) bm->peer = -1;
+
+    snprintf(line, sizeof(line), "READY %lld\n", size);
+    send_to_sock(sock, line);
+    return 1;
+}
+
+/* the payload still expected */
+size_t bigchat_want(const bigmsg_t *bm)
+{
+    long long left = bm->size - bm->done;
+    return left < BIG_CHUNK_SIZE ? (size_t)left : BIG_CHUNK_SIZE;
+}
+
+/* the next `n` payload bytes (at most bigchat_want()); the transfer ends,
+ * and bm->id goes back to 0, with the last of them or on a failed write */
+void bigchat_data(bigmsg_t *bm, const char *data, size_t n)
+{
+    char line[128 + 2 * USERNAME_LEN];
+
+    if (!big_message_write(bm->id, data, (int)n, bm->done)) {
+        bigchat_abort(bm);
+        return;
+    }
+    if (bm->peer > 0) {
+        snprintf(line, sizeof(line), "CHUNK #%lld %zu\n", bm->id, n);
+        /* a recipient that goes away can still fetch it with getbig */
+        if (send_frame_to_sock(bm->peer, line, data, n) != 0) bm->peer = -1;
+    }
+    bm->done += (long long)n;
+    if (bm->done < bm->size) return;
+
+    if (bm->peer > 0) {
+        snprintf(line, sizeof(line), "END #%lld\n", bm->id);
+        send_to_sock(bm->peer, line);
+    }
+    snprintf(line, sizeof(line), "Message sent ✓ (#%lld/%lld, %lld bytes)\n", bm->id, bm->seq, bm->size);
+    send_to_sock(bm->sock, line);
+    log_info("%s sent large message #%lld (%lld bytes) to %s", bm->from, bm->id, bm->size, bm->to);
+    bm->id = 0;
+}
+
+/* the sender stopped short: drop what was stored */
+void bigchat_abort(bigmsg_t *bm)
+{
+    char line[64];
+
+    big_message_abort(bm->id);
+    if (bm->peer > 0) {
+        snprintf(line, sizeof(line), "ABORT #%lld\n", bm->id);
+        send_to_sock(bm->peer, line);
+    }
+    send_to_sock(bm->sock, "ERROR: large message incomplete, discarded\n");
+    log_info("%s large message to %s aborted after %lld/%lld bytes", bm->from, bm->to,
+             bm->done, bm->size);
+    bm->id = 0;
+}
+
+/* threads backend: the whole transfer in the session's own thread */
+void handle_bigchat(const char *from, int sock, const char *to, long long size,
+                    const char *early, size_t early_len)
+{
+    bigmsg_t bm;
+    if (!bigchat_begin(from, sock, to, size, early_len, &bm)) return;
+    if (early_len) bigchat_data(&bm, early, early_len);
+
+    char chunk[BIG_CHUNK_SIZE];
+    while (bm.id) {
+        ssize_t n = session_recv(sock, chunk, bigchat_want(&bm));
+        if (n <= 0) bigchat_abort(&bm);
+        else bigchat_data(&bm, chunk, (size_t)n);
+    }
+}
+
+/* streams a stored large message back in the same framing */
+void handle_getbig(const char *requester, int sock, long long id)
+{
+    char from[USERNAME_LEN], to[USERNAME_LEN];
+    long long size = 0, seq = 0;
+    char line[128 + 2 * USERNAME_LEN];
+
+    if (!big_message_info(id, requester, from, to, &size, &seq)) {
+        send_to_sock(sock, "ERROR: no such large message\n");
+        return;
+    }
+
+    snprintf(line, sizeof(line), "BIGMSG #%lld/%lld %s -> %s %lld\n", id, seq, from, to, size);
+    if (send_frame_to_sock(sock, line, NULL, 0) != 0) return;
+
+    char chunk[BIG_CHUNK_SIZE];
+    for (long long done = 0; done < size; ) {
+        int n = (size - done) < BIG_CHUNK_SIZE ? (int)(size - done) : BIG_CHUNK_SIZE;
+        if (!big_message_read(id, chunk, n, done)) {
+            snprintf(line, sizeof(line), "ABORT #%lld\n", id);
+            send_to_sock(sock, line);
+            return;
+        }
+        snprintf(line, sizeof(line), "CHUNK #%lld %d\n", id, n);
+        if (send_frame_to_sock(sock, line, chunk, (size_t)n) != 0) return;
+        done += n;
+    }
+    snprintf(line, sizeof(line), "END #%lld\n", id);
+    send_to_sock(sock, line);
 }
@@ -0,0 +1,68 @@
+#include "msgbuf.h"
+#include "slab.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* payload capacities of the pools; anything larger is malloc'd */
+#define MSGBUF_CLASSES 5
+static const size_t class_cap[MSGBUF_CLASSES] = { 128, 512, 2048, 8192, 32768 };
+
+static slab_t pools[MSGBUF_CLASSES] = {
+    SLAB_INITIALIZER(sizeof(msgbuf_t) + 128, 64),
+    SLAB_INITIALIZER(sizeof(msgbuf_t) + 512, 64),
+    SLAB_INITIALIZER(sizeof(msgbuf_t) + 2048, 32),
+    SLAB_INITIALIZER(sizeof(msgbuf_t) + 8192, 8),
+    SLAB_INITIALIZER(sizeof(msgbuf_t) + 32768, 4),
+};
+
+msgbuf_t *msgbuf_alloc(size_t cap) {
+    msgbuf_t *mb = NULL;
+    int cls = -1;
+    for (int i = 0; i < MSGBUF_CLASSES; i++) {
+        if (cap <= class_cap[i]) { cls = i; break; }
+    }
+
+    if (cls >= 0) {
+        mb = slab_alloc(&pools[cls]);
+        cap = class_cap[cls];
+    } else {
+        mb = malloc(sizeof(msgbuf_t) + cap);
+    }
+    if (!mb) return NULL;
+
+    mb->cls = cls;
+    mb->len = 0;
+    mb->cap = cap;
+    return mb;
+}
+
+/* formats straight into a pooled buffer; retries once in a larger class
+ * when the first guess is too small */
+msgbuf_t *msgbuf_format(const char *fmt, ...) {
+    msgbuf_t *mb = msgbuf_alloc(class_cap[1]);
+    if (!mb) return NULL;
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(mb->data, mb->cap, fmt, ap);
+    va_end(ap);
+    if (n < 0) { msgbuf_free(mb); return NULL; }
+
+    if ((size_t)n >= mb->cap) {
+        msgbuf_free(mb);
+        mb = msgbuf_alloc((size_t)n + 1);
+        if (!mb) return NULL;
+        va_start(ap, fmt);
+        vsnprintf(mb->data, mb->cap, fmt, ap);
+        va_end(ap);
+    }
+    mb->len = (size_t)n;
+    return mb;
+}
+
+void msgbuf_free(msgbuf_t *mb) {
+    if (!mb) return;
+    if (mb->cls >= 0) slab_free(&pools[mb->cls], mb);
+    else free(mb);
+}
@@ -0,0 +1,1115 @@
+#define _GNU_SOURCE  /* accept4() */
+#include "netio.h"
+#include "server.h"
+#include "client_thread.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Event backends. The I/O thread (the main thread, in netio_run) owns the
+ * listener and every socket; nothing else reads them, and with one
+ * exception below nothing else writes them. Received bytes are appended to
+ * the connection's input queue and the session is put on the run queue,
+ * unless it is already running, in which case a blocked netio_read() is
+ * woken instead. Workers take sessions off the run queue and step them
+ * until their input is used up.
+ *
+ * Replies go the other way: netio_send() appends them to the connection's
+ * output queue and puts it on the notify list. The I/O thread takes the
+ * whole queue at once and sends it with non-blocking send() and EPOLLOUT,
+ * or with io_uring as one IORING_OP_SEND per connection, all of them
+ * submitted together in one io_uring_enter(). A producer never waits for
+ * another client's socket: a recipient whose queue passes NETIO_MAX_OUTPUT
+ * is dropped. Only a session sending to itself waits for room, which
+ * throttles a large response to its reader. Output that makes no progress
+ * for --write-timeout shuts the socket down. The exception is
+ * send_file_to_sock(), which keeps sendfile(): it waits for the queue to
+ * drain and writes the socket itself between netio_direct_begin() and
+ * netio_direct_end().
+ *
+ * For a hot upgrade, netio_freeze() stops the accept and all reading
+ * (with io_uring, by cancelling them) and lets workers park between inputs
+ * even when input is queued; that input goes to the new process
+ * (netio_pending). Output keeps flowing until the workers are idle; then
+ * sends stop too and what is left goes along (netio_pending_output).
+ * netio_thaw() starts everything again.
+ *
+ * A session that ends shuts down the read side of its socket and hands
+ * the connection back through the notify list; the I/O thread sends what
+ * is still queued, then closes and frees it once nothing is read or sent,
+ * so a descriptor is never reused under a read or a send. */
+
+static io_backend_t backend = IO_THREADS;
+
+/* run queue and worker pool: workers are started on demand and kept */
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t run_cond = PTHREAD_COND_INITIALIZER;
+static struct conn *run_head, *run_tail;
+static int nqueued, idle_workers, nworkers;
+
+/* sessions that ended or want reads resumed; drained by the I/O thread */
+static pthread_mutex_t notify_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct conn *notify_head;
+static int kick_fd = -1;
+
+/* hot upgrade state; freezing is read without a lock by the loops */
+static pthread_mutex_t freeze_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t freeze_cond = PTHREAD_COND_INITIALIZER;
+static int freezing, io_parked;
+static int active_steps;            /* workers in session_step, not waiting for input */
+static struct conn *all_conns;      /* I/O thread, or anyone while it is parked */
+static int reads_stopped, sends_stopped;    /* I/O thread, during a freeze */
+
+/* connections with an output queue, for netio_send() from any thread. A
+ * connection is listed until conn_free(), so its descriptor cannot be
+ * reused while a producer can still find it. */
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct conn *out_conns[MAX_CLIENTS];
+
+/* the session a worker is stepping, for netio_send() */
+static __thread struct conn *stepping;
+
+static const char *backend_names[] = { "threads", "epoll", "uring" };
+
+int netio_parse(const char *name) {
+    for (int i = 0; i < 3; i++) {
+        if (strcasecmp(name, backend_names[i]) == 0) {
+            config.io_backend = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const char *netio_name(void) {
+    return backend_names[backend];
+}
+
+int netio_evented(void) {
+    return backend != IO_THREADS;
+}
+
+/* ---- workers ---- */
+
+static void *worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&run_lock);
+    for (;;) {
+        while (!run_head) {
+            idle_workers++;
+            pthread_cond_wait(&run_cond, &run_lock);
+            idle_workers--;
+        }
+        struct conn *conn = run_head;
+        run_head = conn->io.run_next;
+        if (!run_head) run_tail = NULL;
+        nqueued--;
+        __atomic_add_fetch(&active_steps, 1, __ATOMIC_ACQ_REL);
+        pthread_mutex_unlock(&run_lock);
+
+        stepping = conn;
+        session_step(conn);
+        stepping = NULL;
+
+        pthread_mutex_lock(&run_lock);
+        __atomic_sub_fetch(&active_steps, 1, __ATOMIC_ACQ_REL);
+    }
+    return NULL;
+}
+
+static void schedule(struct conn *conn) {
+    pthread_mutex_lock(&run_lock);
+    conn->io.run_next = NULL;
+    if (run_tail) run_tail->io.run_next = conn;
+    else run_head = conn;
+    run_tail = conn;
+    nqueued++;
+    if (idle_workers >= nqueued) {
+        pthread_cond_signal(&run_cond);
+    } else {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker, NULL) == 0) {
+            pthread_detach(tid);
+            nworkers++;
+        } else if (nworkers == 0) {
+            die("pthread_create");
+        }
+    }
+    pthread_mutex_unlock(&run_lock);
+}
+
+/* ---- input queue ---- */
+
+/* I/O thread: appends `n` bytes (and/or end of input) for the session and
+ * gets it running. Returns 1 when reads should pause. */
+static int deliver(struct conn *conn, const char *data, size_t n, int eof) {
+    netio_conn_t *io = &conn->io;
+    int run = 0, pause = 0;
+    pthread_mutex_lock(&io->lock);
+    if (io->done) {
+        pthread_mutex_unlock(&io->lock);
+        return 0;
+    }
+    if (n) {
+        if (io->len + n > io->cap) {
+            if (io->off) {
+                memmove(io->buf, io->buf + io->off, io->len - io->off);
+                io->len -= io->off;
+                io->off = 0;
+            }
+            if (io->len + n > io->cap) {
+                size_t cap = io->cap ? io->cap : BUF_SIZE;
+                while (cap < io->len + n) cap *= 2;
+                char *p = realloc(io->buf, cap);
+                if (!p) die("realloc");
+                io->buf = p;
+                io->cap = cap;
+            }
+        }
+        memcpy(io->buf + io->len, data, n);
+        io->len += n;
+        if (io->len - io->off >= NETIO_MAX_QUEUED && !io->paused)
+            pause = io->paused = 1;
+    }
+    if (eof) io->eof = 1;
+    if (io->waiting) pthread_cond_signal(&io->cond);
+    else if (!io->scheduled) run = io->scheduled = 1;
+    pthread_mutex_unlock(&io->lock);
+    if (run) schedule(conn);
+    return pause;
+}
+
+static void kick(void) {
+    uint64_t one = 1;
+    if (write(kick_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        log_info("netio: kick failed: %s", strerror(errno));
+}
+
+/* only the first entry wakes the I/O thread: it drains the whole list
+ * after consuming the wakeup */
+static void notify(struct conn *conn) {
+    int wake = 0;
+    pthread_mutex_lock(&notify_lock);
+    if (!conn->io.notify_queued) {
+        wake = !notify_head;
+        conn->io.notify_queued = 1;
+        conn->io.notify_next = notify_head;
+        notify_head = conn;
+    }
+    pthread_mutex_unlock(&notify_lock);
+    if (wake) kick();
+}
+
+/* the session's recv(): blocks until input or end of input */
+ssize_t netio_read(struct conn *conn, void *buf, size_t len) {
+    netio_conn_t *io = &conn->io;
+    int resume = 0;
+    pthread_mutex_lock(&io->lock);
+    while (io->off == io->len && !io->eof) {
+        io->waiting = 1;
+        __atomic_sub_fetch(&active_steps, 1, __ATOMIC_ACQ_REL);
+        pthread_cond_wait(&io->cond, &io->lock);
+        __atomic_add_fetch(&active_steps, 1, __ATOMIC_ACQ_REL);
+        io->waiting = 0;
+    }
+    size_t n = io->len - io->off;
+    if (n > len) n = len;
+    memcpy(buf, io->buf + io->off, n);
+    io->off += n;
+    if (io->off == io->len) io->off = io->len = 0;
+    if (io->paused && io->len - io->off < NETIO_MAX_QUEUED / 2) {
+        io->paused = 0;
+        resume = 1;
+    }
+    pthread_mutex_unlock(&io->lock);
+    if (resume) notify(conn);
+    return (ssize_t)n;
+}
+
+/* Called by the worker between inputs: with nothing left to read, or
+ * during a freeze, the session goes back to waiting for the I/O thread
+ * (returns 1). */
+int netio_park(struct conn *conn) {
+    netio_conn_t *io = &conn->io;
+    pthread_mutex_lock(&io->lock);
+    int park = (io->off == io->len && !io->eof) ||
+               __atomic_load_n(&freezing, __ATOMIC_ACQUIRE);
+    if (park) io->scheduled = 0;
+    pthread_mutex_unlock(&io->lock);
+    return park;
+}
+
+/* the session is over: stop its reads and let the I/O thread send what
+ * is still queued and free it */
+void netio_release(struct conn *conn) {
+    netio_conn_t *io = &conn->io;
+    pthread_mutex_lock(&io->lock);
+    io->done = 1;
+    int queued = io->flushing && !io->out_failed;
+    pthread_mutex_unlock(&io->lock);
+    shutdown(conn->sock, queued ? SHUT_RD : SHUT_RDWR);
+    notify(conn);
+}
+
+/* ---- output queue ---- */
+
+/* returns the connection on `sock` with its lock held, or NULL */
+static struct conn *conn_lookup(int sock) {
+    struct conn *c = NULL;
+    pthread_mutex_lock(&out_lock);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (out_conns[i] && out_conns[i]->sock == sock) {
+            c = out_conns[i];
+            pthread_mutex_lock(&c->io.lock);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&out_lock);
+    return c;
+}
+
+/* under io->lock: output is dropped from now on; the caller shuts the
+ * socket down so the session ends and any send in flight fails */
+static void output_drop(netio_conn_t *io) {
+    io->out_failed = 1;
+    io->out_len = io->out_queued = 0;
+    if (io->out_waiting) pthread_cond_broadcast(&io->out_cond);
+}
+
+/* Queues `alen` bytes of `a` and then `blen` bytes of `b` (a frame header
+ * and its payload stay together) for the I/O thread to send. Returns 0
+ * when `sock` is not an event backend connection, so the caller writes it
+ * itself, 1 once queued, and -1 if the connection has ended or its output
+ * failed. The session stepping on this connection waits while its queue
+ * is over NETIO_MAX_OUTPUT; any other sender finding it over the limit
+ * drops the connection instead of waiting for its reader. */
+int netio_send(int sock, const void *a, size_t alen, const void *b, size_t blen) {
+    if (backend == IO_THREADS) return 0;
+    struct conn *conn = conn_lookup(sock);
+    if (!conn) return 0;
+    netio_conn_t *io = &conn->io;
+    size_t n = alen + blen;
+
+    if (io->done || io->out_failed) {
+        pthread_mutex_unlock(&io->lock);
+        return -1;
+    }
+    if (conn != stepping && io->out_queued + n > NETIO_MAX_OUTPUT) {
+        output_drop(io);
+        pthread_mutex_unlock(&io->lock);
+        log_info("Output queue full, dropping client (sock=%d)", sock);
+        shutdown(sock, SHUT_RDWR);
+        return -1;
+    }
+    if (io->out_len + n > io->out_cap) {
+        size_t cap = io->out_cap ? io->out_cap : BUF_SIZE;
+        while (cap < io->out_len + n) cap *= 2;
+        char *p = realloc(io->out, cap);
+        if (!p) die("realloc");
+        io->out = p;
+        io->out_cap = cap;
+    }
+    memcpy(io->out + io->out_len, a, alen);
+    if (blen) memcpy(io->out + io->out_len + alen, b, blen);
+    io->out_len += n;
+    io->out_queued += n;
+    if (!io->flushing && !io->direct) {
+        io->flushing = 1;
+        notify(conn);
+    }
+    if (conn == stepping) {
+        io->out_waiting++;
+        while (io->out_queued > NETIO_MAX_OUTPUT && !io->out_failed)
+            pthread_cond_wait(&io->out_cond, &io->lock);
+        io->out_waiting--;
+    }
+    int rc = io->out_failed ? -1 : 1;
+    pthread_mutex_unlock(&io->lock);
+    return rc;
+}
+
+/* For a writer that must use the socket itself (sendfile): waits until
+ * everything queued is sent and keeps the I/O thread off the socket until
+ * netio_direct_end(). Returns 0 when `sock` is not an event backend
+ * connection, 1 when the caller may write, -1 if the output failed. */
+int netio_direct_begin(int sock) {
+    if (backend == IO_THREADS) return 0;
+    struct conn *conn = conn_lookup(sock);
+    if (!conn) return 0;
+    netio_conn_t *io = &conn->io;
+    io->out_waiting++;
+    while (io->flushing && !io->out_failed)
+        pthread_cond_wait(&io->out_cond, &io->lock);
+    io->out_waiting--;
+    int rc = io->out_failed || io->done ? -1 : 1;
+    if (rc > 0) io->direct = 1;
+    pthread_mutex_unlock(&io->lock);
+    return rc;
+}
+
+/* lines queued meanwhile go out now */
+void netio_direct_end(int sock) {
+    struct conn *conn = conn_lookup(sock);
+    if (!conn) return;
+    netio_conn_t *io = &conn->io;
+    io->direct = 0;
+    if (io->out_len && !io->flushing && !io->out_failed) {
+        io->flushing = 1;
+        notify(conn);
+    }
+    pthread_mutex_unlock(&io->lock);
+}
+
+/* timer thread: the reader took nothing for --write-timeout */
+static void output_stalled(void *arg) {
+    struct conn *conn = arg;
+    log_info("Write timeout, dropping client (sock=%d)", conn->sock);
+    shutdown(conn->sock, SHUT_RDWR);
+}
+
+static void stall_arm(struct conn *conn) {
+    if (config.write_timeout <= 0) return;
+    timer_arm(&conn->io.stall, (unsigned long)config.write_timeout * 1000);
+    conn->io.stalling = 1;
+}
+
+static void stall_clear(struct conn *conn) {
+    if (!conn->io.stalling) return;
+    timer_cancel(&conn->io.stall);
+    conn->io.stalling = 0;
+}
+
+/* I/O thread: once the taken output is sent, takes everything queued
+ * since. Returns 0 when there is nothing left to send. */
+static int take_output(struct conn *conn) {
+    netio_conn_t *io = &conn->io;
+    pthread_mutex_lock(&io->lock);
+    if (io->out_failed) {
+        io->send_off = io->send_len = 0;
+        io->flushing = 0;
+    } else if (io->send_off == io->send_len) {
+        io->send_off = io->send_len = 0;
+        if (io->out_len) {
+            char *p = io->sending;
+            size_t cap = io->send_cap;
+            io->sending = io->out;
+            io->send_cap = io->out_cap;
+            io->send_len = io->out_len;
+            io->out = p;
+            io->out_cap = cap;
+            io->out_len = 0;
+        } else {
+            io->flushing = 0;
+            if (io->out_waiting) pthread_cond_broadcast(&io->out_cond);
+        }
+    }
+    int more = io->send_off < io->send_len;
+    pthread_mutex_unlock(&io->lock);
+    return more;
+}
+
+static void output_sent(struct conn *conn, size_t n) {
+    netio_conn_t *io = &conn->io;
+    io->send_off += n;
+    pthread_mutex_lock(&io->lock);
+    io->out_queued -= n;
+    if (io->out_waiting) pthread_cond_broadcast(&io->out_cond);
+    pthread_mutex_unlock(&io->lock);
+}
+
+/* I/O thread: the socket failed or stalled; the session sees end of input */
+static void output_failed(struct conn *conn) {
+    netio_conn_t *io = &conn->io;
+    pthread_mutex_lock(&io->lock);
+    output_drop(io);
+    io->flushing = 0;
+    pthread_mutex_unlock(&io->lock);
+    io->send_off = io->send_len = 0;
+    stall_clear(conn);
+    shutdown(conn->sock, SHUT_RDWR);
+}
+
+/* I/O thread: an ended connection can go once nothing is read or sent */
+static int conn_reapable(struct conn *conn) {
+    netio_conn_t *io = &conn->io;
+    if (io->armed || io->send_inflight) return 0;
+    pthread_mutex_lock(&io->lock);
+    int idle = !io->flushing || io->out_failed;
+    pthread_mutex_unlock(&io->lock);
+    return idle;
+}
+
+static void epoll_update_events(struct conn *conn, unsigned events);
+
+static void conn_free(struct conn *conn) {
+    netio_conn_t *io = &conn->io;
+    pthread_mutex_lock(&out_lock);
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        if (out_conns[i] == conn) out_conns[i] = NULL;
+    pthread_mutex_unlock(&out_lock);
+    /* a producer that found it before has let go once its lock is free */
+    pthread_mutex_lock(&io->lock);
+    pthread_mutex_unlock(&io->lock);
+    stall_clear(conn);
+    if (io->events) epoll_update_events(conn, 0);
+
+    if (io->all_prev) io->all_prev->io.all_next = io->all_next;
+    else all_conns = io->all_next;
+    if (io->all_next) io->all_next->io.all_prev = io->all_prev;
+    free(io->buf);
+    free(io->out);
+    free(io->sending);
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->cond);
+    pthread_cond_destroy(&io->out_cond);
+    session_free(conn);
+}
+
+/* one connection off the notify list, NULL when it is empty */
+static struct conn *next_notified(void) {
+    pthread_mutex_lock(&notify_lock);
+    struct conn *c = notify_head;
+    if (c) {
+        notify_head = c->io.notify_next;
+        c->io.notify_queued = 0;
+    }
+    pthread_mutex_unlock(&notify_lock);
+    return c;
+}
+
+static int conn_done(struct conn *conn) {
+    pthread_mutex_lock(&conn->io.lock);
+    int done = conn->io.done;
+    pthread_mutex_unlock(&conn->io.lock);
+    return done;
+}
+
+static int conn_paused(struct conn *conn) {
+    pthread_mutex_lock(&conn->io.lock);
+    int paused = conn->io.paused || conn->io.eof || conn->io.done;
+    pthread_mutex_unlock(&conn->io.lock);
+    return paused;
+}
+
+/* ---- hot upgrade ---- */
+
+static int workers_idle(void) {
+    pthread_mutex_lock(&run_lock);
+    int idle = nqueued == 0 && __atomic_load_n(&active_steps, __ATOMIC_ACQUIRE) == 0;
+    pthread_mutex_unlock(&run_lock);
+    return idle;
+}
+
+/* I/O thread: stops until netio_thaw(), then gets sessions that parked
+ * with input queued running again */
+static void io_park(void) {
+    pthread_mutex_lock(&freeze_lock);
+    io_parked = 1;
+    pthread_cond_broadcast(&freeze_cond);
+    while (freezing) pthread_cond_wait(&freeze_cond, &freeze_lock);
+    io_parked = 0;
+    pthread_mutex_unlock(&freeze_lock);
+
+    for (struct conn *c = all_conns; c; c = c->io.all_next) {
+        netio_conn_t *io = &c->io;
+        pthread_mutex_lock(&io->lock);
+        int run = !io->done && !io->scheduled && (io->off < io->len || io->eof);
+        if (run) io->scheduled = 1;
+        pthread_mutex_unlock(&io->lock);
+        if (run) schedule(c);
+    }
+}
+
+/* Stops all reading for a hot upgrade and waits up to timeout_ms for
+ * every worker to finish its current input and the I/O thread to stop
+ * sending and park. Returns 0 on timeout, still frozen; the caller thaws. */
+int netio_freeze(int timeout_ms) {
+    pthread_mutex_lock(&freeze_lock);
+    __atomic_store_n(&freezing, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&freeze_lock);
+
+    /* workers block on several locks; poll rather than signal from each,
+     * and wake the I/O thread to look again */
+    for (int waited = 0;; waited++) {
+        pthread_mutex_lock(&freeze_lock);
+        int parked = io_parked;
+        pthread_mutex_unlock(&freeze_lock);
+        if (parked && workers_idle()) return 1;
+        if (waited >= timeout_ms) return 0;
+        kick();
+        usleep(1000);
+    }
+}
+
+void netio_thaw(void) {
+    pthread_mutex_lock(&freeze_lock);
+    __atomic_store_n(&freezing, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&freeze_cond);
+    pthread_mutex_unlock(&freeze_lock);
+    kick();
+}
+
+/* while frozen: the input queued for `sock` that no session has read */
+size_t netio_pending(int sock, const char **data) {
+    for (struct conn *c = all_conns; c; c = c->io.all_next) {
+        netio_conn_t *io = &c->io;
+        if (c->sock != sock || io->done) continue;
+        pthread_mutex_lock(&io->lock);
+        size_t n = io->len - io->off;
+        *data = io->buf + io->off;
+        pthread_mutex_unlock(&io->lock);
+        return n;
+    }
+    return 0;
+}
+
+/* while frozen: appends the output queued for `sock` that is not sent */
+void netio_pending_output(int sock, strbuf_t *sb) {
+    for (struct conn *c = all_conns; c; c = c->io.all_next) {
+        netio_conn_t *io = &c->io;
+        if (c->sock != sock || io->done) continue;
+        pthread_mutex_lock(&io->lock);
+        if (!io->out_failed) {
+            if (io->send_off < io->send_len)
+                sb_append(sb, io->sending + io->send_off, io->send_len - io->send_off);
+            if (io->out_len) sb_append(sb, io->out, io->out_len);
+        }
+        pthread_mutex_unlock(&io->lock);
+        return;
+    }
+}
+
+/* ---- epoll ---- */
+
+static int epfd = -1;
+static int listen_tag, kick_tag;
+
+/* registers the socket for `events`, adding or removing it as needed */
+static void epoll_update_events(struct conn *conn, unsigned events) {
+    netio_conn_t *io = &conn->io;
+    if (events == io->events) return;
+    struct epoll_event ev = { .events = events, .data.ptr = conn };
+    int op = !io->events ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    if (epoll_ctl(epfd, op, conn->sock, &ev) == 0 || op == EPOLL_CTL_DEL) io->events = events;
+}
+
+static void epoll_arm(struct conn *conn) {
+    epoll_update_events(conn, conn->io.events | EPOLLIN | EPOLLRDHUP);
+    if (conn->io.events & EPOLLIN) conn->io.armed = 1;
+    else deliver(conn, NULL, 0, 1);
+}
+
+static void epoll_disarm(struct conn *conn) {
+    epoll_update_events(conn, conn->io.events & ~(unsigned)(EPOLLIN | EPOLLRDHUP));
+    conn->io.armed = 0;
+}
+
+static void epoll_read(struct conn *conn) {
+    char buf[16384];
+    ssize_t n = recv(conn->sock, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (n <= 0) {
+        epoll_disarm(conn);
+        deliver(conn, NULL, 0, 1);
+        return;
+    }
+    if (deliver(conn, buf, (size_t)n, 0)) epoll_disarm(conn);
+}
+
+/* sends until the queue is empty or the socket is full; a full socket
+ * waits for EPOLLOUT */
+static void epoll_flush(struct conn *conn) {
+    netio_conn_t *io = &conn->io;
+    if (sends_stopped) return;
+    int progress = 0;
+    while (take_output(conn)) {
+        ssize_t n = send(conn->sock, io->sending + io->send_off, io->send_len - io->send_off,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            output_sent(conn, (size_t)n);
+            progress = 1;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            epoll_update_events(conn, io->events | EPOLLOUT);
+            if (io->events & EPOLLOUT) {
+                if (progress || !io->stalling) stall_arm(conn);
+                return;
+            }
+        }
+        output_failed(conn);
+        break;
+    }
+    epoll_update_events(conn, io->events & ~(unsigned)EPOLLOUT);
+    stall_clear(conn);
+}
+
+static void epoll_notified(void) {
+    struct conn *c;
+    while ((c = next_notified()) != NULL) {
+        if (conn_done(c)) {
+            if (c->io.armed) epoll_disarm(c);
+            epoll_flush(c);
+            if (conn_reapable(c)) conn_free(c);
+            continue;
+        }
+        if (!c->io.armed && !conn_paused(c) && !freezing) epoll_arm(c);
+        epoll_flush(c);
+    }
+}
+
+/* ---- io_uring ---- */
+
+/* user_data of the other requests; receives carry their conn and sends
+ * their conn | UD_SEND */
+#define UD_ACCEPT 1
+#define UD_KICK 2
+#define UD_CANCEL 3
+#define UD_SEND 1
+#define BGID 0
+
+static struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned pending;
+    struct io_uring_buf_ring *br;
+    unsigned short br_tail;
+    char *bufs;
+    uint64_t kick_val;
+} ring = { .fd = -1 };
+
+static int uring_enter(unsigned submit, unsigned wait) {
+    return (int)syscall(__NR_io_uring_enter, ring.fd, submit, wait,
+                        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static struct io_uring_sqe *sqe_get(void) {
+    unsigned tail = *ring.sq_tail;
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.entries) {
+        uring_enter(ring.pending, 0);
+        ring.pending = 0;
+    }
+    unsigned idx = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.pending++;
+    return sqe;
+}
+
+static void buf_recycle(unsigned short bid) {
+    struct io_uring_buf *b = &ring.br->bufs[ring.br_tail & (NETIO_URING_BUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(ring.bufs + (size_t)bid * NETIO_URING_BUF_SIZE);
+    b->len = NETIO_URING_BUF_SIZE;
+    b->bid = bid;
+    ring.br_tail++;
+    __atomic_store_n(&ring.br->tail, ring.br_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_setup(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, NETIO_URING_ENTRIES, &p);
+    if (fd < 0) {
+        log_info("io_uring unavailable (%s)", strerror(errno));
+        return 0;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        log_info("io_uring too old (no single mmap)");
+        close(fd);
+        return 0;
+    }
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    char *sq = mmap(NULL, ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || sqes == MAP_FAILED) {
+        log_info("io_uring mmap failed (%s)", strerror(errno));
+        close(fd);
+        return 0;
+    }
+    ring.fd = fd;
+    ring.entries = p.sq_entries;
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.sqes = sqes;
+    ring.cq_head = (unsigned *)(sq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(sq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(sq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+
+    /* receive buffers the kernel picks from, so an idle connection holds
+     * none; needs Linux 5.19, multishot receive 6.0 */
+    size_t br_sz = NETIO_URING_BUFS * sizeof(struct io_uring_buf);
+    ring.br = mmap(NULL, br_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring.bufs = malloc((size_t)NETIO_URING_BUFS * NETIO_URING_BUF_SIZE);
+    if (ring.br == MAP_FAILED || !ring.bufs) die("netio buffers");
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring.br;
+    reg.ring_entries = NETIO_URING_BUFS;
+    reg.bgid = BGID;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        log_info("io_uring buffer ring unavailable (%s)", strerror(errno));
+        munmap(ring.br, br_sz);
+        free(ring.bufs);
+        close(fd);
+        ring.fd = -1;
+        return 0;
+    }
+    for (unsigned short i = 0; i < NETIO_URING_BUFS; i++) buf_recycle(i);
+    return 1;
+}
+
+static void uring_accept(int listen_fd) {
+    struct io_uring_sqe *sqe = sqe_get();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = UD_ACCEPT;
+}
+
+static void uring_kick(void) {
+    struct io_uring_sqe *sqe = sqe_get();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = kick_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&ring.kick_val;
+    sqe->len = sizeof(ring.kick_val);
+    sqe->user_data = UD_KICK;
+}
+
+static void uring_arm(struct conn *conn) {
+    struct io_uring_sqe *sqe = sqe_get();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID;
+    sqe->user_data = (uint64_t)(uintptr_t)conn;
+    conn->io.armed = 1;
+}
+
+/* stops a paused connection's receive; its last completion disarms it */
+static void uring_cancel(struct conn *conn) {
+    struct io_uring_sqe *sqe = sqe_get();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)conn;
+    sqe->user_data = UD_CANCEL;
+}
+
+/* Everything queued goes out in one send. It is only prepared here: the
+ * sends of every connection flushed in one pass of the loop are submitted
+ * together by its next io_uring_enter(). */
+static void uring_flush(struct conn *conn) {
+    netio_conn_t *io = &conn->io;
+    if (io->send_inflight || sends_stopped) return;
+    if (!take_output(conn)) {
+        stall_clear(conn);
+        return;
+    }
+    struct io_uring_sqe *sqe = sqe_get();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->sock;
+    sqe->addr = (uint64_t)(uintptr_t)(io->sending + io->send_off);
+    sqe->len = (unsigned)(io->send_len - io->send_off);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | UD_SEND;
+    io->send_inflight = 1;
+    /* every send follows progress, or starts from an empty queue */
+    stall_arm(conn);
+}
+
+static void uring_send_done(struct conn *conn, int res) {
+    conn->io.send_inflight = 0;
+    if (res > 0) output_sent(conn, (size_t)res);
+    else if (res != -ECANCELED) output_failed(conn);
+    uring_flush(conn);
+    if (conn->io.closing && conn_reapable(conn)) conn_free(conn);
+}
+
+static void uring_recv_done(struct conn *conn, int res, unsigned flags) {
+    int pause = 0;
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+        unsigned short bid = (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT);
+        pause = deliver(conn, ring.bufs + (size_t)bid * NETIO_URING_BUF_SIZE, (size_t)res, 0);
+        buf_recycle(bid);
+    } else if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+        deliver(conn, NULL, 0, 1);
+    }
+    if (flags & IORING_CQE_F_MORE) {
+        if (pause) uring_cancel(conn);
+        return;
+    }
+    /* the multishot receive ended: free, re-arm, or stay paused */
+    conn->io.armed = 0;
+    if (conn->io.closing) {
+        if (conn_reapable(conn)) conn_free(conn);
+    } else if (!conn_paused(conn) && !freezing) {
+        uring_arm(conn);
+    }
+}
+
+static void uring_notified(void) {
+    struct conn *c;
+    while ((c = next_notified()) != NULL) {
+        if (conn_done(c)) {
+            /* an armed receive ends on the shutdown; free it once that
+             * and the last send are done */
+            c->io.closing = 1;
+            uring_flush(c);
+            if (conn_reapable(c)) conn_free(c);
+            continue;
+        }
+        if (!c->io.armed && !conn_paused(c) && !freezing) uring_arm(c);
+        uring_flush(c);
+    }
+}
+
+/* ---- setup and loop ---- */
+
+void netio_init(void) {
+    backend = config.io_backend;
+    if (backend == IO_THREADS) {
+        log_info("Network I/O: %s", netio_name());
+        return;
+    }
+    kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (kick_fd < 0) die("eventfd");
+    if (backend == IO_URING && !uring_setup()) {
+        log_info("Falling back to epoll.");
+        backend = IO_EPOLL;
+    }
+    if (backend == IO_EPOLL) {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) die("epoll_create1");
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &kick_tag };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, kick_fd, &ev) < 0) die("epoll_ctl");
+    }
+    config.io_backend = backend;
+    log_info("Network I/O: %s", netio_name());
+}
+
+/* takes over a new or handed-over session; netio_start() then runs its
+ * first step (login or the resume greeting) on a worker */
+void netio_attach(struct conn *conn) {
+    netio_conn_t *io = &conn->io;
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->cond, NULL);
+    pthread_cond_init(&io->out_cond, NULL);
+    timer_init(&io->stall, output_stalled, conn);
+    io->scheduled = 1;
+    /* input and output carried over from the previous process in a hot
+     * upgrade; that output goes out before anything sent here */
+    if (conn->carry) {
+        io->buf = conn->carry;
+        io->len = io->cap = conn->carry_len;
+        conn->carry = NULL;
+    }
+    if (conn->carry_out) {
+        io->out = conn->carry_out;
+        io->out_len = io->out_cap = io->out_queued = conn->carry_out_len;
+        conn->carry_out = NULL;
+        io->flushing = 1;
+        notify(conn);
+    }
+    pthread_mutex_lock(&out_lock);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (!out_conns[i]) {
+            out_conns[i] = conn;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&out_lock);
+    io->all_next = all_conns;
+    if (all_conns) all_conns->io.all_prev = conn;
+    all_conns = conn;
+    if (backend == IO_URING) uring_arm(conn);
+    else epoll_arm(conn);
+}
+
+void netio_start(struct conn *conn) {
+    schedule(conn);
+}
+
+/* accept() as in the threads loop: refuse at capacity, else start a session */
+static void accepted(int sock) {
+    if (!session_room_for(sock)) return;
+    log_info("New connection accepted (sock=%d)", sock);
+    if (!start_client_thread(sock)) close(sock);
+}
+
+static void epoll_loop(int listen_fd) {
+    int fl = fcntl(listen_fd, F_GETFL);
+    fcntl(listen_fd, F_SETFL, fl | O_NONBLOCK);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_tag };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) die("epoll_ctl");
+
+    struct epoll_event evs[64];
+    while (running) {
+        if (freezing && !reads_stopped) {
+            /* new input stays in the sockets for the next process */
+            epoll_ctl(epfd, EPOLL_CTL_DEL, listen_fd, NULL);
+            for (struct conn *c = all_conns; c; c = c->io.all_next)
+                if (c->io.armed) epoll_disarm(c);
+            reads_stopped = 1;
+        }
+        /* sends are synchronous here: parking stops them */
+        if (reads_stopped && (!freezing || workers_idle())) {
+            io_park();
+            reads_stopped = 0;
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) die("epoll_ctl");
+            for (struct conn *c = all_conns; c; c = c->io.all_next) {
+                if (!c->io.armed && !conn_paused(c)) epoll_arm(c);
+                epoll_flush(c);
+            }
+        }
+
+        int n = epoll_wait(epfd, evs, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die("epoll_wait");
+        }
+        for (int i = 0; i < n; i++) {
+            void *p = evs[i].data.ptr;
+            unsigned e = evs[i].events;
+            if (p == &listen_tag) {
+                int sock;
+                while ((sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+                    accepted(sock);
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("accept");
+            } else if (p == &kick_tag) {
+                uint64_t v;
+                if (read(kick_fd, &v, sizeof(v)) < 0 && errno != EAGAIN) perror("read");
+            } else {
+                struct conn *c = p;
+                if ((c->io.events & EPOLLOUT) && (e & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                    epoll_flush(c);
+                    if (conn_done(c)) notify(c);
+                }
+                if (c->io.armed && (e & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)))
+                    epoll_read(c);
+            }
+        }
+        /* after the batch: it may still hold events for what this frees */
+        epoll_notified();
+    }
+}
+
+/* for a freeze: ends the accept and every receive */
+static void uring_quiesce(void) {
+    struct io_uring_sqe *sqe = sqe_get();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = UD_ACCEPT;
+    sqe->user_data = UD_CANCEL;
+    for (struct conn *c = all_conns; c; c = c->io.all_next)
+        if (c->io.armed) uring_cancel(c);
+}
+
+/* then, with the workers idle, every send; a cancelled send keeps its
+ * output for the new process */
+static void uring_stop_sends(void) {
+    for (struct conn *c = all_conns; c; c = c->io.all_next) {
+        if (!c->io.send_inflight) continue;
+        struct io_uring_sqe *sqe = sqe_get();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uint64_t)(uintptr_t)c | UD_SEND;
+        sqe->user_data = UD_CANCEL;
+    }
+}
+
+static int uring_quiet(int accepting) {
+    if (accepting) return 0;
+    for (struct conn *c = all_conns; c; c = c->io.all_next)
+        if (c->io.armed || c->io.send_inflight) return 0;
+    return 1;
+}
+
+static void uring_loop(int listen_fd) {
+    int accepting = 1;
+    uring_accept(listen_fd);
+    uring_kick();
+    while (running) {
+        if (freezing && !reads_stopped) {
+            uring_quiesce();
+            reads_stopped = 1;
+        }
+        if (reads_stopped && freezing && !sends_stopped && workers_idle()) {
+            uring_stop_sends();
+            sends_stopped = 1;
+        }
+        if (reads_stopped && (!freezing || (sends_stopped && uring_quiet(accepting)))) {
+            io_park();
+            reads_stopped = sends_stopped = 0;
+            if (!accepting) {
+                accepting = 1;
+                uring_accept(listen_fd);
+            }
+            for (struct conn *c = all_conns; c; c = c->io.all_next) {
+                if (!c->io.armed && !c->io.closing && !conn_paused(c)) uring_arm(c);
+                uring_flush(c);
+            }
+            uring_notified();
+        }
+        int rc = uring_enter(ring.pending, 1);
+        if (rc < 0 && errno != EINTR && errno != EBUSY) die("io_uring_enter");
+        if (rc >= 0) ring.pending = 0;
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            uint64_t ud = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            if (ud == UD_ACCEPT) {
+                if (res >= 0) accepted(res);
+                else if (res != -EINTR && res != -ECANCELED) log_info("accept: %s", strerror(-res));
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    if (reads_stopped) accepting = 0;
+                    else uring_accept(listen_fd);
+                }
+            } else if (ud == UD_KICK) {
+                uring_notified();
+                uring_kick();
+            } else if (ud == UD_CANCEL) {
+                /* nothing to do: the cancelled request completes on its own */
+            } else if (ud & UD_SEND) {
+                uring_send_done((struct conn *)(uintptr_t)(ud & ~(uint64_t)UD_SEND), res);
+            } else {
+                uring_recv_done((struct conn *)(uintptr_t)ud, res, flags);
+            }
+            /* the completion must be consumed before its slot is reused */
+            __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/* the accept loop for the event backends; runs on the calling thread */
+void netio_run(int listen_fd) {
+    if (backend == IO_URING) uring_loop(listen_fd);
+    else epoll_loop(listen_fd);
+}
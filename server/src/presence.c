@@ -0,0 +1,177 @@
+#include "presence.h"
+#include "server.h"
+#include "clients.h"
+#include "utils.h"
+#include "logging.h"
+#include "federation.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Presence subscribers get one snapshot of who is online and afterwards
+ * only changes, as lines
+ *     PRESENCE = alice bob          (snapshot)
+ *     PRESENCE +carol -bob          (changes)
+ * Changes are collected by the session threads and sent by one presence
+ * thread after PRESENCE_COALESCE_MS, so a burst of logins costs every
+ * subscriber one line. Lock order: presence_send_lock, presence_lock,
+ * clients_lock. presence_send_lock only orders sends: a snapshot always
+ * reaches its subscriber before any change line does. */
+
+typedef struct {
+    char name[USERNAME_LEN];
+    int online;
+    unsigned epoch;             /* subscribe_epoch when it was queued */
+} presence_delta_t;
+
+static pthread_mutex_t presence_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t presence_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t presence_send_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned subscribe_epoch;
+static int subscribers[MAX_CLIENTS];
+static int nsubscribers;
+static presence_delta_t *pending;
+static int npending;
+static int pending_cap;
+
+/* a change that undoes a pending one cancels it instead of being queued,
+ * unless someone subscribed in between: that snapshot already reflects
+ * the pending change, so both halves must be sent */
+void presence_changed(const char *username, int online) {
+    pthread_mutex_lock(&presence_lock);
+    if (nsubscribers == 0) {
+        pthread_mutex_unlock(&presence_lock);
+        return;
+    }
+    for (int i = npending - 1; i >= 0; i--) {
+        if (strcmp(pending[i].name, username) != 0) continue;
+        if (pending[i].online != online && pending[i].epoch == subscribe_epoch) {
+            pending[i] = pending[--npending];
+            pthread_mutex_unlock(&presence_lock);
+            return;
+        }
+        break;
+    }
+    if (npending == pending_cap) {
+        int cap = pending_cap ? 2 * pending_cap : 2 * MAX_CLIENTS;
+        presence_delta_t *grown = realloc(pending, (size_t)cap * sizeof(*pending));
+        if (!grown) {
+            pthread_mutex_unlock(&presence_lock);
+            return;
+        }
+        pending = grown;
+        pending_cap = cap;
+    }
+    snprintf(pending[npending].name, USERNAME_LEN, "%s", username);
+    pending[npending].online = online;
+    pending[npending].epoch = subscribe_epoch;
+    npending++;
+    pthread_cond_signal(&presence_cond);
+    pthread_mutex_unlock(&presence_lock);
+}
+
+static void *presence_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&presence_lock);
+    for (;;) {
+        while (npending == 0)
+            pthread_cond_wait(&presence_cond, &presence_lock);
+
+        /* let more changes arrive before sending */
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += PRESENCE_COALESCE_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        while (pthread_cond_timedwait(&presence_cond, &presence_lock, &until) != ETIMEDOUT)
+            ;
+        if (npending == 0) continue;
+
+        strbuf_t line;
+        sb_init(&line);
+        sb_append(&line, "PRESENCE", 8);
+        for (int i = 0; i < npending; i++)
+            sb_appendf(&line, " %c%s", pending[i].online ? '+' : '-', pending[i].name);
+        sb_append(&line, "\n", 1);
+        npending = 0;
+
+        int socks[MAX_CLIENTS];
+        int n = nsubscribers;
+        memcpy(socks, subscribers, (size_t)n * sizeof(int));
+        pthread_mutex_unlock(&presence_lock);
+
+        pthread_mutex_lock(&presence_send_lock);
+        for (int i = 0; i < n; i++)
+            send_buf_to_sock(socks[i], line.data, line.len);
+        pthread_mutex_unlock(&presence_send_lock);
+        sb_free(&line);
+
+        pthread_mutex_lock(&presence_lock);
+    }
+    return NULL;
+}
+
+void presence_start(void) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, presence_thread, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    pthread_detach(tid);
+}
+
+/* Registers `sock` for changes and sends it the snapshot. The snapshot is
+ * built under presence_lock but sent after it is released, so a slow
+ * subscriber never holds up logins; presence_send_lock keeps change lines
+ * from overtaking it. A change already in the snapshot may also arrive as
+ * a delta, and applying it again is harmless. Returns 0 if already
+ * subscribed, -1 if there is no room. */
+int presence_subscribe(int sock) {
+    pthread_mutex_lock(&presence_send_lock);
+    pthread_mutex_lock(&presence_lock);
+    for (int i = 0; i < nsubscribers; i++) {
+        if (subscribers[i] == sock) {
+            pthread_mutex_unlock(&presence_lock);
+            pthread_mutex_unlock(&presence_send_lock);
+            return 0;
+        }
+    }
+    if (nsubscribers == MAX_CLIENTS) {
+        pthread_mutex_unlock(&presence_lock);
+        pthread_mutex_unlock(&presence_send_lock);
+        return -1;
+    }
+    subscribers[nsubscribers++] = sock;
+    subscribe_epoch++;
+
+    /* users on linked nodes are included */
+    char names[MAX_CLIENTS + MAX_PEERS * MAX_CLIENTS][USERNAME_LEN];
+    int n = get_online_users(names);
+    n += fed_remote_users(names + n, MAX_PEERS * MAX_CLIENTS);
+    strbuf_t line;
+    sb_init(&line);
+    sb_append(&line, "PRESENCE =", 10);
+    for (int i = 0; i < n; i++)
+        sb_appendf(&line, " %s", names[i]);
+    sb_append(&line, "\n", 1);
+    pthread_mutex_unlock(&presence_lock);
+
+    send_buf_to_sock(sock, line.data, line.len);
+    pthread_mutex_unlock(&presence_send_lock);
+    sb_free(&line);
+    return 1;
+}
+
+void presence_unsubscribe(int sock) {
+    pthread_mutex_lock(&presence_lock);
+    for (int i = 0; i < nsubscribers; i++) {
+        if (subscribers[i] == sock) {
+            subscribers[i] = subscribers[--nsubscribers];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&presence_lock);
+}
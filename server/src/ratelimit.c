@@ -0,0 +1,149 @@
+#include "ratelimit.h"
+#include "server.h"
+#include "clients.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+rl_limit_t rl_limits[RL_NCLASSES] = {
+    [RL_CHAT]  = { 5.0, 20.0 },
+    [RL_QUERY] = { 2.0, 10.0 },
+    [RL_OTHER] = { 10.0, 30.0 },
+};
+
+static const char *const class_names[RL_NCLASSES] = {
+    [RL_CHAT] = "chat", [RL_QUERY] = "query", [RL_OTHER] = "other",
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+const char *rl_class_name(rl_class_t c) {
+    return class_names[c];
+}
+
+/* "<class>=<rate>/<burst>", e.g. chat=5/20; returns 0 if malformed */
+int rl_parse(const char *spec) {
+    for (int c = 0; c < RL_NCLASSES; c++) {
+        size_t n = strlen(class_names[c]);
+        if (strncasecmp(spec, class_names[c], n) != 0 || spec[n] != '=') continue;
+        double rate, burst;
+        if (sscanf(spec + n + 1, "%lf/%lf", &rate, &burst) != 2 || rate < 0 || burst < 1)
+            return 0;
+        rl_limits[c].rate = rate;
+        rl_limits[c].burst = burst;
+        return 1;
+    }
+    return 0;
+}
+
+rl_class_t rl_class_of(const char *cmd) {
+    static const char *const queries[] = {
+        "getmessages", "search", "sync", "bigchat", "getbig", "deletemessages",
+        "chanhistory", "export", NULL
+    };
+    if (strcasecmp(cmd, "Chat") == 0 || strcasecmp(cmd, "post") == 0) return RL_CHAT;
+    for (int i = 0; queries[i]; i++)
+        if (strcasecmp(cmd, queries[i]) == 0) return RL_QUERY;
+    return RL_OTHER;
+}
+
+/* Buckets belong to the user, indexed directly by interned id (users.h),
+ * so reconnecting or opening a second session neither refills nor
+ * doubles the allowance. Grown on demand, guarded by rl_lock. */
+static pthread_mutex_t rl_lock = PTHREAD_MUTEX_INITIALIZER;
+static rl_bucket_t (*user_buckets)[RL_NCLASSES];
+static int user_buckets_cap;
+
+static rl_bucket_t *bucket_locked(int user_id, rl_class_t c) {
+    if (user_id >= user_buckets_cap) {
+        int cap = user_buckets_cap ? user_buckets_cap : 64;
+        while (cap <= user_id) cap *= 2;
+        void *grown = realloc(user_buckets, (size_t)cap * sizeof(*user_buckets));
+        if (!grown) return NULL;
+        user_buckets = grown;
+        memset(user_buckets + user_buckets_cap, 0,
+               (size_t)(cap - user_buckets_cap) * sizeof(*user_buckets));
+        user_buckets_cap = cap;
+    }
+    return &user_buckets[user_id][c];
+}
+
+/* Takes one of the user's tokens. Returns 0 if the command may run,
+ * otherwise the number of milliseconds until a token is available. */
+long rl_take(int user_id, rl_class_t c) {
+    const rl_limit_t *lim = &rl_limits[c];
+    if (lim->rate <= 0 || user_id <= 0) return 0;
+
+    pthread_mutex_lock(&rl_lock);
+    rl_bucket_t *b = bucket_locked(user_id, c);
+    if (!b) {
+        pthread_mutex_unlock(&rl_lock);
+        return 0;
+    }
+    double now = now_seconds();
+    if (b->last == 0) b->tokens = lim->burst;
+    else b->tokens += (now - b->last) * lim->rate;
+    if (b->tokens > lim->burst) b->tokens = lim->burst;
+    b->last = now;
+
+    long wait_ms = 0;
+    if (b->tokens >= 1.0) b->tokens -= 1.0;
+    else wait_ms = (long)((1.0 - b->tokens) / lim->rate * 1000.0) + 1;
+    pthread_mutex_unlock(&rl_lock);
+    return wait_ms;
+}
+
+/* ---- overload: moving average of the time spent waiting for db_lock ---- */
+
+static long long db_wait_avg_ns;     /* EWMA, weight 1/8 */
+static long long db_wait_stamp_ns;   /* when it was last updated */
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* updates are racy read-modify-writes; losing one sample is harmless */
+void overload_note_db_wait(long long ns) {
+    long long avg = __atomic_load_n(&db_wait_avg_ns, __ATOMIC_RELAXED);
+    avg += (ns - avg) / 8;
+    __atomic_store_n(&db_wait_avg_ns, avg, __ATOMIC_RELAXED);
+    __atomic_store_n(&db_wait_stamp_ns, now_ns(), __ATOMIC_RELAXED);
+}
+
+/* an average older than a second describes a queue that has since drained */
+int overload_active(void) {
+    if (config.overload_ms <= 0) return 0;
+    long long stamp = __atomic_load_n(&db_wait_stamp_ns, __ATOMIC_RELAXED);
+    if (now_ns() - stamp > 1000000000LL) return 0;
+    return __atomic_load_n(&db_wait_avg_ns, __ATOMIC_RELAXED) > config.overload_ms * 1000000LL;
+}
+
+/* ---- counters ---- */
+
+static unsigned long counters[STAT_NCOUNTERS];
+
+void stat_inc(stat_counter_t c) {
+    __atomic_fetch_add(&counters[c], 1, __ATOMIC_RELAXED);
+}
+
+void stats_send(int sock) {
+    char out[512];
+    snprintf(out, sizeof(out),
+             "STATS rate_limited=%lu shed=%lu refused=%lu db_wait_avg_us=%lld overload=%s\n",
+             __atomic_load_n(&counters[STAT_RATE_LIMITED], __ATOMIC_RELAXED),
+             __atomic_load_n(&counters[STAT_SHED], __ATOMIC_RELAXED),
+             __atomic_load_n(&counters[STAT_REFUSED], __ATOMIC_RELAXED),
+             __atomic_load_n(&db_wait_avg_ns, __ATOMIC_RELAXED) / 1000,
+             overload_active() ? "yes" : "no");
+    send_to_sock(sock, out);
+}
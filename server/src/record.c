@@ -0,0 +1,236 @@
+#include "record.h"
+#include "server.h"
+#include "users.h"
+#include "logging.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+static FILE *capture;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec started;
+static unsigned next_session;
+
+/* command words kept verbatim; anything else in first position is text */
+static const char *const commands[] = {
+    "Chat", "getmessages", "search", "sync", "bigchat", "getbig", "deletemessages",
+    "getuserlist", "Menu", "select", "open", "help", "exit", "compress", "stats",
+    "lockstats", "peers", "trace", "join", "leave", "post", "channels", "chanhistory",
+    "subscribe", "unsubscribe", "pong", "ack", "redeliver", "export", "backup",
+    "/open", "/menu", "/exit", "/help", "/users", NULL
+};
+
+/* protocol words that carry no user data and are kept verbatim */
+static const char *const keywords[] = {
+    "since", "until", "with", "limit", "page", "persist", "presence", "status",
+    "on", "off", "dump", "reset", "resume", "format", "text", "jsonl", NULL
+};
+
+/* What each argument of a command is, by position:
+ *   n  user name        becomes u<id>
+ *   c  channel          becomes #h<hash>
+ *   d  number or date   kept
+ *   w  keyword          kept if it is one
+ *   s  search text      x's, up to an option (with/limit/page)
+ *   b  message body     everything left becomes x's
+ *   *  repeat the two before (ack <user> <seq> ...)
+ * Arguments past the spec, and any token that does not fit its slot,
+ * become x's unless they are keywords; options (since/until/with/limit/
+ * page/format) give the next token its kind. */
+static const struct {
+    const char *cmd;
+    const char *args;
+} grammar[] = {
+    { "Chat", "nb" }, { "post", "cb" }, { "search", "s" }, { "getmessages", "n" },
+    { "deletemessages", "n" }, { "export", "n" }, { "select", "n" }, { "bigchat", "nd" },
+    { "getbig", "d" }, { "sync", "d" }, { "ack", "nd*" }, { "join", "c" }, { "leave", "c" },
+    { "chanhistory", "cd" }, { "lockstats", "d" }, { "trace", "wd" }, { NULL, NULL }
+};
+
+int record_open(const char *path) {
+    capture = fopen(path, "wb");
+    if (!capture) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    fwrite(REC_MAGIC, 1, 8, capture);
+    log_info("Recording traffic to %s", path);
+    return 1;
+}
+
+void record_close(void) {
+    pthread_mutex_lock(&record_lock);
+    if (capture) fclose(capture);
+    capture = NULL;
+    pthread_mutex_unlock(&record_lock);
+}
+
+static void put_le(unsigned char *p, unsigned long v, int n) {
+    for (int i = 0; i < n; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void write_record(int type, unsigned session, const char *data, size_t len) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long ms = (unsigned long)((now.tv_sec - started.tv_sec) * 1000 +
+                                       (now.tv_nsec - started.tv_nsec) / 1000000);
+    if (len > 0xffff) len = 0xffff;
+
+    unsigned char h[REC_HEADER_SIZE];
+    h[0] = (unsigned char)type;
+    put_le(h + 1, session, 4);
+    put_le(h + 5, ms, 4);
+    put_le(h + 9, len, 2);
+
+    pthread_mutex_lock(&record_lock);
+    if (capture) {
+        fwrite(h, 1, sizeof(h), capture);
+        if (len) fwrite(data, 1, len, capture);
+        /* a session's records reach the disk by the time it ends */
+        if (type == REC_CLOSE) fflush(capture);
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+static void put_x(size_t n, char *out, size_t out_size) {
+    if (n >= out_size) n = out_size - 1;
+    memset(out, 'x', n);
+    out[n] = '\0';
+}
+
+static int is_keyword(const char *tok, size_t n) {
+    for (int i = 0; keywords[i]; i++)
+        if (strlen(keywords[i]) == n && strncasecmp(tok, keywords[i], n) == 0) return 1;
+    return 0;
+}
+
+/* one structured argument of kind `kind` (see grammar), anonymized */
+static void anonymize_arg(char kind, const char *tok, size_t n, char *out, size_t out_size) {
+    if (is_keyword(tok, n)) {
+        snprintf(out, out_size, "%.*s", (int)n, tok);
+        return;
+    }
+    if (kind == 'n' && n < USERNAME_LEN) {
+        char word[USERNAME_LEN];
+        memcpy(word, tok, n);
+        word[n] = '\0';
+        int id = user_lookup(word);
+        if (id) {
+            snprintf(out, out_size, "u%d", id);
+            return;
+        }
+    }
+    /* a hash whether or not the channel exists yet, so join and post
+     * agree and no channel id is revealed */
+    if (kind == 'c' && n > 1 && tok[0] == '#') {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < n; i++) h = (h ^ (unsigned char)tok[i]) * 16777619u;
+        snprintf(out, out_size, "#h%u", h % 1000000u);
+        return;
+    }
+    if (kind == 'd') {
+        size_t digits = 0;
+        while (digits < n && (isdigit((unsigned char)tok[digits]) || tok[digits] == '-' ||
+                              tok[digits] == ':' || tok[digits] == 'T'))
+            digits++;
+        if (digits == n && isdigit((unsigned char)tok[0])) {
+            snprintf(out, out_size, "%.*s", (int)n, tok);
+            return;
+        }
+    }
+    put_x(n, out, out_size);
+}
+
+/* the kind of the token after an option word, 0 if `tok` is not one */
+static char option_kind(const char *tok, size_t n) {
+    static const struct { const char *word; char kind; } options[] = {
+        { "since", 'd' }, { "until", 'd' }, { "limit", 'd' }, { "page", 'd' },
+        { "with", 'n' }, { "format", 'w' }, { NULL, 0 }
+    };
+    for (int i = 0; options[i].word; i++)
+        if (strlen(options[i].word) == n && strncasecmp(tok, options[i].word, n) == 0) return options[i].kind;
+    return 0;
+}
+
+static const char *args_of(const char *cmd, size_t n) {
+    for (int i = 0; grammar[i].cmd; i++)
+        if (strlen(grammar[i].cmd) == n && strncasecmp(cmd, grammar[i].cmd, n) == 0) return grammar[i].args;
+    return "";
+}
+
+unsigned record_session_start(const char *username) {
+    if (!capture) return 0;
+    unsigned session = __atomic_add_fetch(&next_session, 1, __ATOMIC_RELAXED);
+    char line[64];
+    snprintf(line, sizeof(line), "login u%d", user_lookup(username));
+    write_record(REC_OPEN, session, line, strlen(line));
+    return session;
+}
+
+static int is_command(const char *tok, size_t n) {
+    for (int i = 0; commands[i]; i++)
+        if (strlen(commands[i]) == n && strncasecmp(tok, commands[i], n) == 0) return 1;
+    return 0;
+}
+
+/* Only the first line is kept; later bytes are bigchat payload. A known
+ * command word is kept and its arguments are anonymized by the grammar
+ * above: message bodies are always x's, numbers survive only where the
+ * command takes one. A line that is not a command, and every `free_text`
+ * line (closed-chat and menu messages), is all x's. */
+void record_command(unsigned session, const char *line, size_t len, int free_text) {
+    if (!capture || !session) return;
+    const char *nl = memchr(line, '\n', len);
+    if (nl) len = (size_t)(nl - line);
+    while (len && (line[len - 1] == '\r' || line[len - 1] == ' ')) len--;
+
+    char out[BUF_SIZE];
+    size_t o = 0;
+    size_t i = 0;
+    int word = 0;
+    const char *spec = NULL;    /* NULL: the line is text */
+    size_t arg = 0;
+    char next = 0;              /* kind forced by the option before */
+    int body = 0;
+    while (i < len && o < sizeof(out) - USERNAME_LEN - 2) {
+        if (line[i] == ' ') { out[o++] = line[i++]; continue; }
+        size_t start = i, n;
+        while (i < len && line[i] != ' ') i++;
+        n = i - start;
+        if (word++ == 0 && !free_text && is_command(line + start, n)) {
+            memcpy(out + o, line + start, n);
+            o += n;
+            spec = args_of(line + start, n);
+            continue;
+        }
+        char kind = 'x';
+        if (spec && !body) {
+            if (spec[arg] == '*' && arg >= 2) arg -= 2;
+            if (next) {
+                kind = next;
+                next = 0;
+            } else if (spec[arg] == 'b') {
+                body = 1;
+            } else if ((next = option_kind(line + start, n)) != 0) {
+                kind = 'w';
+            } else {
+                kind = spec[arg] ? spec[arg] : 'x';
+                /* search text runs until an option */
+                if (kind != 's' && spec[arg]) arg++;
+            }
+        }
+        if (!spec || body || kind == 's') {
+            put_x(n, out + o, sizeof(out) - o);
+        } else {
+            anonymize_arg(kind, line + start, n, out + o, sizeof(out) - o);
+        }
+        o += strlen(out + o);
+    }
+    write_record(REC_CMD, session, out, o);
+}
+
+void record_session_end(unsigned session) {
+    if (capture && session) write_record(REC_CLOSE, session, NULL, 0);
+}
@@ -0,0 +1,304 @@
+#include "shards.h"
+#include "server.h"
+#include "database.h"
+#include "logging.h"
+#include "ratelimit.h"
+#include "trace.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Sharded stores insert through one writer thread per shard. Callers queue
+ * a request and wait; the writer takes everything queued, commits it as one
+ * transaction and wakes them, so concurrent senders share a commit.
+ *
+ * Message ids stay unique and increasing across shards: they are handed out
+ * here and inserted explicitly. Because shards commit independently, a
+ * newer id can become visible before an older one. shard_id_watermark()
+ * is the highest id below every insert still in flight; reads that page by
+ * id stop there so they never skip a row that is about to appear. */
+
+struct shard_insert {
+    long long id;
+    int sender_id;
+    int receiver_id;
+    const char *text;
+    long long ts;
+    long long seq;              /* set by the writer */
+    int done;
+    int ok;
+    shard_insert_t *next;
+};
+
+shard_t shards[MAX_SHARDS];
+int nshards = 1;
+
+#define MAX_INFLIGHT 64
+static pthread_mutex_t id_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t id_cond = PTHREAD_COND_INITIALIZER;
+static long long last_id;
+static long long inflight[MAX_INFLIGHT];    /* 0 = free */
+static int ninflight;
+
+/* unsharded: shard 0 is `db` and the writes stay on the caller's thread */
+void shards_init_single(void) {
+    nshards = 1;
+    shards[0].db = db;
+    shards[0].lock = &db_lock;
+    shards[0].wdb = NULL;
+}
+
+static sqlite3 *open_or_die(const char *path) {
+    sqlite3 *d = NULL;
+    if (sqlite3_open(path, &d) != SQLITE_OK) {
+        fprintf(stderr, "Cannot open DB %s: %s\n", path, sqlite3_errmsg(d));
+        exit(1);
+    }
+    /* the query and writer connections share each file */
+    sqlite3_busy_timeout(d, 5000);
+    db_tune(d, 1);
+    return d;
+}
+
+static long long max_id(sqlite3 *d) {
+    long long id = 0;
+    sqlite3_stmt *stmt = NULL;
+    /* sqlite_sequence remembers ids of deleted rows too, so none is reused */
+    const char *sql =
+        "SELECT max(coalesce((SELECT seq FROM sqlite_sequence WHERE name = 'messages'), 0), "
+        "coalesce((SELECT max(id) FROM messages), 0));";
+    if (sqlite3_prepare_v2(d, sql, -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) id = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return id;
+}
+
+static void *shard_writer(void *arg);
+
+/* opens (creating if needed) shard-0.db .. shard-<n-1>.db in `dir`;
+ * `prepare` creates or migrates the message schema on each */
+void shards_open(const char *dir, int n, void (*prepare)(sqlite3 *d)) {
+    char path[4096];
+    nshards = n;
+    for (int i = 0; i < n; i++) {
+        shard_t *s = &shards[i];
+        snprintf(path, sizeof(path), "%s/shard-%d.db", dir, i);
+        s->db = open_or_die(path);
+        prepare(s->db);
+        s->wdb = open_or_die(path);
+        pthread_mutex_init(&s->own_lock, NULL);
+        s->lock = &s->own_lock;
+        pthread_mutex_init(&s->qlock, NULL);
+        pthread_cond_init(&s->qcond, NULL);
+        pthread_cond_init(&s->done_cond, NULL);
+
+        long long m = max_id(s->db);
+        if (m > last_id) last_id = m;
+
+        if (pthread_create(&s->writer, NULL, shard_writer, s) != 0) die("pthread_create");
+    }
+    log_info("Opened %d shard(s) in %s, next message id %lld.", n, dir, last_id + 1);
+}
+
+/* raises the next id past every id already in the shards. A --takeover
+ * process opens the shards while the old one is still storing, so it
+ * calls this once the old process has exited. */
+void shards_reseed(void) {
+    if (!shards[0].wdb) return;
+    long long top = 0;
+    for (int i = 0; i < nshards; i++) {
+        shard_t *s = &shards[i];
+        shard_lock(s);
+        long long m = max_id(s->db);
+        shard_unlock(s);
+        if (m > top) top = m;
+    }
+    pthread_mutex_lock(&id_lock);
+    if (top > last_id) {
+        log_info("Shards hold ids up to %lld, next message id %lld.", top, top + 1);
+        last_id = top;
+    }
+    pthread_mutex_unlock(&id_lock);
+}
+
+/* stops each writer once its queue is committed, then closes both
+ * connections; inserts queued after that fail */
+void shards_close(void) {
+    if (!shards[0].wdb) return;
+    for (int i = 0; i < nshards; i++) {
+        shard_t *s = &shards[i];
+        pthread_mutex_lock(&s->qlock);
+        s->stopping = 1;
+        pthread_cond_signal(&s->qcond);
+        pthread_mutex_unlock(&s->qlock);
+        pthread_join(s->writer, NULL);
+
+        shard_lock(s);
+        pthread_mutex_lock(&s->qlock);
+        if (s->db) sqlite3_close_v2(s->db);
+        if (s->wdb) sqlite3_close_v2(s->wdb);
+        s->db = s->wdb = NULL;
+        pthread_mutex_unlock(&s->qlock);
+        shard_unlock(s);
+    }
+}
+
+/* a conversation is keyed by its two ids in either order; a channel by
+ * its own id twice */
+int shard_of(int key_a, int key_b) {
+    if (nshards == 1) return 0;
+    uint64_t lo = (uint32_t)(key_a < key_b ? key_a : key_b);
+    uint64_t hi = (uint32_t)(key_a < key_b ? key_b : key_a);
+    uint64_t h = (lo << 32 | hi) * 0x9E3779B97F4A7C15ull;
+    return (int)((h >> 32) % (uint64_t)nshards);
+}
+
+unsigned long long shard_mask_all(void) {
+    return nshards >= 64 ? ~0ull : (1ull << nshards) - 1;
+}
+
+/* same accounting as db_lock: overload protection, lock profile, traces */
+void shard_lock_at(shard_t *s, lockprof_site_t *site) {
+    long long waited = lockprof_acquire(s->lock, site);
+    overload_note_db_wait(waited);
+    if (waited && trace_current)
+        trace_record("db_lock wait", trace_now_us() - waited / 1000, waited / 1000);
+}
+
+void shard_unlock(shard_t *s) {
+    lockprof_release(s->lock);
+}
+
+/* ---- message ids ---- */
+
+long long shard_id_begin(void) {
+    pthread_mutex_lock(&id_lock);
+    while (ninflight == MAX_INFLIGHT)
+        pthread_cond_wait(&id_cond, &id_lock);
+    long long id = ++last_id;
+    for (int i = 0; i < MAX_INFLIGHT; i++) {
+        if (!inflight[i]) {
+            inflight[i] = id;
+            break;
+        }
+    }
+    ninflight++;
+    pthread_mutex_unlock(&id_lock);
+    return id;
+}
+
+void shard_id_end(long long id) {
+    pthread_mutex_lock(&id_lock);
+    for (int i = 0; i < MAX_INFLIGHT; i++) {
+        if (inflight[i] == id) {
+            inflight[i] = 0;
+            ninflight--;
+            pthread_cond_signal(&id_cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&id_lock);
+}
+
+long long shard_id_watermark(void) {
+    if (nshards == 1 && !shards[0].wdb) return INT64_MAX;
+    pthread_mutex_lock(&id_lock);
+    long long mark = last_id;
+    for (int i = 0; i < MAX_INFLIGHT; i++)
+        if (inflight[i] && inflight[i] <= mark) mark = inflight[i] - 1;
+    pthread_mutex_unlock(&id_lock);
+    return mark;
+}
+
+/* ---- writer ---- */
+
+static void *shard_writer(void *arg) {
+    shard_t *s = arg;
+    pthread_mutex_lock(&s->qlock);
+    for (;;) {
+        while (!s->qhead && !s->stopping)
+            pthread_cond_wait(&s->qcond, &s->qlock);
+        if (!s->qhead) break;
+        shard_insert_t *batch = s->qhead;
+        s->qhead = s->qtail = NULL;
+        pthread_mutex_unlock(&s->qlock);
+
+        if (!s->insert_stmt) {
+            const char *sql =
+                "INSERT INTO messages (id, sender_id, receiver_id, content, timestamp, seq) "
+                "VALUES (?1, ?2, ?3, ?4, ?5, " MESSAGE_NEXT_SEQ("?2", "?3") ") RETURNING seq;";
+            if (sqlite3_prepare_v3(s->wdb, sql, -1, SQLITE_PREPARE_PERSISTENT, &s->insert_stmt, NULL) != SQLITE_OK) {
+                fprintf(stderr, "DB prepare error: %s\n", sqlite3_errmsg(s->wdb));
+                s->insert_stmt = NULL;
+            }
+        }
+
+        int committed = s->insert_stmt &&
+                        sqlite3_exec(s->wdb, "BEGIN IMMEDIATE;", NULL, NULL, NULL) == SQLITE_OK;
+        for (shard_insert_t *r = batch; committed && r; r = r->next) {
+            sqlite3_stmt *stmt = s->insert_stmt;
+            sqlite3_bind_int64(stmt, 1, r->id);
+            sqlite3_bind_int(stmt, 2, r->sender_id);
+            sqlite3_bind_int(stmt, 3, r->receiver_id);
+            sqlite3_bind_text(stmt, 4, r->text, -1, SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 5, r->ts);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                r->seq = sqlite3_column_int64(stmt, 0);
+                r->ok = sqlite3_step(stmt) == SQLITE_DONE;
+            }
+            if (!r->ok) fprintf(stderr, "DB step error: %s\n", sqlite3_errmsg(s->wdb));
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+        }
+        if (committed && sqlite3_exec(s->wdb, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+            fprintf(stderr, "DB commit error: %s\n", sqlite3_errmsg(s->wdb));
+            sqlite3_exec(s->wdb, "ROLLBACK;", NULL, NULL, NULL);
+            committed = 0;
+        }
+
+        pthread_mutex_lock(&s->qlock);
+        for (shard_insert_t *r = batch; r; r = r->next) {
+            if (!committed) r->ok = 0;
+            r->done = 1;
+        }
+        pthread_cond_broadcast(&s->done_cond);
+    }
+    pthread_mutex_unlock(&s->qlock);
+    sqlite3_finalize(s->insert_stmt);
+    s->insert_stmt = NULL;
+    return NULL;
+}
+
+/* Queues one insert and waits until its batch is committed. Returns the
+ * message id, 0 on failure; *seq gets its number in the conversation. */
+long long shard_store(shard_t *s, int sender_id, int receiver_id, const char *text, long long ts,
+                      long long *seq) {
+    shard_insert_t req;
+    memset(&req, 0, sizeof(req));
+    req.id = shard_id_begin();
+    req.sender_id = sender_id;
+    req.receiver_id = receiver_id;
+    req.text = text;
+    req.ts = ts;
+
+    pthread_mutex_lock(&s->qlock);
+    if (s->stopping) {
+        pthread_mutex_unlock(&s->qlock);
+        shard_id_end(req.id);
+        return 0;
+    }
+    if (s->qtail) s->qtail->next = &req;
+    else s->qhead = &req;
+    s->qtail = &req;
+    pthread_cond_signal(&s->qcond);
+    while (!req.done)
+        pthread_cond_wait(&s->done_cond, &s->qlock);
+    pthread_mutex_unlock(&s->qlock);
+
+    shard_id_end(req.id);
+    if (seq) *seq = req.seq;
+    return req.ok ? req.id : 0;
+}
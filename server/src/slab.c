@@ -0,0 +1,45 @@
+#include "slab.h"
+#include <stdlib.h>
+
+/* every object is at least pointer-sized and pointer-aligned so a free
+ * object can hold the free-list link */
+static size_t slot_size(const slab_t *s) {
+    size_t align = sizeof(void *) > sizeof(long double) ? sizeof(void *) : sizeof(long double);
+    size_t n = s->obj_size < sizeof(void *) ? sizeof(void *) : s->obj_size;
+    return (n + align - 1) / align * align;
+}
+
+static int grow_locked(slab_t *s) {
+    size_t sz = slot_size(s);
+    char *chunk = malloc(sz * s->per_chunk);
+    if (!chunk) return 0;
+    for (size_t i = 0; i < s->per_chunk; i++) {
+        void **obj = (void **)(chunk + i * sz);
+        *obj = s->free_list;
+        s->free_list = obj;
+    }
+    s->total += s->per_chunk;
+    return 1;
+}
+
+void *slab_alloc(slab_t *s) {
+    pthread_mutex_lock(&s->lock);
+    if (!s->free_list && !grow_locked(s)) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+    void **obj = s->free_list;
+    s->free_list = *obj;
+    s->in_use++;
+    pthread_mutex_unlock(&s->lock);
+    return obj;
+}
+
+void slab_free(slab_t *s, void *obj) {
+    if (!obj) return;
+    pthread_mutex_lock(&s->lock);
+    *(void **)obj = s->free_list;
+    s->free_list = obj;
+    s->in_use--;
+    pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,191 @@
+#include "timer.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* level 0 resolves single ticks; each higher level covers 64x the span of
+ * the one below (0.1s, 25.6s, ~27min, ~29h, ~77 days). Timers in higher
+ * levels cascade down as the wheel turns, Linux-style. */
+#define WHEEL_BITS0   8
+#define WHEEL_BITS    6
+#define WHEEL_SIZE0   (1 << WHEEL_BITS0)
+#define WHEEL_SIZE    (1 << WHEEL_BITS)
+#define WHEEL_LEVELS  4
+
+typedef struct {
+    wheel_timer_t head;   /* circular list sentinel */
+} slot_t;
+
+static slot_t level0[WHEEL_SIZE0];
+static slot_t levels[WHEEL_LEVELS][WHEEL_SIZE];
+static unsigned long long now_tick = 0;
+
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wheel_done = PTHREAD_COND_INITIALIZER;
+static wheel_timer_t *running_timer = NULL;
+static int started = 0;
+
+static void list_init(wheel_timer_t *head) {
+    head->next = head->prev = head;
+}
+
+static void list_add(wheel_timer_t *head, wheel_timer_t *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void list_del(wheel_timer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+static int level_shift(int level) {
+    return WHEEL_BITS0 + level * WHEEL_BITS;
+}
+
+static void place_locked(wheel_timer_t *t) {
+    unsigned long long delta = t->expires > now_tick ? t->expires - now_tick : 0;
+
+    if (delta < WHEEL_SIZE0) {
+        list_add(&level0[t->expires & (WHEEL_SIZE0 - 1)].head, t);
+        return;
+    }
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        if (delta < (1ULL << (level_shift(l) + WHEEL_BITS)) || l == WHEEL_LEVELS - 1) {
+            unsigned long long e = t->expires;
+            /* clamp beyond the wheel's range to its last slot */
+            if (l == WHEEL_LEVELS - 1 && delta >= (1ULL << (level_shift(l) + WHEEL_BITS)))
+                e = now_tick + (1ULL << (level_shift(l) + WHEEL_BITS)) - 1;
+            list_add(&levels[l][(e >> level_shift(l)) & (WHEEL_SIZE - 1)].head, t);
+            return;
+        }
+    }
+}
+
+/* move one slot of level l back through place_locked() */
+static void cascade_locked(int l, int index) {
+    wheel_timer_t *head = &levels[l][index].head;
+    wheel_timer_t pending;
+    list_init(&pending);
+    while (head->next != head) {
+        wheel_timer_t *t = head->next;
+        list_del(t);
+        list_add(&pending, t);
+    }
+    while (pending.next != &pending) {
+        wheel_timer_t *t = pending.next;
+        list_del(t);
+        place_locked(t);
+    }
+}
+
+static void advance_locked(wheel_timer_t *expired) {
+    now_tick++;
+    int index = (int)(now_tick & (WHEEL_SIZE0 - 1));
+
+    /* level 0 wrapped: pull the next slot of each higher level down */
+    if (index == 0) {
+        for (int l = 0; l < WHEEL_LEVELS; l++) {
+            int li = (int)((now_tick >> level_shift(l)) & (WHEEL_SIZE - 1));
+            cascade_locked(l, li);
+            if (li != 0) break;
+        }
+    }
+
+    wheel_timer_t *head = &level0[index].head;
+    while (head->next != head) {
+        wheel_timer_t *t = head->next;
+        list_del(t);
+        list_add(expired, t);
+    }
+}
+
+static unsigned long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000ULL + (unsigned long long)ts.tv_nsec / 1000000ULL;
+}
+
+static void *ticker(void *arg) {
+    (void)arg;
+    unsigned long long base = monotonic_ms();
+
+    for (;;) {
+        struct timespec sleep_for = { 0, TIMER_TICK_MS * 1000000L };
+        nanosleep(&sleep_for, NULL);
+
+        /* catch up on ticks missed while callbacks ran or the host stalled */
+        unsigned long long target = (monotonic_ms() - base) / TIMER_TICK_MS;
+
+        pthread_mutex_lock(&wheel_lock);
+        while (now_tick < target) {
+            wheel_timer_t expired;
+            list_init(&expired);
+            advance_locked(&expired);
+
+            while (expired.next != &expired) {
+                wheel_timer_t *t = expired.next;
+                list_del(t);
+                running_timer = t;
+                pthread_mutex_unlock(&wheel_lock);
+                t->fn(t->arg);
+                pthread_mutex_lock(&wheel_lock);
+                running_timer = NULL;
+                pthread_cond_broadcast(&wheel_done);
+            }
+        }
+        pthread_mutex_unlock(&wheel_lock);
+    }
+    return NULL;
+}
+
+void timers_start(void) {
+    pthread_mutex_lock(&wheel_lock);
+    if (started) { pthread_mutex_unlock(&wheel_lock); return; }
+    for (int i = 0; i < WHEEL_SIZE0; i++) list_init(&level0[i].head);
+    for (int l = 0; l < WHEEL_LEVELS; l++)
+        for (int i = 0; i < WHEEL_SIZE; i++) list_init(&levels[l][i].head);
+    started = 1;
+    pthread_mutex_unlock(&wheel_lock);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, ticker, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    pthread_detach(tid);
+}
+
+void timer_init(wheel_timer_t *t, void (*fn)(void *arg), void *arg) {
+    memset(t, 0, sizeof(*t));
+    t->fn = fn;
+    t->arg = arg;
+}
+
+/* (re)arm: a pending timer is moved, not duplicated. ms == 0 is a no-op. */
+void timer_arm(wheel_timer_t *t, unsigned long ms) {
+    if (ms == 0) return;
+    unsigned long long ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    pthread_mutex_lock(&wheel_lock);
+    if (started) {
+        if (t->next) list_del(t);
+        t->expires = now_tick + (ticks ? ticks : 1);
+        place_locked(t);
+    }
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+void timer_cancel(wheel_timer_t *t) {
+    pthread_mutex_lock(&wheel_lock);
+    if (t->next) list_del(t);
+    while (running_timer == t)
+        pthread_cond_wait(&wheel_done, &wheel_lock);
+    pthread_mutex_unlock(&wheel_lock);
+}
@@ -0,0 +1,183 @@
+#define _GNU_SOURCE   /* gettid() */
+#include "trace.h"
+#include "clients.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    const char *name;           /* static string: span names are literals */
+    char detail[16];            /* command name, root spans only */
+    long long id;
+    long long ts_us;
+    long long dur_us;
+    int tid;
+} trace_event_t;
+
+/* A ring is written only by the thread that owns it; its lock exists so a
+ * dump can copy it consistently and is otherwise uncontended. When the
+ * owner exits, the ring (and its events) passes to the next new thread. */
+typedef struct {
+    pthread_mutex_t lock;
+    int owned;
+    unsigned long head;         /* events ever written */
+    trace_event_t *events;
+} trace_ring_t;
+
+int trace_sample_every;
+__thread long long trace_current;
+
+static trace_ring_t rings[TRACE_MAX_THREADS];
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread trace_ring_t *my_ring;
+static __thread int my_tid;
+static unsigned long sample_counter;
+static long long next_id;
+
+long long trace_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void ring_release(void *ring) {
+    pthread_mutex_lock(&rings_lock);
+    ((trace_ring_t *)ring)->owned = 0;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void make_key(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+static trace_ring_t *ring_claim(void) {
+    if (my_ring) return my_ring;
+    pthread_once(&ring_key_once, make_key);
+
+    pthread_mutex_lock(&rings_lock);
+    for (int i = 0; i < TRACE_MAX_THREADS && !my_ring; i++) {
+        trace_ring_t *r = &rings[i];
+        if (r->owned) continue;
+        if (!r->events) {
+            r->events = calloc(TRACE_RING_EVENTS, sizeof(trace_event_t));
+            if (!r->events) break;
+            pthread_mutex_init(&r->lock, NULL);
+        }
+        r->owned = 1;
+        my_ring = r;
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (my_ring) {
+        pthread_setspecific(ring_key, my_ring);
+        my_tid = (int)gettid();
+    }
+    return my_ring;
+}
+
+static void ring_push(const char *name, const char *detail, long long start_us, long long dur_us) {
+    trace_ring_t *r = ring_claim();
+    if (!r) return;
+    pthread_mutex_lock(&r->lock);
+    trace_event_t *e = &r->events[r->head % TRACE_RING_EVENTS];
+    e->name = name;
+    /* details come from client input and end up in JSON: keep them plain */
+    size_t n = 0;
+    for (; detail && *detail && n < sizeof(e->detail) - 1; detail++) {
+        char c = *detail;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '/')
+            e->detail[n++] = c;
+    }
+    e->detail[n] = '\0';
+    e->id = trace_current;
+    e->ts_us = start_us;
+    e->dur_us = dur_us;
+    e->tid = my_tid;
+    r->head++;
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* decides whether this command is sampled; returns 1 if it is traced */
+int trace_command_start(trace_span_t *root) {
+    int every = __atomic_load_n(&trace_sample_every, __ATOMIC_RELAXED);
+    if (every <= 0) return 0;
+    if (__atomic_fetch_add(&sample_counter, 1, __ATOMIC_RELAXED) % (unsigned)every != 0) return 0;
+    trace_current = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+    root->start_us = trace_now_us();
+    return 1;
+}
+
+void trace_command_end(trace_span_t *root, const char *cmd) {
+    if (!trace_current) return;
+    ring_push("command", cmd, root->start_us, trace_now_us() - root->start_us);
+    trace_current = 0;
+}
+
+void trace_begin(trace_span_t *sp) {
+    sp->start_us = trace_now_us();
+}
+
+void trace_end(trace_span_t *sp, const char *name) {
+    ring_push(name, NULL, sp->start_us, trace_now_us() - sp->start_us);
+}
+
+/* for spans measured elsewhere, e.g. a lock wait */
+void trace_record(const char *name, long long start_us, long long dur_us) {
+    if (trace_current) ring_push(name, NULL, start_us, dur_us);
+}
+
+static int by_ts(const void *a, const void *b) {
+    const trace_event_t *x = a, *y = b;
+    return (x->ts_us > y->ts_us) - (x->ts_us < y->ts_us);
+}
+
+/* "TRACE <n>\n" followed by n bytes of trace_event JSON */
+void trace_dump(int sock) {
+    size_t cap = (size_t)TRACE_MAX_THREADS * TRACE_RING_EVENTS;
+    trace_event_t *all = malloc(cap * sizeof(*all));
+    if (!all) {
+        send_to_sock(sock, "ERROR: out of memory\n");
+        return;
+    }
+    size_t n = 0;
+    for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+        trace_ring_t *r = &rings[i];
+        pthread_mutex_lock(&rings_lock);
+        int live = r->events != NULL;
+        pthread_mutex_unlock(&rings_lock);
+        if (!live) continue;
+
+        pthread_mutex_lock(&r->lock);
+        unsigned long count = r->head < TRACE_RING_EVENTS ? r->head : TRACE_RING_EVENTS;
+        for (unsigned long k = 0; k < count; k++)
+            all[n++] = r->events[(r->head - count + k) % TRACE_RING_EVENTS];
+        pthread_mutex_unlock(&r->lock);
+    }
+    qsort(all, n, sizeof(*all), by_ts);
+
+    strbuf_t json;
+    sb_init(&json);
+    sb_appendf(&json, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (size_t i = 0; i < n; i++) {
+        const trace_event_t *e = &all[i];
+        sb_appendf(&json,
+                   "%s\n{\"name\":\"%s%s%s\",\"cat\":\"server\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                   "\"pid\":%d,\"tid\":%d,\"args\":{\"trace\":%lld}}",
+                   i ? "," : "", e->name, e->detail[0] ? " " : "", e->detail,
+                   e->ts_us, e->dur_us, (int)getpid(), e->tid, e->id);
+    }
+    sb_appendf(&json, "\n]}\n");
+    free(all);
+
+    char header[48];
+    snprintf(header, sizeof(header), "TRACE %zu\n", json.len);
+    send_frame_to_sock(sock, header, json.data, json.len);
+    sb_free(&json);
+}
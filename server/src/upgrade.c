@@ -0,0 +1,459 @@
+#include "upgrade.h"
+#include "server.h"
+#include "client_thread.h"
+#include "logging.h"
+#include "database.h"
+#include "lockprof.h"
+#include "utils.h"
+#include "netio.h"
+#include "shards.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define UPGRADE_MAGIC   0x55504752u   /* "UPGR" */
+#define UPGRADE_VERSION 3             /* 2 sent each session in one packet, 1 sent
+                                         client_chat_state_t as raw bytes */
+#define UPGRADE_ACK_TIMEOUT_SEC 10
+#define UPGRADE_PACKET (64 * 1024)
+/* a sanity bound: queued output can pass NETIO_MAX_OUTPUT by one reply */
+#define UPGRADE_MAX_RECORD (64u << 20)
+
+/* first packet, carries server_fd */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nsessions;
+} upgrade_header_t;
+
+/* Then one record per logged-in client: a first packet carrying its socket
+ * and the record's length as a uint32, continued in packets of at most
+ * UPGRADE_PACKET bytes without a socket. The session is a list of fields, each a uint16 tag, a uint32 length and that many bytes,
+ * so the record does not depend on the layout of client_chat_state_t and a
+ * reader skips tags it does not know. Names are sent without their NUL;
+ * numbers are uint32. */
+enum {
+    F_USERNAME = 1,
+    F_MODE,
+    F_CHAT_PARTNER,
+    F_ROOM_MEMBER,          /* once per member, in order */
+    F_MENU,
+    F_MENU_RETURN,
+    F_MENU_PREV_MODE,
+    F_MENU_PARTNER,
+    F_INPUT,                /* received but not yet used (event backends) */
+    F_OUTPUT                /* queued but not yet sent (event backends) */
+};
+
+static void put_field(strbuf_t *sb, uint16_t tag, const void *data, uint32_t len) {
+    sb_append(sb, (const char *)&tag, sizeof(tag));
+    sb_append(sb, (const char *)&len, sizeof(len));
+    sb_append(sb, data, len);
+}
+
+static void put_name(strbuf_t *sb, uint16_t tag, const char *name) {
+    put_field(sb, tag, name, (uint32_t)strnlen(name, USERNAME_LEN - 1));
+}
+
+static void put_u32(strbuf_t *sb, uint16_t tag, uint32_t v) {
+    put_field(sb, tag, &v, sizeof(v));
+}
+
+static void encode_session(strbuf_t *sb, const char *username, const client_chat_state_t *st,
+                           const char *input, size_t input_len,
+                           const char *output, size_t output_len) {
+    put_name(sb, F_USERNAME, username);
+    if (input_len) put_field(sb, F_INPUT, input, (uint32_t)input_len);
+    if (output_len) put_field(sb, F_OUTPUT, output, (uint32_t)output_len);
+    if (!st) return;
+    put_u32(sb, F_MODE, (uint32_t)st->mode);
+    put_name(sb, F_CHAT_PARTNER, st->chat_partner);
+    for (int i = 0; i < st->room_size && i < MAX_ROOM_USERS; i++)
+        put_name(sb, F_ROOM_MEMBER, st->room_partners[i]);
+    put_u32(sb, F_MENU, (uint32_t)st->menu);
+    put_u32(sb, F_MENU_RETURN, (uint32_t)st->menu_return);
+    put_u32(sb, F_MENU_PREV_MODE, (uint32_t)st->menu_prev_mode);
+    put_name(sb, F_MENU_PARTNER, st->menu_partner);
+}
+
+static int get_name(const char *v, uint32_t len, char out[USERNAME_LEN]) {
+    if (len >= USERNAME_LEN || memchr(v, '\0', len)) return 0;
+    memcpy(out, v, len);
+    out[len] = '\0';
+    return 1;
+}
+
+static int get_u32(const char *v, uint32_t len, uint32_t max, uint32_t *out) {
+    if (len != sizeof(uint32_t)) return 0;
+    memcpy(out, v, sizeof(uint32_t));
+    return *out <= max;
+}
+
+/* a field copied out of the record, for F_INPUT and F_OUTPUT */
+static int get_bytes(const char *v, uint32_t len, char **out, size_t *out_len) {
+    if (len == 0 || *out || (*out = malloc(len)) == NULL) return 0;
+    memcpy(*out, v, len);
+    *out_len = len;
+    return 1;
+}
+
+static void drop_bytes(resumed_session_t *s) {
+    free(s->input);
+    free(s->output);
+    s->input = s->output = NULL;
+}
+
+/* Returns 0 for a record that is truncated, out of range or has no
+ * username. F_INPUT is copied into s->input, F_OUTPUT into s->output. */
+static int decode_session(const char *p, size_t n, resumed_session_t *s) {
+    client_chat_state_t *st = &s->state;
+    char *username = s->username;
+    memset(st, 0, sizeof(*st));
+    username[0] = '\0';
+    s->input = s->output = NULL;
+    s->input_len = s->output_len = 0;
+    while (n > 0) {
+        uint16_t tag;
+        uint32_t len, u = 0;
+        if (n < sizeof(tag) + sizeof(len)) return 0;
+        memcpy(&tag, p, sizeof(tag));
+        memcpy(&len, p + sizeof(tag), sizeof(len));
+        p += sizeof(tag) + sizeof(len);
+        n -= sizeof(tag) + sizeof(len);
+        if (len > n) return 0;
+
+        int ok = 1;
+        switch (tag) {
+        case F_USERNAME: ok = get_name(p, len, username); break;
+        case F_MODE:
+            if ((ok = get_u32(p, len, SEMI_CLOSED_CHAT, &u))) st->mode = (chat_mode_t)u;
+            break;
+        case F_CHAT_PARTNER: ok = get_name(p, len, st->chat_partner); break;
+        case F_ROOM_MEMBER:
+            ok = st->room_size < MAX_ROOM_USERS &&
+                 get_name(p, len, st->room_partners[st->room_size]);
+            if (ok) st->room_size++;
+            break;
+        case F_MENU:
+            if ((ok = get_u32(p, len, MENU_ROOM_CHAT, &u))) st->menu = (menu_step_t)u;
+            break;
+        case F_MENU_RETURN:
+            if ((ok = get_u32(p, len, MENU_ROOM_CHAT, &u))) st->menu_return = (menu_step_t)u;
+            break;
+        case F_MENU_PREV_MODE:
+            if ((ok = get_u32(p, len, SEMI_CLOSED_CHAT, &u))) st->menu_prev_mode = (chat_mode_t)u;
+            break;
+        case F_MENU_PARTNER: ok = get_name(p, len, st->menu_partner); break;
+        case F_INPUT: ok = get_bytes(p, len, &s->input, &s->input_len); break;
+        case F_OUTPUT: ok = get_bytes(p, len, &s->output, &s->output_len); break;
+        default: break;         /* from a newer build; not needed here */
+        }
+        if (!ok) {
+            drop_bytes(s);
+            return 0;
+        }
+        p += len;
+        n -= len;
+    }
+    if (!username[0]) {
+        drop_bytes(s);
+        return 0;
+    }
+    return 1;
+}
+
+/* SOCK_SEQPACKET keeps packet boundaries: `head` and then `data` go out
+ * as one packet, with the fd attached */
+static int send_with_fd(int us, const void *head, size_t head_len,
+                        const void *data, size_t len, int fd) {
+    struct iovec iov[2] = { { (void *)head, head_len }, { (void *)data, len } };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len ? 2 : 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(us, &msg, MSG_NOSIGNAL) == (ssize_t)(head_len + len);
+}
+
+static int send_record(int us, const strbuf_t *rec, int fd) {
+    uint32_t total = (uint32_t)rec->len;
+    size_t n = rec->len < UPGRADE_PACKET - sizeof(total) ? rec->len : UPGRADE_PACKET - sizeof(total);
+    if (!send_with_fd(us, &total, sizeof(total), rec->data, n, fd)) return 0;
+    for (size_t off = n; off < rec->len; off += n) {
+        n = rec->len - off < UPGRADE_PACKET ? rec->len - off : UPGRADE_PACKET;
+        if (send(us, rec->data + off, n, MSG_NOSIGNAL) != (ssize_t)n) return 0;
+    }
+    return 1;
+}
+
+/* Returns the packet's length, or -1 if it was cut short by `len` or
+ * carried no descriptor. */
+static ssize_t recv_with_fd(int us, void *data, size_t len, int *fd) {
+    struct iovec iov = { data, len };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    *fd = -1;
+    ssize_t n = recvmsg(us, &msg, MSG_CMSG_CLOEXEC);
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); n >= 0 && c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(c), sizeof(int));
+    }
+    if (n < 0 || (msg.msg_flags & MSG_TRUNC) || *fd < 0) return -1;
+    return n;
+}
+
+/* Returns a malloc'd record of *len bytes, or NULL if any packet was cut
+ * short or the first carried no descriptor (*fd is then -1 or closed by
+ * the caller). */
+static char *recv_record(int us, size_t *len, int *fd) {
+    char *pkt = malloc(UPGRADE_PACKET);
+    if (!pkt) return NULL;
+    uint32_t total;
+    ssize_t n = recv_with_fd(us, pkt, UPGRADE_PACKET, fd);
+    char *rec = NULL;
+    if (n >= (ssize_t)sizeof(total)) {
+        memcpy(&total, pkt, sizeof(total));
+        n -= (ssize_t)sizeof(total);
+        if (total <= UPGRADE_MAX_RECORD && (size_t)n <= total && (rec = malloc(total ? total : 1)) != NULL)
+            memcpy(rec, pkt + sizeof(total), (size_t)n);
+    }
+    free(pkt);
+    for (size_t got = (size_t)n; rec && got < total; ) {
+        size_t want = total - got < UPGRADE_PACKET ? total - got : UPGRADE_PACKET;
+        if (recv(us, rec + got, want, 0) != (ssize_t)want) {
+            free(rec);
+            rec = NULL;
+            break;
+        }
+        got += want;
+    }
+    if (rec) *len = total;
+    return rec;
+}
+
+/* Old process side. Every reader parks first, so nothing reads a socket
+ * that is being handed over; then the registry and DB are locked for the
+ * transfer so no session changes state or half-writes a row while it is
+ * being copied. After the new process answers OK this process exits
+ * without closing anything: the new process holds duplicates of every
+ * socket, so clients stay connected, and it starts reading them once it
+ * sees this end of the upgrade socket close, i.e. once we are gone. */
+static void hand_over(int us) {
+    if (!session_freeze(UPGRADE_ACK_TIMEOUT_SEC * 1000)) {
+        log_info("Hot upgrade aborted: sessions did not go idle.");
+        session_thaw();
+        return;
+    }
+    LOCK(clients_lock);
+    db_lock_acquire();
+
+    upgrade_header_t hdr = { UPGRADE_MAGIC, UPGRADE_VERSION, 0 };
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        if (clients[i].active) hdr.nsessions++;
+
+    int sndbuf = 2 * UPGRADE_PACKET;
+    setsockopt(us, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    int ok = send_with_fd(us, &hdr, sizeof(hdr), NULL, 0, server_fd);
+    strbuf_t rec, out;
+    sb_init(&rec);
+    sb_init(&out);
+    for (int i = 0; ok && i < MAX_CLIENTS; i++) {
+        if (!clients[i].active) continue;
+        /* with an event backend, input the I/O thread read but no session
+         * used yet, and output queued but not sent; with threads the one
+         * is still in the socket and the other already written */
+        const char *input = NULL;
+        size_t input_len = 0;
+        out.len = 0;
+        if (netio_evented()) {
+            input_len = netio_pending(clients[i].sock, &input);
+            netio_pending_output(clients[i].sock, &out);
+        }
+        rec.len = 0;
+        encode_session(&rec, clients[i].username, clients[i].state, input, input_len,
+                       out.data, out.len);
+        ok = rec.len <= UPGRADE_MAX_RECORD && send_record(us, &rec, clients[i].sock);
+    }
+    sb_free(&rec);
+    sb_free(&out);
+
+    char ack[4] = {0};
+    if (ok) ok = recv(us, ack, sizeof(ack) - 1, 0) > 0 && strncmp(ack, "OK", 2) == 0;
+
+    if (ok) {
+        log_info("Handed %u session(s) to the new process, exiting.", hdr.nsessions);
+        fflush(stdout);
+        /* db_lock is held: close_database() would deadlock; v2 defers the
+         * close past the cached statements */
+        if (db) sqlite3_close_v2(db);
+        _exit(0);
+    }
+
+    log_info("Hot upgrade aborted, continuing to serve.");
+    UNLOCK(db_lock);
+    UNLOCK(clients_lock);
+    session_thaw();
+}
+
+static void *upgrade_listener(void *arg) {
+    int lfd = (int)(intptr_t)arg;
+    while (running) {
+        int us = accept(lfd, NULL, NULL);
+        if (us < 0) {
+            if (errno == EINTR) continue;
+            perror("upgrade accept");
+            break;
+        }
+
+        char req[16] = {0};
+        struct timeval tv = { UPGRADE_ACK_TIMEOUT_SEC, 0 };
+        setsockopt(us, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (recv(us, req, sizeof(req) - 1, 0) > 0 && strncmp(req, "TAKEOVER", 8) == 0) {
+            log_info("New server process requested takeover...");
+            hand_over(us);
+        }
+        close(us);
+    }
+    close(lfd);
+    return NULL;
+}
+
+void upgrade_listen(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "upgrade socket path too long: %s\n", path);
+        return;
+    }
+    strcpy(addr.sun_path, path);
+
+    int lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (lfd < 0) { perror("upgrade socket"); return; }
+
+    /* a previous process may still be bound to the path; it is done with it */
+    unlink(path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 1) < 0) {
+        perror("upgrade bind");
+        close(lfd);
+        return;
+    }
+    chmod(path, 0600);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, upgrade_listener, (void *)(intptr_t)lfd) != 0) {
+        perror("pthread_create");
+        close(lfd);
+        return;
+    }
+    pthread_detach(tid);
+    session_freeze_init();
+    log_info("Hot upgrade socket: %s", path);
+}
+
+/* New process side: receive server_fd and every session, acknowledge, wait
+ * for the old process to exit, then start the sessions. Any short or bad
+ * packet abandons the takeover before OK is sent, so the old process keeps
+ * serving. Returns 1 on success. */
+int upgrade_takeover(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) return 0;
+    strcpy(addr.sun_path, path);
+
+    int us = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (us < 0) { perror("takeover socket"); return 0; }
+    if (connect(us, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("takeover connect");
+        close(us);
+        return 0;
+    }
+    if (send(us, "TAKEOVER", 8, MSG_NOSIGNAL) != 8) { close(us); return 0; }
+
+    upgrade_header_t hdr;
+    int fd;
+    if (recv_with_fd(us, &hdr, sizeof(hdr), &fd) != (ssize_t)sizeof(hdr) ||
+        hdr.magic != UPGRADE_MAGIC || hdr.version != UPGRADE_VERSION) {
+        fprintf(stderr, "takeover: bad handshake (the running server may be another version)\n");
+        if (fd >= 0) close(fd);
+        close(us);
+        return 0;
+    }
+    server_fd = fd;
+
+    if (hdr.nsessions > MAX_CLIENTS) {
+        fprintf(stderr, "takeover: %u sessions, at most %d\n", hdr.nsessions, MAX_CLIENTS);
+        close(server_fd);
+        close(us);
+        return 0;
+    }
+
+    resumed_session_t got[MAX_CLIENTS];
+    uint32_t n = 0;
+    for (; n < hdr.nsessions; n++) {
+        size_t len = 0;
+        char *rec = recv_record(us, &len, &got[n].sock);
+        int good = rec && decode_session(rec, len, &got[n]);
+        free(rec);
+        if (!good) {
+            if (got[n].sock >= 0) close(got[n].sock);
+            break;
+        }
+    }
+    int ok = n == hdr.nsessions;
+    if (!ok)
+        fprintf(stderr, "takeover: session %u of %u was cut short or malformed\n",
+                n + 1, hdr.nsessions);
+    else
+        ok = send(us, "OK", 2, MSG_NOSIGNAL) == 2;
+    if (!ok) {
+        for (uint32_t i = 0; i < n; i++) {
+            close(got[i].sock);
+            drop_bytes(&got[i]);
+        }
+        close(server_fd);
+        close(us);
+        return 0;
+    }
+    /* the old process exits right after reading OK; its end closing is the
+     * confirmation that it no longer reads any of these sockets */
+    struct timeval tv = { UPGRADE_ACK_TIMEOUT_SEC, 0 };
+    setsockopt(us, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char c;
+    if (recv(us, &c, 1, 0) != 0)
+        log_info("Takeover: the old process did not confirm its exit; starting anyway.");
+    close(us);
+    /* ids were seeded before the old process stopped storing */
+    shards_reseed();
+
+    int adopted = start_resumed_sessions(got, (int)n);
+    log_info("Took over listener and %d of %u session(s).", adopted, hdr.nsessions);
+    return 1;
+}
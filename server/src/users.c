@@ -0,0 +1,150 @@
+#include "users.h"
+#include "server.h"
+#include "logging.h"
+#include "database.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sqlite3.h>
+
+/* name -> id: open addressing over ids, keyed by the name they point at.
+ * id -> name: names[] indexed directly by id. Both guarded by users_lock.
+ * Lock order is db_lock before users_lock, never the reverse. */
+static pthread_mutex_t users_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *slots = NULL;        /* 0 = empty */
+static size_t slot_cap = 0;
+static size_t slot_used = 0;
+static char **names = NULL;
+static int names_cap = 0;
+
+static uint32_t hash_name(const char *s) {
+    uint32_t h = 2166136261u;   /* FNV-1a */
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
+
+static int find_locked(const char *name) {
+    if (slot_cap == 0) return 0;
+    size_t mask = slot_cap - 1;
+    for (size_t i = hash_name(name) & mask; slots[i]; i = (i + 1) & mask) {
+        if (strcmp(names[slots[i]], name) == 0) return slots[i];
+    }
+    return 0;
+}
+
+static void slot_put(int *table, size_t cap, int id) {
+    size_t mask = cap - 1;
+    size_t i = hash_name(names[id]) & mask;
+    while (table[i]) i = (i + 1) & mask;
+    table[i] = id;
+}
+
+static int insert_locked(int id, const char *name) {
+    if (id >= names_cap) {
+        int cap = names_cap ? names_cap : 64;
+        while (cap <= id) cap *= 2;
+        char **grown = realloc(names, cap * sizeof(*names));
+        if (!grown) return 0;
+        memset(grown + names_cap, 0, (cap - names_cap) * sizeof(*names));
+        names = grown;
+        names_cap = cap;
+    }
+    if (names[id]) return 1;
+
+    /* keep the table at most half full */
+    if ((slot_used + 1) * 2 > slot_cap) {
+        size_t cap = slot_cap ? slot_cap * 2 : 128;
+        int *grown = calloc(cap, sizeof(*grown));
+        if (!grown) return 0;
+        for (size_t i = 0; i < slot_cap; i++)
+            if (slots[i]) slot_put(grown, cap, slots[i]);
+        free(slots);
+        slots = grown;
+        slot_cap = cap;
+    }
+
+    names[id] = strdup(name);
+    if (!names[id]) return 0;
+    slot_put(slots, slot_cap, id);
+    slot_used++;
+    return 1;
+}
+
+void users_load(void) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, "SELECT id, name FROM users;", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "DB prepare error: %s\n", sqlite3_errmsg(db));
+        return;
+    }
+
+    pthread_mutex_lock(&users_lock);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char *name = sqlite3_column_text(stmt, 1);
+        if (name) insert_locked(sqlite3_column_int(stmt, 0), (const char *)name);
+    }
+    pthread_mutex_unlock(&users_lock);
+
+    sqlite3_finalize(stmt);
+    log_info("Loaded %zu users.", slot_used);
+}
+
+int user_lookup(const char *name) {
+    pthread_mutex_lock(&users_lock);
+    int id = find_locked(name);
+    pthread_mutex_unlock(&users_lock);
+    return id;
+}
+
+/* returns the id for `name`, creating the users row on first sight.
+ * Must not be called with db_lock held. */
+int user_intern(const char *name) {
+    if (!name || !*name) return 0;
+
+    int id = user_lookup(name);
+    if (id) return id;
+
+    db_lock_acquire();
+    sqlite3_stmt *stmt = NULL;
+    const char *sql =
+        "INSERT INTO users (name) VALUES (?) "
+        "ON CONFLICT(name) DO UPDATE SET name = excluded.name RETURNING id;";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) == SQLITE_ROW) id = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    if (!id) fprintf(stderr, "DB error interning user: %s\n", sqlite3_errmsg(db));
+
+    if (id) {
+        pthread_mutex_lock(&users_lock);
+        if (!insert_locked(id, name)) id = 0;
+        pthread_mutex_unlock(&users_lock);
+    }
+    UNLOCK(db_lock);
+    return id;
+}
+
+const char *user_name(int id) {
+    const char *name = "";
+    pthread_mutex_lock(&users_lock);
+    if (id > 0 && id < names_cap && names[id]) name = names[id];
+    pthread_mutex_unlock(&users_lock);
+    return name;
+}
+
+static char admins[MAX_ADMINS][USERNAME_LEN];
+static int nadmins;
+
+/* --admin <user>; returns 0 if the list is full or the name too long */
+int user_add_admin(const char *name) {
+    if (nadmins == MAX_ADMINS || !*name || strlen(name) >= USERNAME_LEN) return 0;
+    snprintf(admins[nadmins++], USERNAME_LEN, "%s", name);
+    return 1;
+}
+
+int user_is_admin(const char *name) {
+    for (int i = 0; i < nadmins; i++)
+        if (strcmp(admins[i], name) == 0) return 1;
+    return 0;
+}
@@ -1,7 +1,56 @@
+#define _GNU_SOURCE   /* strptime(), timegm() */
 #include "utils.h"
 #include "clients.h"
 #include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+void sb_init(strbuf_t *sb) {
+    sb->data = NULL;
+    sb->len = 0;
+    sb->cap = 0;
+}
+
+static int sb_reserve(strbuf_t *sb, size_t extra) {
+    if (sb->len + extra + 1 <= sb->cap) return 1;
+    size_t cap = sb->cap ? sb->cap : 256;
+    while (cap < sb->len + extra + 1) cap *= 2;
+    char *grown = realloc(sb->data, cap);
+    if (!grown) return 0;
+    sb->data = grown;
+    sb->cap = cap;
+    return 1;
+}
+
+int sb_append(strbuf_t *sb, const char *data, size_t len) {
+    if (!sb_reserve(sb, len)) return 0;
+    memcpy(sb->data + sb->len, data, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+    return 1;
+}
+
+int sb_appendf(strbuf_t *sb, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || !sb_reserve(sb, (size_t)n)) return 0;
+
+    va_start(ap, fmt);
+    vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, ap);
+    va_end(ap);
+    sb->len += (size_t)n;
+    return 1;
+}
+
+void sb_free(strbuf_t *sb) {
+    free(sb->data);
+    sb_init(sb);
+}
 
 void trim_whitespace(char *s) {
     char *start = s;
@@ -14,12 +63,49 @@ void trim_whitespace(char *s) {
     *(end + 1) = '\0';
 }
 
+/* accepts epoch seconds or a UTC date: YYYY-MM-DD, YYYY-MM-DDTHH:MM[:SS] */
+int parse_timestamp(const char *s, long long *out) {
+    if (!s || !*s) return 0;
+
+    char *end = NULL;
+    long long v = strtoll(s, &end, 10);
+    if (*end == '\0') { *out = v; return 1; }
+
+    static const char *formats[] = { "%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M", "%Y-%m-%d" };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *rest = strptime(s, formats[i], &tm);
+        if (rest && *rest == '\0') {
+            *out = (long long)timegm(&tm);
+            return 1;
+        }
+    }
+    return 0;
+}
+
 void send_help(int sock, client_chat_state_t *state) {
     send_to_sock(sock, "Available commands:\n");
     send_to_sock(sock, " - Chat <user> <message>    (open mode)\n");
-    send_to_sock(sock, " - getmessages <user>\n");
+    send_to_sock(sock, " - getmessages <user> [since <ts>] [until <ts>]\n");
+    send_to_sock(sock, " - search <text> [with <user>] [limit N] [page N]\n");
     send_to_sock(sock, " - deletemessages <user>\n");
+    send_to_sock(sock, " - export <user> [format text|jsonl]   (whole conversation as EXPORT <n> <format>, CHUNKs, END EXPORT)\n");
+    send_to_sock(sock, " - sync <last_id>   (messages newer than #last_id, all conversations)\n");
+    send_to_sock(sock, " - ack <user> <seq> ...   (received everything from <user> up to #id/<seq>)\n");
+    send_to_sock(sock, " - redeliver   (messages not yet acked)\n");
+    send_to_sock(sock, " - compress on|off  (history, search and sync as ZLIB <n> frames)\n");
+    send_to_sock(sock, " - bigchat <user> <size>   (then send <size> raw bytes after READY)\n");
+    send_to_sock(sock, " - getbig <id>      (download a large message)\n");
     send_to_sock(sock, " - getuserlist\n");
+    send_to_sock(sock, " - join #channel [persist] / leave #channel / channels\n");
+    send_to_sock(sock, " - post #channel <message>   chanhistory #channel [N]\n");
+    send_to_sock(sock, " - subscribe presence   (who is online, then +user/-user updates)\n");
+    send_to_sock(sock, " - stats   (rate-limit and overload counters)\n");
+    send_to_sock(sock, " - backup <name> | backup status   (online copy into --backup-dir)\n");
+    send_to_sock(sock, " - lockstats [N|on|off|reset]   (lock contention by call site)\n");
+    send_to_sock(sock, " - peers   (cluster links)\n");
+    send_to_sock(sock, " - trace on [N] | off | dump   (sampled latency spans, Chrome JSON)\n");
     send_to_sock(sock, " - Menu   (interactive chatrooms)\n");
     send_to_sock(sock, " - select <username>   (enter closed chat)\n");
     send_to_sock(sock, " - open   (go to open mode)\n");
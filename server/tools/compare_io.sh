@@ -0,0 +1,43 @@
+#!/bin/sh
+# compare_io.sh: replays one capture against each network backend.
+#
+#   tools/compare_io.sh <capture> [port] [replay options]
+#
+# Starts ./server on a scratch database once per backend (threads, epoll,
+# uring) with rate limits off, runs tools/replay at max speed unless other
+# replay options are given, and prints each backend's summary under the
+# backend the server reports it is running, so a uring run that fell back
+# to epoll is labelled as such. Run from the server directory after "make".
+
+[ $# -ge 1 ] || { echo "usage: $0 <capture> [port] [replay options]" >&2; exit 1; }
+capture=$1
+port=${2:-6070}
+[ $# -ge 2 ] && shift 2 || shift 1
+[ $# -gt 0 ] || set -- --speed max
+
+scratch=$(mktemp -d) || exit 1
+trap 'rm -rf "$scratch"' EXIT
+
+for io in threads epoll uring; do
+    # line-buffered so the backend line is in the log while it runs
+    stdbuf -oL ./server "$port" "$scratch/$io.db" --io "$io" \
+        --rate-limit chat=0/1 --rate-limit query=0/1 --rate-limit other=0/1 \
+        > "$scratch/$io.log" 2>&1 &
+    pid=$!
+    sleep 0.5
+    used=$(sed -n 's/.*Network I\/O: //p' "$scratch/$io.log" | head -n 1)
+    if [ -z "$used" ]; then
+        echo "== $io: server did not start" >&2
+        cat "$scratch/$io.log" >&2
+        kill "$pid" 2>/dev/null
+        continue
+    fi
+    if [ "$used" = "$io" ]; then
+        echo "== $io"
+    else
+        echo "== $io (requested; fell back to $used)"
+    fi
+    ./tools/replay "$capture" 127.0.0.1 "$port" "$@" | tail -n 3
+    kill "$pid"
+    wait "$pid" 2>/dev/null
+done
@@ -0,0 +1,314 @@
+/* replay: drives a server with the commands from a --record capture.
+ *
+ *   replay <capture> <host> <port> [--speed N|max] [--prefix P]
+ *
+ * Every recorded session gets its own connection and thread, opened and
+ * fed on the recorded schedule divided by the speed (max = no waiting).
+ * Latency is the time from sending a command to the first line of its
+ * reply; lines the server pushes on its own (deliveries, presence,
+ * pings) are skipped. Recorded names u<id> are replayed as <P>u<id> (the
+ * prefix written straight before the name), so one server can take several
+ * replays side by side. */
+
+#define _GNU_SOURCE
+#include "record.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPLY_TIMEOUT_MS 2000
+/* a reply written in several parts is read until the socket has been
+ * quiet this long, after its latency is taken */
+#define DRAIN_QUIET_MS 1
+/* after login: greeting, token and redelivery may come separately */
+#define LOGIN_QUIET_MS 20
+
+typedef struct {
+    int type;
+    unsigned ms;
+    char *data;
+} rec_t;
+
+typedef struct {
+    unsigned id;
+    rec_t *recs;
+    int nrecs;
+    int cap;
+} session_t;
+
+static session_t *sessions;
+static int nsessions;
+static double speed = 1.0;                 /* 0 = as fast as replies come */
+static const char *prefix = "";
+static struct addrinfo *server;
+static struct timespec t0;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static double *latencies;
+static long nlat, latcap, noreply, failed_sessions;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - t0.tv_sec) * 1000.0 + (ts.tv_nsec - t0.tv_nsec) / 1e6;
+}
+
+static void sleep_until(unsigned rec_ms) {
+    if (speed <= 0) return;
+    double due = rec_ms / speed;
+    double left = due - now_ms();
+    if (left <= 0) return;
+    struct timespec ts = { (time_t)(left / 1000), (long)((left - (long)(left / 1000) * 1000) * 1e6) };
+    nanosleep(&ts, NULL);
+}
+
+static session_t *session_for(unsigned id) {
+    for (int i = 0; i < nsessions; i++)
+        if (sessions[i].id == id) return &sessions[i];
+    sessions = realloc(sessions, (size_t)(nsessions + 1) * sizeof(*sessions));
+    memset(&sessions[nsessions], 0, sizeof(*sessions));
+    sessions[nsessions].id = id;
+    return &sessions[nsessions++];
+}
+
+static unsigned long get_le(const unsigned char *p, int n) {
+    unsigned long v = 0;
+    for (int i = n - 1; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static int load(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) { perror(path); return 0; }
+    char magic[8];
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, REC_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        fclose(f);
+        return 0;
+    }
+    unsigned char h[REC_HEADER_SIZE];
+    while (fread(h, 1, sizeof(h), f) == sizeof(h)) {
+        size_t len = get_le(h + 9, 2);
+        session_t *s = session_for((unsigned)get_le(h + 1, 4));
+        if (s->nrecs == s->cap) {
+            s->cap = s->cap ? 2 * s->cap : 16;
+            s->recs = realloc(s->recs, (size_t)s->cap * sizeof(rec_t));
+        }
+        rec_t *r = &s->recs[s->nrecs++];
+        r->type = h[0];
+        r->ms = (unsigned)get_le(h + 5, 4);
+        r->data = malloc(len + 1);
+        if (len && fread(r->data, 1, len, f) != len) { s->nrecs--; break; }
+        r->data[len] = '\0';
+    }
+    fclose(f);
+    return 1;
+}
+
+/* "u12" tokens get the prefix, the rest is copied */
+static void rename_users(const char *in, char *out, size_t size) {
+    size_t o = 0;
+    for (const char *p = in; *p && o < size - 1; ) {
+        int at_word = (p == in || p[-1] == ' ');
+        if (at_word && p[0] == 'u' && p[1] >= '0' && p[1] <= '9') {
+            o += (size_t)snprintf(out + o, size - o, "%s", prefix);
+            if (o >= size) { o = size - 1; break; }
+        }
+        out[o++] = *p++;
+    }
+    out[o] = '\0';
+}
+
+/* waits up to `timeout_ms` for data; returns bytes read into buf (0 = none) */
+static ssize_t read_reply(int sock, char *buf, size_t size, int timeout_ms) {
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    if (poll(&pfd, 1, timeout_ms) <= 0) return 0;
+    ssize_t n = recv(sock, buf, size - 1, 0);
+    if (n < 0) n = 0;
+    buf[n] = '\0';
+    return n;
+}
+
+static void drain(int sock, int quiet_ms) {
+    char buf[65536];
+    while (read_reply(sock, buf, sizeof(buf), quiet_ms) > 0)
+        ;
+}
+
+/* lines the server sends unasked: live deliveries "#<id>/<seq> ...",
+ * presence changes, pings and broadcasts */
+static int is_push(const char *line) {
+    if (line[0] == '#') {
+        const char *p = line + 1;
+        while (isdigit((unsigned char)*p)) p++;
+        return p > line + 1 && *p == '/';
+    }
+    return strncmp(line, "PRESENCE ", 9) == 0 || strncmp(line, "PING", 4) == 0 ||
+           strncmp(line, "[Broadcast]", 11) == 0;
+}
+
+/* Reads until the first line that is not a push, which is the reply to
+ * the command sent at `sent`. Leaves that line and whatever followed it
+ * in `reply`. Returns the latency in ms, -1 if no reply came in time. */
+static double await_reply(int sock, char *reply, size_t size, double sent) {
+    size_t len = 0, pos = 0;
+    for (;;) {
+        int left = (int)(sent + REPLY_TIMEOUT_MS - now_ms());
+        if (left <= 0 || len == size - 1) return -1;
+        ssize_t n = read_reply(sock, reply + len, size - len, left);
+        if (n <= 0) return -1;
+        len += (size_t)n;
+        double at = now_ms();
+        char *nl;
+        while ((nl = memchr(reply + pos, '\n', len - pos)) != NULL) {
+            *nl = '\0';
+            int push = is_push(reply + pos);
+            *nl = '\n';
+            if (!push) {
+                memmove(reply, reply + pos, len - pos);
+                reply[len - pos] = '\0';
+                return at - sent;
+            }
+            pos = (size_t)(nl - reply) + 1;
+        }
+    }
+}
+
+static void note_latency(double ms) {
+    pthread_mutex_lock(&stats_lock);
+    if (ms < 0) {
+        noreply++;
+    } else {
+        if (nlat == latcap) {
+            latcap = latcap ? 2 * latcap : 1024;
+            latencies = realloc(latencies, (size_t)latcap * sizeof(double));
+        }
+        latencies[nlat++] = ms;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void *run_session(void *arg) {
+    session_t *s = arg;
+    int sock = -1;
+    char line[2048], reply[65536];
+
+    for (int i = 0; i < s->nrecs; i++) {
+        rec_t *r = &s->recs[i];
+        sleep_until(r->ms);
+        if (r->type == REC_OPEN) {
+            sock = socket(server->ai_family, SOCK_STREAM, 0);
+            if (sock < 0 || connect(sock, server->ai_addr, server->ai_addrlen) < 0) {
+                pthread_mutex_lock(&stats_lock);
+                failed_sessions++;
+                pthread_mutex_unlock(&stats_lock);
+                if (sock >= 0) close(sock);
+                return NULL;
+            }
+            read_reply(sock, reply, sizeof(reply), REPLY_TIMEOUT_MS);
+            rename_users(r->data, line, sizeof(line) - 1);
+            strcat(line, "\n");
+            send(sock, line, strlen(line), MSG_NOSIGNAL);
+            read_reply(sock, reply, sizeof(reply), REPLY_TIMEOUT_MS);
+            drain(sock, LOGIN_QUIET_MS);
+        } else if (r->type == REC_CMD && sock >= 0) {
+            rename_users(r->data, line, sizeof(line) - 1);
+            strcat(line, "\n");
+            double sent = now_ms();
+            send(sock, line, strlen(line), MSG_NOSIGNAL);
+            double ms = await_reply(sock, reply, sizeof(reply), sent);
+            note_latency(ms);
+
+            /* large messages were recorded without payload: send filler */
+            long long size;
+            if (ms >= 0 && sscanf(r->data, "bigchat %*s %lld", &size) == 1 && strstr(reply, "READY")) {
+                char fill[16384];
+                memset(fill, 'x', sizeof(fill));
+                for (long long left = size; left > 0; ) {
+                    size_t k = left < (long long)sizeof(fill) ? (size_t)left : sizeof(fill);
+                    if (send(sock, fill, k, MSG_NOSIGNAL) <= 0) break;
+                    left -= (long long)k;
+                }
+            }
+            drain(sock, DRAIN_QUIET_MS);
+        } else if (r->type == REC_CLOSE && sock >= 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    if (sock >= 0) close(sock);
+    return NULL;
+}
+
+static int by_value(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double pct(double p) {
+    if (nlat == 0) return 0;
+    long i = (long)(p * (nlat - 1));
+    return latencies[i];
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s <capture> <host> <port> [--speed N|max] [--prefix P]\n", argv[0]);
+        return 1;
+    }
+    for (int i = 4; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--speed") == 0)
+            speed = strcmp(argv[i + 1], "max") == 0 ? 0 : atof(argv[i + 1]);
+        else if (strcmp(argv[i], "--prefix") == 0)
+            prefix = argv[i + 1];
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (!load(argv[1])) return 1;
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    int rc = getaddrinfo(argv[2], argv[3], &hints, &server);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", argv[2], gai_strerror(rc));
+        return 1;
+    }
+
+    long ncommands = 0;
+    for (int i = 0; i < nsessions; i++)
+        for (int k = 0; k < sessions[i].nrecs; k++)
+            ncommands += sessions[i].recs[k].type == REC_CMD;
+    if (speed > 0)
+        printf("replaying %d session(s), %ld command(s) at %gx\n", nsessions, ncommands, speed);
+    else
+        printf("replaying %d session(s), %ld command(s) at max speed\n", nsessions, ncommands);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t *tids = calloc((size_t)nsessions, sizeof(pthread_t));
+    for (int i = 0; i < nsessions; i++)
+        pthread_create(&tids[i], NULL, run_session, &sessions[i]);
+    for (int i = 0; i < nsessions; i++)
+        pthread_join(tids[i], NULL);
+    double elapsed = now_ms() / 1000.0;
+
+    qsort(latencies, (size_t)nlat, sizeof(double), by_value);
+    printf("elapsed %.2fs, %ld replies, %.1f commands/s\n",
+           elapsed, nlat, elapsed > 0 ? nlat / elapsed : 0.0);
+    printf("latency ms: p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+           pct(0.50), pct(0.90), pct(0.99), nlat ? latencies[nlat - 1] : 0.0);
+    printf("no reply within %d ms: %ld, sessions not connected: %ld\n",
+           REPLY_TIMEOUT_MS, noreply, failed_sessions);
+    freeaddrinfo(server);
+    return 0;
+}